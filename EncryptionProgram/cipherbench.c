@@ -0,0 +1,288 @@
+/*
+File: cipherbench.c
+Author: Adeline Harcourt
+Description: A microbenchmark for the encode/decode and key kernels in
+		otp_cipher.c. For every instruction set level the CPU supports, it
+		checks that the kernel output matches the scalar loop byte for byte
+		and then reports encode, decode, key, pack and unpack throughput in
+		GB/s (of chars), and the text and key pair scan in GB/s of both
+		inputs together, which should come close to the memcpy rate
+		printed after it.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "otp_proto.h"
+#include "otp_cipher.h"
+
+// Returns the current time in seconds from a monotonic clock
+static double Now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fills a buffer with random capital letters and spaces
+static void RandomText(char *buf, size_t n) {
+	size_t i;
+	int randNum;
+
+	for (i = 0; i < n; i++) {
+		randNum = rand() % 27 + 65;
+		buf[i] = (randNum == 91) ? ' ' : (char)randNum;
+	}
+}
+
+// Checks the current kernels against the scalar reference over every
+// length from 0 to 300 at a few misalignments, then over the whole buffer.
+// Returns 1 if they all match.
+static int MatchesScalar(const char *text, const char *key, const char *refEnc, const char *refDec,
+		char *out, size_t n) {
+	size_t len, offset;
+	int isa = CipherIsa();
+	char small[512];
+
+	for (offset = 0; offset < 4; offset++) {
+		for (len = 0; len <= 300; len++) {
+			EncodeText(out, text + offset, key + offset, len);
+			CipherSetIsa(CIPHER_ISA_SCALAR);
+			EncodeText(small, text + offset, key + offset, len);
+			CipherSetIsa(isa);
+			if (memcmp(out, small, len) != 0) return 0;
+
+			DecodeText(out, text + offset, key + offset, len);
+			CipherSetIsa(CIPHER_ISA_SCALAR);
+			DecodeText(small, text + offset, key + offset, len);
+			CipherSetIsa(isa);
+			if (memcmp(out, small, len) != 0) return 0;
+		}
+	}
+
+	EncodeText(out, text, key, n);
+	if (memcmp(out, refEnc, n) != 0) return 0;
+	DecodeText(out, text, key, n);
+	if (memcmp(out, refDec, n) != 0) return 0;
+	return 1;
+}
+
+// Checks the current key kernel against the scalar one the same way.
+// Returns 1 if they match.
+static int KeyMatchesScalar(const unsigned char *bytes, const char *refKey, size_t refCount,
+		char *out, size_t n) {
+	size_t len, offset, count;
+	int isa = CipherIsa();
+	char small[512];
+
+	for (offset = 0; offset < 4; offset++) {
+		for (len = 0; len <= 300; len++) {
+			count = KeyFromBytes(out, bytes + offset, len);
+			CipherSetIsa(CIPHER_ISA_SCALAR);
+			if (KeyFromBytes(small, bytes + offset, len) != count) count = (size_t)-1;
+			CipherSetIsa(isa);
+			if (count == (size_t)-1 || memcmp(out, small, count) != 0) return 0;
+		}
+	}
+
+	return KeyFromBytes(out, bytes, n) == refCount && memcmp(out, refKey, refCount) == 0;
+}
+
+// Checks the current pack kernels against the scalar ones, and that
+// unpacking in place (from the end of the buffer) gives the text back.
+// Returns 1 if they all match.
+static int PackMatchesScalar(const char *text, const unsigned char *refPacked, char *out, size_t n) {
+	size_t len, offset;
+	int isa = CipherIsa();
+	unsigned char packed[512], small[512];
+	char inPlace[512];
+
+	for (offset = 0; offset < 4; offset++) {
+		for (len = 0; len <= 300; len++) {
+			PackText(packed, text + offset, len);
+			CipherSetIsa(CIPHER_ISA_SCALAR);
+			PackText(small, text + offset, len);
+			CipherSetIsa(isa);
+			if (memcmp(packed, small, PACKED_SIZE(len)) != 0) return 0;
+
+			memcpy(inPlace + len - PACKED_SIZE(len), packed, PACKED_SIZE(len));
+			if (!UnpackText(inPlace, (unsigned char *)inPlace + len - PACKED_SIZE(len), len)) return 0;
+			if (memcmp(inPlace, text + offset, len) != 0) return 0;
+		}
+	}
+
+	PackText((unsigned char *)out, text, n);
+	if (memcmp(out, refPacked, PACKED_SIZE(n)) != 0) return 0;
+	return UnpackText(out, refPacked, n) && memcmp(out, text, n) == 0;
+}
+
+// Checks the current scan kernels against the scalar ones, with a bad
+// char put at the start, middle and end of the text or key for every
+// length up to 300. Returns 1 if they all match.
+static int ScanMatchesScalar(const char *text, const char *key, size_t n) {
+	size_t len, offset, expect;
+	int isa = CipherIsa(), where, inKey;
+	char badText[512], badKey[512];
+
+	for (offset = 0; offset < 4; offset++) {
+		for (len = 0; len <= 300; len++) {
+			for (where = 0; where < 4; where++) {
+				for (inKey = 0; inKey < 2; inKey++) {
+					memcpy(badText, text + offset, len);
+					memcpy(badKey, key + offset, len);
+					expect = where == 0 ? len : where == 1 ? 0 : where == 2 ? len / 2 : len - 1;
+					if (expect < len) (inKey ? badKey : badText)[expect] = where == 3 ? '\n' : '@' + (where == 2 ? 27 : 0);
+
+					CipherSetIsa(CIPHER_ISA_SCALAR);
+					expect = ScanPair(badText, badKey, len);
+					CipherSetIsa(isa);
+					if (ScanPair(badText, badKey, len) != expect) return 0;
+					if (ScanText(inKey ? badKey : badText, len) != expect) return 0;
+				}
+			}
+		}
+	}
+	return ScanPair(text, key, n) == n && ScanText(text, n) == n;
+}
+
+// Runs the pair scan over the buffers repeatedly and returns GB/s of text
+// and key scanned together
+static double ScanThroughput(const char *text, const char *key, size_t n, int iterations) {
+	double start;
+	size_t found = 0;
+	int i;
+
+	ScanPair(text, key, n);
+	start = Now();
+	for (i = 0; i < iterations; i++) found += ScanPair(text, key, n);
+	if (found != n * iterations) return 0;
+	return 2.0 * n * iterations / (Now() - start) / 1e9;
+}
+
+// Copies the text repeatedly and returns GB/s copied, as a yardstick for
+// the scan
+static double CopyThroughput(char *out, const char *text, size_t n, int iterations) {
+	double start;
+	int i;
+
+	memcpy(out, text, n);
+	start = Now();
+	for (i = 0; i < iterations; i++) {
+		memcpy(out, text, n);
+		__asm__ volatile("" : : "r"(out) : "memory"); // Keep every copy
+	}
+	return (double)n * iterations / (Now() - start) / 1e9;
+}
+
+// Runs the pack and unpack kernels over the buffer repeatedly and returns
+// GB/s of chars for each
+static void PackThroughput(char *out, const char *text, unsigned char *packed, size_t n, int iterations,
+		double *packRate, double *unpackRate) {
+	double start;
+	int i;
+
+	PackText(packed, text, n);
+	start = Now();
+	for (i = 0; i < iterations; i++) PackText(packed, text, n);
+	*packRate = (double)n * iterations / (Now() - start) / 1e9;
+
+	UnpackText(out, packed, n);
+	start = Now();
+	for (i = 0; i < iterations; i++) UnpackText(out, packed, n);
+	*unpackRate = (double)n * iterations / (Now() - start) / 1e9;
+}
+
+// Runs the key kernel over the buffer repeatedly and returns GB/s of random
+// bytes consumed
+static double KeyThroughput(char *out, const unsigned char *bytes, size_t n, int iterations) {
+	double start, elapsed;
+	int i;
+
+	KeyFromBytes(out, bytes, n);
+	start = Now();
+	for (i = 0; i < iterations; i++) KeyFromBytes(out, bytes, n);
+	elapsed = Now() - start;
+	return (double)n * iterations / elapsed / 1e9;
+}
+
+// Runs a kernel over the buffer repeatedly and returns GB/s of text processed
+static double Throughput(void (*kernel)(char *, const char *, const char *, size_t),
+		char *out, const char *text, const char *key, size_t n, int iterations) {
+	double start, elapsed;
+	int i;
+
+	kernel(out, text, key, n); // Warm up caches and page in the output
+	start = Now();
+	for (i = 0; i < iterations; i++) kernel(out, text, key, n);
+	elapsed = Now() - start;
+	return (double)n * iterations / elapsed / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+	size_t n = 16 << 20, i, refCount;
+	int iterations = 20, isa, best = CipherBestIsa(), failed = 0;
+	char *text, *key, *out, *refEnc, *refDec, *refKey;
+	unsigned char *bytes, *refPacked, *packed;
+	double packRate, unpackRate;
+
+	// Check user input format
+	if (argc > 1) n = (size_t)atol(argv[1]) << 10;
+	if (argc > 2) iterations = atoi(argv[2]);
+	if (argc > 3 || n == 0 || iterations < 1) {
+		fprintf(stderr, "USAGE: %s [kilobytes] [iterations]\n", argv[0]);
+		exit(1);
+	}
+
+	// Create random text and key, and the scalar results to compare against
+	text = malloc(n);
+	key = malloc(n);
+	out = malloc(n);
+	refEnc = malloc(n);
+	refDec = malloc(n);
+	refKey = malloc(n);
+	bytes = malloc(n);
+	refPacked = malloc(PACKED_SIZE(n));
+	packed = malloc(PACKED_SIZE(n));
+	if (!text || !key || !out || !refEnc || !refDec || !refKey || !bytes || !refPacked || !packed) {
+		fprintf(stderr, "ERROR: could not allocate %zu byte buffers\n", n);
+		exit(1);
+	}
+	srand(1);
+	RandomText(text, n);
+	RandomText(key, n);
+	for (i = 0; i < n; i++) bytes[i] = rand() & 0xFF;
+	CipherSetIsa(CIPHER_ISA_SCALAR);
+	EncodeText(refEnc, text, key, n);
+	DecodeText(refDec, text, key, n);
+	refCount = KeyFromBytes(refKey, bytes, n);
+	PackText(refPacked, text, n);
+
+	printf("%-10s %12s %12s %12s %12s %12s %12s  (%zu KiB x %d)\n", "isa", "encode GB/s", "decode GB/s", "key GB/s",
+		"pack GB/s", "unpack GB/s", "scan GB/s", n >> 10, iterations);
+	for (isa = CIPHER_ISA_SCALAR; isa <= best; isa++) {
+		CipherSetIsa(isa);
+		if (!MatchesScalar(text, key, refEnc, refDec, out, n) || !KeyMatchesScalar(bytes, refKey, refCount, out, n) ||
+				!PackMatchesScalar(text, refPacked, out, n) || !ScanMatchesScalar(text, key, n)) {
+			printf("%-10s output differs from scalar\n", CipherIsaName(isa));
+			failed = 1;
+			continue;
+		}
+		PackThroughput(out, text, packed, n, iterations, &packRate, &unpackRate);
+		printf("%-10s %12.2f %12.2f %12.2f %12.2f %12.2f %12.2f\n", CipherIsaName(isa),
+			Throughput(EncodeText, out, text, key, n, iterations),
+			Throughput(DecodeText, out, text, key, n, iterations),
+			KeyThroughput(out, bytes, n, iterations), packRate, unpackRate,
+			ScanThroughput(text, key, n, iterations));
+	}
+	printf("%-10s %77.2f\n", "memcpy", CopyThroughput(out, text, n, iterations));
+
+	free(text);
+	free(key);
+	free(out);
+	free(refEnc);
+	free(refDec);
+	free(refKey);
+	free(bytes);
+	free(refPacked);
+	free(packed);
+	return failed;
+}
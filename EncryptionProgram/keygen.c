@@ -3,40 +3,211 @@ File: keygen.c
 Author: Adeline Harcourt 
 Description: A program that generates a one-time pad key text file
 		of a specified length filled with random uppercase letters 
-		and space characters.
+		and space characters. The letters come from a ChaCha20
+		generator seeded by the kernel (see otp_random.c) and are
+		written a large buffer at a time. With --out the key goes
+		straight into a preallocated file instead of stdout, and
+		--threads fills it with several threads, each writing its own
+		chunks from its own separately seeded generator.
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "otp_random.h"
+
+// Key chars generated per write, and per chunk of an --out file
+#define KEYGEN_BUFFER (1 << 20)
+
+// Most threads --threads accepts
+#define MAX_THREADS 256
+
+// An --out file being filled. Threads take the next chunk from nextChunk.
+struct KeyFile {
+	int fd;
+	long long length;
+	long long nextChunk;
+};
+
+// Writes all n bytes of buffer to stdout
+static void WriteAll(const char *buffer, size_t n) {
+	ssize_t written;
+
+	while (n > 0) {
+		written = write(STDOUT_FILENO, buffer, n);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			perror("keygen: write");
+			exit(1);
+		}
+		buffer += written;
+		n -= written;
+	}
+}
  
+// Writes all n bytes of buffer to fd at offset
+static void PWriteAll(int fd, const char *buffer, size_t n, off_t offset) {
+	ssize_t written;
+
+	while (n > 0) {
+		written = pwrite(fd, buffer, n, offset);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			perror("keygen: write");
+			exit(1);
+		}
+		buffer += written;
+		offset += written;
+		n -= written;
+	}
+}
+
+// Thread body: fills chunks of the file until there are none left
+static void *FillChunks(void *arg) {
+	struct KeyFile *file = arg;
+	struct RandomStream *random = malloc(sizeof(struct RandomStream));
+	char *buffer = malloc(KEYGEN_BUFFER);
+	unsigned char seed[RANDOM_SEED_SIZE];
+	long long chunk, offset;
+	size_t n;
+
+	if (random == NULL || buffer == NULL) {
+		fprintf(stderr, "keygen: could not allocate buffers\n");
+		exit(1);
+	}
+	RandomSeed(seed);
+	RandomInit(random, seed, 0);
+
+	for (;;) {
+		chunk = __atomic_fetch_add(&file->nextChunk, 1, __ATOMIC_RELAXED);
+		offset = chunk * KEYGEN_BUFFER;
+		if (offset >= file->length) break;
+
+		n = file->length - offset < KEYGEN_BUFFER ? (size_t)(file->length - offset) : KEYGEN_BUFFER;
+		RandomKey(random, buffer, n);
+		PWriteAll(file->fd, buffer, n, offset);
+	}
+
+	free(random);
+	free(buffer);
+	return NULL;
+}
+
+// Writes a key of keylength chars and a newline to path, using threads
+// threads
+static void WriteKeyFile(const char *path, long long keylength, int threads) {
+	struct KeyFile file = {0};
+	pthread_t ids[MAX_THREADS];
+	int i, err;
+
+	// Key files are secret, so only the owner can read them
+	file.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (file.fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	file.length = keylength;
+
+	// Reserve the space up front so a full disk fails now rather than part
+	// way through, and the threads never extend the file. Not every file
+	// system can, so fall back to setting the size.
+	if (fallocate(file.fd, 0, 0, keylength + 1) < 0) {
+		if (errno != EOPNOTSUPP && errno != ENOSYS) {
+			perror("keygen: fallocate");
+			exit(1);
+		}
+		if (ftruncate(file.fd, keylength + 1) < 0) {
+			perror("keygen: ftruncate");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < threads; i++) {
+		err = pthread_create(&ids[i], NULL, FillChunks, &file);
+		if (err != 0) {
+			fprintf(stderr, "keygen: could not start thread %d\n", i);
+			exit(1);
+		}
+	}
+	for (i = 0; i < threads; i++) pthread_join(ids[i], NULL);
+
+	// Add newline char
+	PWriteAll(file.fd, "\n", 1, keylength);
+	if (close(file.fd) < 0) {
+		perror(path);
+		exit(1);
+	}
+}
+
 int main(int argc, char *argv[]) {
-	int i, randNum, keylength;
-	srand(time(NULL));
+	static const struct option options[] = {
+		{ "threads", required_argument, NULL, 't' },
+		{ "out", required_argument, NULL, 'o' },
+		{ NULL, 0, NULL, 0 }
+	};
+	static struct RandomStream random;
+	static char buffer[KEYGEN_BUFFER + 1];
+	unsigned char seed[RANDOM_SEED_SIZE];
+	long long keylength;
+	long cpus;
+	size_t chunk;
+	char *end, *path = NULL;
+	int opt, threads = 1;
+
+	while ((opt = getopt_long(argc, argv, "t:o:", options, NULL)) != -1) {
+		switch (opt) {
+			case 't':
+				// 0 means one thread per CPU
+				threads = atoi(optarg);
+				if (threads == 0) {
+					cpus = sysconf(_SC_NPROCESSORS_ONLN);
+					threads = cpus > 0 ? (int)cpus : 1;
+				}
+				break;
+			case 'o':
+				path = optarg;
+				break;
+			default:
+				threads = -1;
+				break;
+		}
+	}
 
 	// Check user input format
-	if (argc < 2) { 
-		fprintf(stderr,"USAGE: %s keylength\n", argv[0]); 
+	if (optind >= argc || threads < 1 || threads > MAX_THREADS || (threads > 1 && path == NULL)) { 
+		fprintf(stderr,"USAGE: %s [--threads N] [--out file] keylength\n", argv[0]); 
+		fprintf(stderr,"       --threads needs --out; 0 threads means one per CPU\n"); 
 		exit(0); 
 	} 
 	
 	// Get length of key to be generated
-	keylength = atoi(argv[1]);	
-
-	// Generate random key and print to stdout
-	for (i = 0; i < keylength; i++) {
-		randNum = rand() % 27 + 65;
-		
-		// replace 91 with spaces
-		if (randNum == 91) {
-			printf(" ");
-		}
-		else {
-			printf("%c", (char)randNum);
-		}
+	keylength = strtoll(argv[optind], &end, 10);
+	if (end == argv[optind] || *end != '\0' || keylength < 0) {
+		fprintf(stderr, "keygen: bad key length %s\n", argv[optind]);
+		exit(1);
 	}
-	
-	// Add newline char
-	printf("\n");
+
+	if (path != NULL) {
+		WriteKeyFile(path, keylength, threads);
+		return 0;
+	}
+
+	RandomSeed(seed);
+	RandomInit(&random, seed, 0);
+
+	// Generate random key and write it to stdout, adding the newline
+	// to the last chunk
+	do {
+		chunk = keylength < KEYGEN_BUFFER ? (size_t)keylength : KEYGEN_BUFFER;
+		RandomKey(&random, buffer, chunk);
+		keylength -= chunk;
+		if (keylength == 0) buffer[chunk++] = '\n';
+		WriteAll(buffer, chunk);
+	} while (keylength > 0);
 	
 	return 0;
 }
@@ -0,0 +1,141 @@
+/*
+File: otp.h
+Author: Adeline Harcourt
+Description: The libotp interface, for programs that want to encode and
+		decode without running otp_enc or otp_dec. Texts and keys are
+		capital letters and spaces, the same as for the clients, and
+		nothing is NUL terminated: every call takes a length.
+		  OtpEncode / OtpDecode - cipher a buffer in this process
+		  OtpCipherBatch        - the same for a vector of jobs
+		  OtpConnect ...        - an asynchronous client that pipelines
+		                          many messages over one framed daemon
+		                          connection and reports each through a
+		                          completion callback
+		  OtpPoolOpen ...       - the same over a pool of connections to
+		                          several daemons, each message sent to
+		                          the least loaded and moved to another
+		                          daemon if its own fails
+		Link with libotp.a (built by compileall).
+*/
+#ifndef OTP_H
+#define OTP_H
+
+#include <stddef.h>
+#include "otp_proto.h"
+
+// Results. STATUS_OK and the other STATUS_ codes in otp_proto.h are passed
+// on from the daemon; the library's own failures are negative.
+#define OTP_ERR_TEXT    -1	// Text holds something other than capital letters and spaces
+#define OTP_ERR_KEY     -2	// So does the key
+#define OTP_ERR_CONNECT -3	// Could not connect, or the handshake was refused
+#define OTP_ERR_BUSY    -4	// Handshake answered ID_BUSY
+#define OTP_ERR_IO      -5	// Connection failed or was closed mid-message
+#define OTP_ERR_CLOSED  -6	// OtpClose was called before the reply came
+#define OTP_ERR_NOMEM   -7
+
+// Encodes or decodes n chars. out may be the same buffer as the text or
+// key. Returns STATUS_OK, or OTP_ERR_TEXT / OTP_ERR_KEY, in which case out
+// holds an undefined prefix of the result.
+int OtpEncode(const char *plainText, const char *key, char *out, size_t n);
+int OtpDecode(const char *cipherText, const char *key, char *out, size_t n);
+
+// One job for OtpCipherBatch: op is OP_ENCODE or OP_DECODE, and status is
+// set to what OtpEncode or OtpDecode would return
+struct OtpJob {
+	char op;
+	const char *text, *key;
+	char *out;
+	size_t n;
+	int status;
+};
+
+// Runs count jobs and returns the number that failed
+size_t OtpCipherBatch(struct OtpJob *jobs, size_t count);
+
+// Asynchronous client. Callbacks run from OtpPoll, OtpDrain or OtpClose,
+// in the order messages were submitted. out holds the result when status
+// is STATUS_OK.
+struct OtpClient;
+typedef void (*OtpDone)(void *arg, int status, char *out, size_t n);
+
+// Connects to a daemon on localhost, using the framed handshake for op
+// (otp_d serves both ops on either). Returns STATUS_OK or an OTP_ERR_ code.
+int OtpConnect(struct OtpClient **client, int port, char op);
+
+// The same for a daemon at endpoint: a port on localhost, "host:port",
+// "[IPv6 address]:port" or the path of a Unix socket
+int OtpConnectTo(struct OtpClient **client, const char *endpoint, char op);
+
+// Queues a message. The text, key and out buffers belong to the client
+// until the callback runs. Returns STATUS_OK, or an OTP_ERR_ code without
+// calling the callback.
+int OtpSubmit(struct OtpClient *client, char op, const char *text, const char *key, char *out, size_t n,
+	OtpDone done, void *arg);
+
+// For callers with their own event loop: the socket and the poll events
+// the client is waiting for. Call OtpPoll with a timeout of 0 when they
+// come.
+int OtpClientFD(const struct OtpClient *client);
+short OtpClientEvents(const struct OtpClient *client);
+
+// Sends and receives what the socket allows within timeoutMs (-1 waits for
+// progress), running callbacks as replies finish. Returns the number of
+// messages finished, or OTP_ERR_IO once the connection has failed (every
+// outstanding message is then finished with an error).
+int OtpPoll(struct OtpClient *client, int timeoutMs);
+
+// Waits for every submitted message to finish. Returns STATUS_OK or
+// OTP_ERR_IO.
+int OtpDrain(struct OtpClient *client);
+
+// Messages submitted and not yet finished
+size_t OtpPending(const struct OtpClient *client);
+
+// Finishes outstanding messages with OTP_ERR_CLOSED, closes the connection
+// and frees the client
+void OtpClose(struct OtpClient *client);
+
+// Connection pool. Messages submitted to a pool go to whichever daemon of
+// a list the balance rule picks, on that daemon's least loaded connection.
+// A daemon that cannot be connected to is set aside for a while (longer
+// each time it fails in a row) and then tried again. Messages cut off by a
+// failed or closed connection are sent again elsewhere, up to
+// OTP_POOL_TRIES times in all, before finishing with OTP_ERR_IO.
+// Callbacks run from OtpPoolPoll, OtpPoolDrain or OtpPoolClose; across
+// daemons they may run out of submission order.
+struct OtpPool;
+
+#define OTP_BALANCE_LEAST 0	// Daemon with the fewest messages outstanding
+#define OTP_BALANCE_TWO   1	// The less loaded of two daemons picked at random
+
+#define OTP_POOL_TRIES 3
+
+// Opens perDaemon connections to each daemon in endpoints, a comma
+// separated list of endpoints as for OtpConnectTo, using the framed
+// handshake for op. Daemons that cannot be reached are set aside. Returns
+// STATUS_OK, or the OTP_ERR_ code of the last failure if none could be.
+int OtpPoolOpen(struct OtpPool **pool, const char *endpoints, int perDaemon, int balance, char op);
+
+// Queues a message on a daemon's connection, as OtpSubmit does. Returns
+// STATUS_OK, or an OTP_ERR_ code without calling the callback
+// (OTP_ERR_CONNECT once every daemon is set aside).
+int OtpPoolSubmit(struct OtpPool *pool, char op, const char *text, const char *key, char *out, size_t n,
+	OtpDone done, void *arg);
+
+// Moves every connection along as OtpPoll does, waiting up to timeoutMs
+// for any of them. Returns the number of messages finished.
+int OtpPoolPoll(struct OtpPool *pool, int timeoutMs);
+
+// Waits for every submitted message to finish. Returns STATUS_OK or
+// OTP_ERR_IO.
+int OtpPoolDrain(struct OtpPool *pool);
+
+// Messages submitted and not yet finished, and daemons not set aside
+size_t OtpPoolPending(const struct OtpPool *pool);
+int OtpPoolHealthy(const struct OtpPool *pool);
+
+// Finishes outstanding messages with OTP_ERR_CLOSED, closes every
+// connection and frees the pool
+void OtpPoolClose(struct OtpPool *pool);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+File: otp_admit.c
+Author: Adeline Harcourt
+Description: Admission control for the otp daemons. The limits are on
+		concurrent requests (-c), on text and key bytes held by admitted
+		requests (-i) and on message size (-m). They are checked once a
+		request's size is known, before its text is read. A
+		request over the request or byte limit waits up to the queue
+		timeout (-q, in milliseconds) for room. With a timeout of 0 it is
+		turned away at once. The counters live in memory shared by every
+		shard and forked child, so the limits hold for the whole daemon.
+		They are taken with atomic adds that are undone when over the
+		limit, so no lock is needed. Forked children wait on a futex. The
+		epoll and io_uring engines park waiting connections and retry
+		them as requests finish.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include "otp_server.h"
+
+// Returns the current time in milliseconds from a monotonic clock. The
+// deadlines in otp_server.c are kept in it too.
+long long NowMs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Sets up the shared counters. Called once before any shard or child is
+// forked.
+void OpenAdmission(struct ServerConfig *config) {
+	struct Admission *admission;
+
+	admission = mmap(NULL, sizeof(struct Admission), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (admission == MAP_FAILED) error("could not allocate admission counters", 1);
+	memset(admission, '\0', sizeof(*admission));
+	config->admission = admission;
+}
+
+// Text and key bytes a request holds while admitted
+static unsigned long RequestBytes(struct Conn *conn) {
+	return 2 * (unsigned long)conn->length;
+}
+
+// Takes a request slot and the request's bytes if both are free. A request
+// larger than the whole byte limit still gets in when nothing else is held,
+// so it is not starved. Returns 1 if admitted.
+static int TakeRoom(struct ServerConfig *config, struct Conn *conn) {
+	struct Admission *admission = config->admission;
+	unsigned long need = RequestBytes(conn), held;
+	int active;
+
+	active = __atomic_add_fetch(&admission->active, 1, __ATOMIC_ACQ_REL);
+	if (config->maxRequests > 0 && active > config->maxRequests) {
+		__atomic_sub_fetch(&admission->active, 1, __ATOMIC_RELEASE);
+		return 0;
+	}
+	held = __atomic_add_fetch(&admission->bytes, need, __ATOMIC_ACQ_REL);
+	if (config->maxBytes > 0 && held > config->maxBytes && held != need) {
+		__atomic_sub_fetch(&admission->bytes, need, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&admission->active, 1, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	conn->admitBytes = need;
+	conn->holding = admission;
+	__atomic_fetch_add(&admission->admitted, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+// Takes a waiting request off the queue count
+static void LeaveQueue(struct Admission *admission) {
+	__atomic_sub_fetch(&admission->queued, 1, __ATOMIC_RELAXED);
+}
+
+// First admission attempt for a request whose size (conn->length, plus
+// message chars already admitted for framed messages) is known. Returns
+// STATUS_OK if admitted, ADMIT_WAIT if it should wait for room, or the
+// STATUS_ code to turn it away with.
+int AdmitRequest(struct ServerConfig *config, struct Conn *conn, unsigned long messageChars) {
+	struct Admission *admission = config->admission;
+	unsigned long limit;
+
+	// An original protocol message is buffered whole, so it has a limit
+	// even when -m is not given
+	limit = conn->state == CONN_LENGTH ? config->legacyMax : config->maxSize;
+	if (limit > 0 && messageChars > limit) {
+		__atomic_fetch_add(&admission->rejectedSize, 1, __ATOMIC_RELAXED);
+		return STATUS_OVER_SIZE;
+	}
+	if (TakeRoom(config, conn)) return STATUS_OK;
+	if (config->queueTimeout <= 0) {
+		__atomic_fetch_add(&admission->rejectedBusy, 1, __ATOMIC_RELAXED);
+		return STATUS_BUSY;
+	}
+
+	conn->admitDeadline = NowMs() + config->queueTimeout;
+	__atomic_fetch_add(&admission->queued, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&admission->waited, 1, __ATOMIC_RELAXED);
+	return ADMIT_WAIT;
+}
+
+// Tries again for a waiting request. Returns STATUS_OK, ADMIT_WAIT, or
+// STATUS_BUSY once its wait has run out.
+int AdmitRetry(struct ServerConfig *config, struct Conn *conn) {
+	struct Admission *admission = config->admission;
+
+	if (TakeRoom(config, conn)) {
+		LeaveQueue(admission);
+		return STATUS_OK;
+	}
+	if (NowMs() < conn->admitDeadline) return ADMIT_WAIT;
+
+	LeaveQueue(admission);
+	__atomic_fetch_add(&admission->timedOut, 1, __ATOMIC_RELAXED);
+	return STATUS_BUSY;
+}
+
+// Blocks until a waiting request is admitted or its wait runs out. Used by
+// the fork engine's children. Returns STATUS_OK or STATUS_BUSY.
+int AdmitWait(struct ServerConfig *config, struct Conn *conn) {
+	struct Admission *admission = config->admission;
+	struct timespec wait;
+	uint32_t seen;
+	long long left;
+	int status;
+
+	while (1) {
+		// Note the wakeup count first, so a release that lands between the
+		// retry and the wait is not missed
+		seen = __atomic_load_n(&admission->wakeups, __ATOMIC_ACQUIRE);
+		status = AdmitRetry(config, conn);
+		if (status != ADMIT_WAIT) return status;
+
+		left = conn->admitDeadline - NowMs();
+		if (left <= 0) continue;
+		wait.tv_sec = left / 1000;
+		wait.tv_nsec = (left % 1000) * 1000000;
+		__atomic_add_fetch(&admission->sleepers, 1, __ATOMIC_ACQ_REL);
+		syscall(SYS_futex, &admission->wakeups, FUTEX_WAIT, seen, &wait, NULL, 0);
+		__atomic_sub_fetch(&admission->sleepers, 1, __ATOMIC_ACQ_REL);
+	}
+}
+
+// Gives back the room held by a connection's admitted request, waking any
+// forked children waiting for it
+void AdmitRelease(struct Conn *conn) {
+	struct Admission *admission = conn->holding;
+
+	if (admission == NULL) return;
+	__atomic_sub_fetch(&admission->bytes, conn->admitBytes, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&admission->active, 1, __ATOMIC_RELEASE);
+	conn->holding = NULL;
+	conn->admitBytes = 0;
+
+	if (__atomic_load_n(&admission->sleepers, __ATOMIC_ACQUIRE) > 0) {
+		__atomic_add_fetch(&admission->wakeups, 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &admission->wakeups, FUTEX_WAKE, 0x7fffffff, NULL, NULL, 0);
+	}
+}
+
+// Checks in the handshake whether an original protocol client should be
+// turned away, since that protocol has no way to say so later. Only done
+// when over-limit requests are not queued. Returns 1 (and counts the
+// client as turned away) if the daemon is full.
+int AdmitHandshake(struct ServerConfig *config) {
+	struct Admission *admission = config->admission;
+	int full;
+
+	if (config->queueTimeout > 0) return 0;
+	full = (config->maxRequests > 0 && __atomic_load_n(&admission->active, __ATOMIC_RELAXED) >= config->maxRequests) ||
+		(config->maxBytes > 0 && __atomic_load_n(&admission->bytes, __ATOMIC_RELAXED) >= config->maxBytes);
+	if (full) __atomic_fetch_add(&admission->rejectedBusy, 1, __ATOMIC_RELAXED);
+	return full;
+}
+
+// Prints the admission counters
+void PrintAdmission(struct ServerConfig *config, FILE *out) {
+	struct Admission *admission = config->admission;
+
+	fprintf(out, "  admission: %d active, %lu bytes held, %d queued; %lu admitted, %lu waited, "
+		"%lu timed out, %lu turned away busy, %lu over size\n",
+		__atomic_load_n(&admission->active, __ATOMIC_RELAXED),
+		__atomic_load_n(&admission->bytes, __ATOMIC_RELAXED),
+		__atomic_load_n(&admission->queued, __ATOMIC_RELAXED),
+		__atomic_load_n(&admission->admitted, __ATOMIC_RELAXED),
+		__atomic_load_n(&admission->waited, __ATOMIC_RELAXED),
+		__atomic_load_n(&admission->timedOut, __ATOMIC_RELAXED),
+		__atomic_load_n(&admission->rejectedBusy, __ATOMIC_RELAXED),
+		__atomic_load_n(&admission->rejectedSize, __ATOMIC_RELAXED));
+}
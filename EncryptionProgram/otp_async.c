@@ -0,0 +1,421 @@
+/*
+File: otp_async.c
+Author: Adeline Harcourt
+Description: The asynchronous client half of libotp. Messages submitted to
+		an OtpClient are queued and sent back to back as frames on one
+		non-blocking connection to the daemon, without waiting for
+		earlier replies. The daemon answers messages in the order they
+		came, so replies are matched to the queue head, read straight
+		into the caller's output buffer, and each message's callback runs
+		once its last frame is in. Frames are written with sendmsg
+		straight from the caller's text and key buffers, many at a time.
+		A frame that comes back with an error status ends the connection
+		(the daemon hangs up after it), so every later message finishes
+		with OTP_ERR_IO.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include "otp.h"
+#include "otp_cipher.h"
+#include "otp_net.h"
+
+#define SEND_FRAMES 64		// Frames handed to one sendmsg call
+
+// Longest a connect, and then the handshake, may take, so a host that has
+// gone away is given up on rather than waited out
+#define CONNECT_MS 2000
+
+// One submitted message
+struct Request {
+	char op;
+	const char *text, *key;
+	char *out;
+	size_t n;
+	OtpDone done;
+	void *arg;
+	struct Request *next;
+};
+
+struct OtpClient {
+	int fd;
+	int failed;					// Connection unusable; submits are refused
+	struct Request *head, *tail;	// Outstanding messages, oldest first
+	struct Request *freeList;		// Finished requests kept for reuse
+	size_t pending;
+
+	// Send cursor: the first message not wholly sent, the text offset of
+	// its frame being sent, which part of that frame (header, text, key)
+	// and how much of the part is out
+	struct Request *sending;
+	size_t sendOffset, partDone;
+	int sendPart;
+	unsigned char headers[SEND_FRAMES][FRAME_HEADER_SIZE];
+
+	// Receive cursor: the reply header being read, chars of the head
+	// message's result in so far, and what is left of the current frame
+	unsigned char reply[FRAME_HEADER_SIZE];
+	size_t replyDone, recvOffset, chunkLeft;
+	int chunkLast;
+};
+
+// Chars in the frame of a message that starts at offset
+static size_t FrameChars(const struct Request *req, size_t offset) {
+	return req->n - offset < STREAM_CHUNK_SIZE ? req->n - offset : STREAM_CHUNK_SIZE;
+}
+
+// Bytes in one part of the frame at the send cursor
+static size_t PartLength(const struct OtpClient *client) {
+	return client->sendPart == 0 ? FRAME_HEADER_SIZE : FrameChars(client->sending, client->sendOffset);
+}
+
+// Moves the send cursor past a whole part, on to the next frame or message
+static void NextPart(struct OtpClient *client) {
+	client->partDone = 0;
+	if (++client->sendPart < 3) return;
+	client->sendPart = 0;
+	client->sendOffset += FrameChars(client->sending, client->sendOffset);
+	if (client->sendOffset >= client->sending->n) {
+		client->sending = client->sending->next;
+		client->sendOffset = 0;
+	}
+}
+
+// Runs the callback for the head message and recycles it
+static void Finish(struct OtpClient *client, int status) {
+	struct Request *req = client->head;
+
+	client->head = req->next;
+	if (client->head == NULL) client->tail = NULL;
+	if (client->sending == req) client->sending = client->head;
+	client->pending--;
+	client->recvOffset = 0;
+	req->next = client->freeList;
+	client->freeList = req;
+	req->done(req->arg, status, req->out, req->n);
+}
+
+// Marks the connection failed and finishes everything outstanding, the
+// head message with status and the rest with rest
+static void FailAll(struct OtpClient *client, int status, int rest) {
+	client->failed = 1;
+	client->sending = NULL;
+	if (client->head != NULL) Finish(client, status);
+	while (client->head != NULL) Finish(client, rest);
+}
+
+// Sends as many frames as the socket takes. Returns 0, or -1 if the
+// connection failed.
+static int PumpSend(struct OtpClient *client) {
+	struct iovec iov[3 * SEND_FRAMES];
+	struct msghdr msg;
+	struct FrameHeader header;
+	struct Request *req;
+	size_t offset, done, chunk, len;
+	int part, frame, count;
+	ssize_t tempChars;
+
+	while (client->sending != NULL) {
+		// Lay out frames from the cursor on, skipping empty parts
+		req = client->sending;
+		offset = client->sendOffset;
+		part = client->sendPart;
+		done = client->partDone;
+		for (frame = count = 0; req != NULL && frame < SEND_FRAMES; frame++) {
+			chunk = FrameChars(req, offset);
+			for (; part < 3; part++, done = 0) {
+				if (part == 0) {
+					header.op = req->op;
+					header.flags = (offset + chunk == req->n) ? FRAME_LAST : 0;
+					header.status = STATUS_OK;
+					header.length = chunk;
+					PackFrameHeader(client->headers[frame], &header);
+					iov[count].iov_base = client->headers[frame] + done;
+					len = FRAME_HEADER_SIZE - done;
+				}
+				else {
+					iov[count].iov_base = (char *)(part == 1 ? req->text : req->key) + offset + done;
+					len = chunk - done;
+				}
+				iov[count].iov_len = len;
+				if (len > 0) count++;
+			}
+			part = 0;
+			offset += chunk;
+			if (offset >= req->n) {
+				req = req->next;
+				offset = 0;
+			}
+		}
+
+		memset(&msg, '\0', sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		tempChars = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+		if (tempChars < 0 && errno == EINTR) continue;
+		if (tempChars < 0 && errno == EAGAIN) return 0;
+		if (tempChars < 0) return -1;
+
+		// Move the cursor past what went out
+		while (client->sending != NULL) {
+			len = PartLength(client) - client->partDone;
+			if ((size_t)tempChars < len) {
+				client->partDone += tempChars;
+				break;
+			}
+			tempChars -= len;
+			NextPart(client);
+		}
+	}
+	return 0;
+}
+
+// Reads whatever replies have arrived, finishing messages as they complete.
+// Returns the number finished, or -1 if the connection failed.
+static int PumpReceive(struct OtpClient *client) {
+	struct FrameHeader header;
+	struct Request *req;
+	ssize_t tempChars;
+	int finished = 0;
+
+	while ((req = client->head) != NULL && !client->failed) {
+		// Reply frame header
+		if (client->replyDone < FRAME_HEADER_SIZE) {
+			tempChars = recv(client->fd, client->reply + client->replyDone, FRAME_HEADER_SIZE - client->replyDone, 0);
+			if (tempChars < 0 && errno == EINTR) continue;
+			if (tempChars < 0 && errno == EAGAIN) break;
+			if (tempChars <= 0) return -1;
+			client->replyDone += tempChars;
+			if (client->replyDone < FRAME_HEADER_SIZE) continue;
+
+			UnpackFrameHeader(client->reply, &header);
+			if (header.status != STATUS_OK) {
+				FailAll(client, header.status, OTP_ERR_IO);
+				return finished + 1;
+			}
+			if (header.length > req->n - client->recvOffset) return -1;
+			client->chunkLeft = header.length;
+			client->chunkLast = header.flags & FRAME_LAST;
+		}
+
+		// Its chars, straight into the caller's buffer
+		if (client->chunkLeft > 0) {
+			tempChars = recv(client->fd, req->out + client->recvOffset, client->chunkLeft, 0);
+			if (tempChars < 0 && errno == EINTR) continue;
+			if (tempChars < 0 && errno == EAGAIN) break;
+			if (tempChars <= 0) return -1;
+			client->recvOffset += tempChars;
+			client->chunkLeft -= tempChars;
+			if (client->chunkLeft > 0) continue;
+		}
+
+		client->replyDone = 0;
+		if (client->chunkLast) {
+			if (client->recvOffset != req->n) return -1;
+			Finish(client, STATUS_OK);
+			finished++;
+		}
+	}
+	return finished;
+}
+
+// Opens a socket to endpoint and connects it, trying each address the
+// host resolves to. Returns the socket, or -1.
+static int OpenEndpoint(const char *endpoint) {
+	struct sockaddr_un unixAddress;
+	struct addrinfo *addresses, *address;
+	struct NetTuning tuning = { .noDelay = 1 }; // As otp_enc and otp_dec do
+	struct timeval limit = { CONNECT_MS / 1000, CONNECT_MS % 1000 * 1000 };
+	char host[NET_HOST_SIZE];
+	const char *port, *failure;
+	int fd = -1;
+
+	if (strchr(endpoint, '/') != NULL) {
+		memset(&unixAddress, '\0', sizeof(unixAddress));
+		unixAddress.sun_family = AF_UNIX;
+		if (strlen(endpoint) >= sizeof(unixAddress.sun_path)) return -1;
+		strcpy(unixAddress.sun_path, endpoint);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *)&unixAddress, sizeof(unixAddress)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+		return fd;
+	}
+
+	if (SplitEndpoint(endpoint, host, sizeof(host), &port) < 0) return -1;
+	addresses = ResolveEndpoint(host[0] != '\0' ? host : NET_DEFAULT_HOST, port, 0, &failure);
+	if (addresses == NULL) return -1;
+	for (address = addresses; address != NULL; address = address->ai_next) {
+		fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+		if (fd < 0) continue;
+		TuneSocket(fd, &tuning);
+
+		// The send timeout bounds connect, and the receive timeout the
+		// handshake after it
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+		if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+	return fd;
+}
+
+int OtpConnect(struct OtpClient **client, int port, char op) {
+	char endpoint[16];
+
+	snprintf(endpoint, sizeof(endpoint), "%d", port);
+	return OtpConnectTo(client, endpoint, op);
+}
+
+int OtpConnectTo(struct OtpClient **client, const char *endpoint, char op) {
+	struct OtpClient *c;
+	char answer[2];
+	size_t charsRead = 0;
+	ssize_t tempChars;
+
+	c = calloc(1, sizeof(struct OtpClient));
+	if (c == NULL) return OTP_ERR_NOMEM;
+
+	c->fd = OpenEndpoint(endpoint);
+	if (c->fd < 0) goto refused;
+
+	// Handshake, then everything after it is non-blocking
+	if (send(c->fd, op == OP_DECODE ? ID_DECODE_STREAM : ID_ENCODE_STREAM, 3, MSG_NOSIGNAL) != 3) goto refused;
+	while (charsRead < sizeof(answer)) {
+		tempChars = recv(c->fd, answer + charsRead, sizeof(answer) - charsRead, 0);
+		if (tempChars < 0 && errno == EINTR) continue;
+		if (tempChars <= 0) goto refused;
+		charsRead += tempChars;
+	}
+	if (memcmp(answer, ID_BUSY, 2) == 0) {
+		close(c->fd);
+		free(c);
+		return OTP_ERR_BUSY;
+	}
+	if (memcmp(answer, "OK", 2) != 0) goto refused;
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+
+	*client = c;
+	return STATUS_OK;
+
+refused:
+	if (c->fd >= 0) close(c->fd);
+	free(c);
+	return OTP_ERR_CONNECT;
+}
+
+int OtpSubmit(struct OtpClient *client, char op, const char *text, const char *key, char *out, size_t n,
+		OtpDone done, void *arg) {
+	struct Request *req;
+	size_t bad;
+
+	if (client->failed) return OTP_ERR_IO;
+	if (op != OP_ENCODE && op != OP_DECODE) return STATUS_WRONG_OP;
+	bad = ScanPair(text, key, n);
+	if (bad < n) return ValidText(text + bad, 1) ? OTP_ERR_KEY : OTP_ERR_TEXT;
+
+	if (client->freeList != NULL) {
+		req = client->freeList;
+		client->freeList = req->next;
+	}
+	else if ((req = malloc(sizeof(struct Request))) == NULL) return OTP_ERR_NOMEM;
+	req->op = op;
+	req->text = text;
+	req->key = key;
+	req->out = out;
+	req->n = n;
+	req->done = done;
+	req->arg = arg;
+	req->next = NULL;
+
+	if (client->tail != NULL) client->tail->next = req;
+	else client->head = req;
+	client->tail = req;
+	if (client->sending == NULL) {
+		client->sending = req;
+		client->sendOffset = client->partDone = 0;
+		client->sendPart = 0;
+	}
+	client->pending++;
+
+	// Start it on its way now; replies are left for OtpPoll so callbacks
+	// never run inside OtpSubmit
+	if (PumpSend(client) < 0) client->failed = 1;
+	return STATUS_OK;
+}
+
+int OtpClientFD(const struct OtpClient *client) {
+	return client->fd;
+}
+
+short OtpClientEvents(const struct OtpClient *client) {
+	if (client->failed || client->head == NULL) return 0;
+	return POLLIN | (client->sending != NULL ? POLLOUT : 0);
+}
+
+int OtpPoll(struct OtpClient *client, int timeoutMs) {
+	struct pollfd pfd;
+	int finished = 0, progress;
+
+	if (client->failed) {
+		FailAll(client, OTP_ERR_IO, OTP_ERR_IO);
+		return OTP_ERR_IO;
+	}
+	pfd.fd = client->fd;
+	pfd.events = OtpClientEvents(client);
+	if (pfd.events == 0) return 0;
+	if (poll(&pfd, 1, timeoutMs) < 0 && errno != EINTR) {
+		FailAll(client, OTP_ERR_IO, OTP_ERR_IO);
+		return OTP_ERR_IO;
+	}
+
+	// Keep both directions moving until neither can: sending more may
+	// need replies read first if the daemon is pushing back
+	do {
+		if (PumpSend(client) < 0 || (progress = PumpReceive(client)) < 0) {
+			FailAll(client, OTP_ERR_IO, OTP_ERR_IO);
+			return OTP_ERR_IO;
+		}
+		finished += progress;
+	} while (progress > 0 && !client->failed);
+	return finished;
+}
+
+int OtpDrain(struct OtpClient *client) {
+	while (client->pending > 0) {
+		if (OtpPoll(client, -1) < 0) return OTP_ERR_IO;
+	}
+	return client->failed ? OTP_ERR_IO : STATUS_OK;
+}
+
+size_t OtpPending(const struct OtpClient *client) {
+	return client->pending;
+}
+
+void OtpClose(struct OtpClient *client) {
+	struct Request *req;
+
+	client->sending = NULL;
+	while (client->head != NULL) Finish(client, OTP_ERR_CLOSED);
+	while ((req = client->freeList) != NULL) {
+		client->freeList = req->next;
+		free(req);
+	}
+	close(client->fd);
+	free(client);
+}
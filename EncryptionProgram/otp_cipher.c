@@ -0,0 +1,730 @@
+/*
+File: otp_cipher.c
+Author: Adeline Harcourt
+Description: The encode/decode kernels shared by the otp daemons. Letters
+		map to 0-25 and space to 26, the key is added (or subtracted) mod
+		27 and the result maps back. The scalar kernels are the original
+		per-character loops from otp_enc_d and otp_dec_d. The vector
+		kernels do the same work 16, 32 or 64 chars at a time: a compare
+		and blend handles the space mapping and an unsigned min against
+		the value minus 27 replaces the division. They produce the same
+		output as the scalar loops for any text and key made of capital
+		letters and spaces. The key kernels turn random bytes into key
+		chars for keygen: bytes of KEY_BYTE_LIMIT and up are dropped so
+		every char is equally likely, the rest are reduced mod 27 by
+		taking 216, 108, 54 and 27 off in turn (with the same unsigned min
+		trick) and mapped to chars, and the kept chars are packed together.
+		The validity scans used by the clients and libotp get the same
+		treatment: the vector versions test a block of chars (of the text
+		and key together, for the pair scan) and look at the combined
+		result once per block, going back over a block only to find the
+		first bad char in it. The pack kernels squeeze
+		chars to 5 bits each for the packed wire format, 8 chars to 5
+		bytes; the scalar versions shift the 8 values of a group together
+		in three steps, and the AVX2 versions map 32 chars at a time and
+		use BMI2's bit extract and deposit for each group.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "otp_cipher.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CIPHER_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*Kernel)(char *out, const char *text, const char *key, size_t n);
+typedef size_t (*KeyKernel)(char *out, const unsigned char *bytes, size_t n);
+typedef size_t (*ScanKernel)(const char *text, size_t n);
+typedef size_t (*PairKernel)(const char *text, const char *key, size_t n);
+typedef void (*PackKernel)(unsigned char *out, const char *text, size_t n);
+typedef int (*UnpackKernel)(char *out, const unsigned char *packed, size_t n);
+
+// Kernels in use, set up by CipherInit before main runs
+static Kernel encodeKernel, decodeKernel;
+static KeyKernel keyKernel;
+static ScanKernel scanKernel;
+static PairKernel pairKernel;
+static PackKernel packKernel;
+static UnpackKernel unpackKernel;
+static int currentIsa = CIPHER_ISA_SCALAR;
+
+// Generate ciphertext from n chars of plain text and key (original loop)
+static void EncodeScalar(char *out, const char *plainText, const char *key, size_t n) {
+	size_t i;
+	char plainChar, keyChar;
+
+	for (i = 0; i < n; i++) {
+		// Replace space chars with 91 for proper modulus
+		keyChar = key[i];
+		plainChar = plainText[i];
+		if(keyChar == 32) keyChar = 91;
+		if(plainChar == 32) plainChar = 91;
+		out[i] = (char)((keyChar + plainChar - 130) % 27 + 65);
+
+		// Replace 91s with space chars
+		if (out[i] == 91) {
+			out[i] = ' ';
+		}
+	}
+}
+
+// Decode n chars of cipher text with the key (original loop)
+static void DecodeScalar(char *out, const char *cipherText, const char *key, size_t n) {
+	size_t i;
+	int tempInt;
+	char cipherChar, keyChar;
+
+	for (i = 0; i < n; i++) {
+		// Replace space chars with ASCII 91 for proper modulus
+		keyChar = key[i];
+		cipherChar = cipherText[i];
+		if(keyChar == 32) keyChar = 91;
+		if(cipherChar == 32) cipherChar = 91;
+
+		// Modulus and account for negative numbers
+		tempInt = (cipherChar - keyChar) % 27;
+		if(tempInt < 0) tempInt += 27;
+
+		// Add 65 to reach uppercase alphabet chars
+		out[i] = (char)(tempInt + 65);
+
+		// Replace all 91s with space chars
+		if (out[i] == 91) {
+			out[i] = ' ';
+		}
+	}
+}
+
+// Returns 1 if the char is not a capital letter or space (the original
+// check from the clients)
+static inline int BadChar(char c) {
+	return (c < 65 || c > 90) && c != 32;
+}
+
+// Returns the offset of the first of the n chars that is not a capital
+// letter or space, or n if they all are
+static size_t ScanScalar(const char *text, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (BadChar(text[i])) return i;
+	}
+	return n;
+}
+
+// The same for a text and key together: the first offset at which either
+// has a bad char
+static size_t ScanPairScalar(const char *text, const char *key, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (BadChar(text[i]) | BadChar(key[i])) return i;
+	}
+	return n;
+}
+
+// Turn n random bytes into key chars, dropping bytes of KEY_BYTE_LIMIT and
+// up. Returns the number of chars written to out, which needs room for n.
+static size_t KeyFromBytesScalar(char *out, const unsigned char *bytes, size_t n) {
+	size_t i, count = 0;
+	int value;
+
+	for (i = 0; i < n; i++) {
+		// Always write, but only keep the char if the byte was in range
+		value = bytes[i] % 27;
+		out[count] = (value == 26) ? ' ' : (char)(value + 65);
+		count += (bytes[i] < KEY_BYTE_LIMIT);
+	}
+	return count;
+}
+
+// Bit mask of the 5 value bits in each byte of a group of 8
+#define PACK_MASK 0x1F1F1F1F1F1F1F1FULL
+
+// Packs 8 values (one per byte, each under 32) into the low 40 bits, the
+// first value lowest
+static inline uint64_t Pack8(uint64_t values) {
+	values = (values & 0x001F001F001F001FULL) | ((values & 0x1F001F001F001F00ULL) >> 3);
+	values = (values & 0x000003FF000003FFULL) | ((values & 0x03FF000003FF0000ULL) >> 6);
+	return (values & 0xFFFFFULL) | ((values & 0x000FFFFF00000000ULL) >> 12);
+}
+
+// Spreads 40 packed bits back out to 8 values, one per byte
+static inline uint64_t Unpack8(uint64_t bits) {
+	bits = (bits & 0xFFFFFULL) | ((bits & 0xFFFFF00000ULL) << 12);
+	bits = (bits & 0x000003FF000003FFULL) | ((bits & 0x000FFC00000FFC00ULL) << 6);
+	return (bits & 0x001F001F001F001FULL) | ((bits & 0x03E003E003E003E0ULL) << 3);
+}
+
+// Packs n chars 5 bits each, 8 chars to 5 bytes (a last short group takes
+// only the bytes it needs). out may be the same buffer as text, since a
+// group is read before it is written and is written no further along.
+static void PackScalar(unsigned char *out, const char *text, size_t n) {
+	size_t i, j, take;
+	uint64_t values, bits;
+
+	for (i = 0; i < n; i += 8) {
+		take = n - i < 8 ? n - i : 8;
+		values = 0;
+		for (j = 0; j < take; j++)
+			values |= (uint64_t)((text[i + j] == ' ' ? 26 : text[i + j] - 'A') & 0x1F) << (8 * j);
+		bits = Pack8(values);
+		for (j = 0; j < (take * 5 + 7) / 8; j++) out[i / 8 * 5 + j] = bits >> (8 * j);
+	}
+}
+
+// Unpacks n chars. Returns 1 if every code was 0-26, else 0. The packed
+// bytes may sit at the end of out, since each group is read before its
+// chars are written and writes never catch up with unread groups.
+static int UnpackScalar(char *out, const unsigned char *packed, size_t n) {
+	size_t i, j, take;
+	uint64_t bits, values;
+	int value, ok = 1;
+
+	for (i = 0; i < n; i += 8) {
+		take = n - i < 8 ? n - i : 8;
+		bits = 0;
+		for (j = 0; j < (take * 5 + 7) / 8; j++) bits |= (uint64_t)packed[i / 8 * 5 + j] << (8 * j);
+		values = Unpack8(bits);
+		for (j = 0; j < take; j++) {
+			value = (values >> (8 * j)) & 0x1F;
+			ok &= value <= 26;
+			out[i + j] = (value == 26) ? ' ' : (char)(value + 'A');
+		}
+	}
+	return ok;
+}
+
+#ifdef CIPHER_X86
+
+// SSE2 helpers: map chars to 0-26, reduce 0-53 mod 27, and map back
+static inline __m128i ToValues128(__m128i chars) {
+	__m128i isSpace = _mm_cmpeq_epi8(chars, _mm_set1_epi8(' '));
+	__m128i values = _mm_sub_epi8(chars, _mm_set1_epi8('A'));
+	return _mm_or_si128(_mm_andnot_si128(isSpace, values), _mm_and_si128(isSpace, _mm_set1_epi8(26)));
+}
+
+static inline __m128i Mod27_128(__m128i sum) {
+	// Values under 27 wrap around when 27 is taken off, so the min keeps them
+	return _mm_min_epu8(sum, _mm_sub_epi8(sum, _mm_set1_epi8(27)));
+}
+
+static inline __m128i ToChars128(__m128i values) {
+	__m128i isSpace = _mm_cmpeq_epi8(values, _mm_set1_epi8(26));
+	__m128i chars = _mm_add_epi8(values, _mm_set1_epi8('A'));
+	return _mm_or_si128(_mm_andnot_si128(isSpace, chars), _mm_and_si128(isSpace, _mm_set1_epi8(' ')));
+}
+
+// Reduces bytes under 243 mod 27
+static inline __m128i ByteMod27_128(__m128i bytes) {
+	bytes = _mm_min_epu8(bytes, _mm_sub_epi8(bytes, _mm_set1_epi8((char)216)));
+	bytes = _mm_min_epu8(bytes, _mm_sub_epi8(bytes, _mm_set1_epi8(108)));
+	bytes = _mm_min_epu8(bytes, _mm_sub_epi8(bytes, _mm_set1_epi8(54)));
+	return Mod27_128(bytes);
+}
+
+static void EncodeSSE2(char *out, const char *plainText, const char *key, size_t n) {
+	size_t i;
+	__m128i p, k;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		p = ToValues128(_mm_loadu_si128((const __m128i *)(plainText + i)));
+		k = ToValues128(_mm_loadu_si128((const __m128i *)(key + i)));
+		_mm_storeu_si128((__m128i *)(out + i), ToChars128(Mod27_128(_mm_add_epi8(p, k))));
+	}
+	EncodeScalar(out + i, plainText + i, key + i, n - i);
+}
+
+static void DecodeSSE2(char *out, const char *cipherText, const char *key, size_t n) {
+	size_t i;
+	__m128i c, k;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		c = ToValues128(_mm_loadu_si128((const __m128i *)(cipherText + i)));
+		k = ToValues128(_mm_loadu_si128((const __m128i *)(key + i)));
+		// Adding 27 first keeps the difference positive
+		c = _mm_add_epi8(c, _mm_set1_epi8(27));
+		_mm_storeu_si128((__m128i *)(out + i), ToChars128(Mod27_128(_mm_sub_epi8(c, k))));
+	}
+	DecodeScalar(out + i, cipherText + i, key + i, n - i);
+}
+
+// A char is valid if it is a space or at most 25 past 'A'. Sets each byte
+// of a valid char.
+static inline __m128i ValidMask128(__m128i chars) {
+	__m128i values = _mm_sub_epi8(chars, _mm_set1_epi8('A'));
+	return _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(values, _mm_set1_epi8(25)), values),
+		_mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')));
+}
+
+// The checks are combined over 64 chars before looking at the result, and
+// a block that fails is gone over again to find its bad char
+static size_t ScanSSE2(const char *text, size_t n) {
+	size_t i, j;
+	__m128i ok;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		ok = _mm_set1_epi8(-1);
+		for (j = 0; j < 64; j += 16) ok = _mm_and_si128(ok, ValidMask128(_mm_loadu_si128((const __m128i *)(text + i + j))));
+		if (_mm_movemask_epi8(ok) != 0xFFFF) return i + ScanScalar(text + i, 64);
+	}
+	return i + ScanScalar(text + i, n - i);
+}
+
+static size_t ScanPairSSE2(const char *text, const char *key, size_t n) {
+	size_t i, j;
+	__m128i ok;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		ok = _mm_set1_epi8(-1);
+		for (j = 0; j < 64; j += 16) {
+			ok = _mm_and_si128(ok, ValidMask128(_mm_loadu_si128((const __m128i *)(text + i + j))));
+			ok = _mm_and_si128(ok, ValidMask128(_mm_loadu_si128((const __m128i *)(key + i + j))));
+		}
+		if (_mm_movemask_epi8(ok) != 0xFFFF) return i + ScanPairScalar(text + i, key + i, 64);
+	}
+	return i + ScanPairScalar(text + i, key + i, n - i);
+}
+
+static size_t KeyFromBytesSSE2(char *out, const unsigned char *bytes, size_t n) {
+	size_t i, j, count = 0;
+	__m128i raw, chars;
+	unsigned keep;
+	char packed[16];
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		raw = _mm_loadu_si128((const __m128i *)(bytes + i));
+		chars = ToChars128(ByteMod27_128(raw));
+		keep = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(raw, _mm_set1_epi8(KEY_BYTE_LIMIT - 1)), raw));
+
+		// Most of the time a few bytes are dropped and the rest are packed one by one
+		if (keep == 0xFFFF) {
+			_mm_storeu_si128((__m128i *)(out + count), chars);
+			count += 16;
+			continue;
+		}
+		_mm_storeu_si128((__m128i *)packed, chars);
+		for (j = 0; j < 16; j++) {
+			out[count] = packed[j];
+			count += (keep >> j) & 1;
+		}
+	}
+	return count + KeyFromBytesScalar(out + count, bytes + i, n - i);
+}
+
+// AVX2 versions of the same steps, 32 chars at a time
+__attribute__((target("avx2")))
+static inline __m256i ToValues256(__m256i chars) {
+	__m256i isSpace = _mm256_cmpeq_epi8(chars, _mm256_set1_epi8(' '));
+	return _mm256_blendv_epi8(_mm256_sub_epi8(chars, _mm256_set1_epi8('A')), _mm256_set1_epi8(26), isSpace);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i Mod27_256(__m256i sum) {
+	return _mm256_min_epu8(sum, _mm256_sub_epi8(sum, _mm256_set1_epi8(27)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i ToChars256(__m256i values) {
+	__m256i isSpace = _mm256_cmpeq_epi8(values, _mm256_set1_epi8(26));
+	return _mm256_blendv_epi8(_mm256_add_epi8(values, _mm256_set1_epi8('A')), _mm256_set1_epi8(' '), isSpace);
+}
+
+__attribute__((target("avx2")))
+static void EncodeAVX2(char *out, const char *plainText, const char *key, size_t n) {
+	size_t i;
+	__m256i p, k;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		p = ToValues256(_mm256_loadu_si256((const __m256i *)(plainText + i)));
+		k = ToValues256(_mm256_loadu_si256((const __m256i *)(key + i)));
+		_mm256_storeu_si256((__m256i *)(out + i), ToChars256(Mod27_256(_mm256_add_epi8(p, k))));
+	}
+	EncodeSSE2(out + i, plainText + i, key + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void DecodeAVX2(char *out, const char *cipherText, const char *key, size_t n) {
+	size_t i;
+	__m256i c, k;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		c = ToValues256(_mm256_loadu_si256((const __m256i *)(cipherText + i)));
+		k = ToValues256(_mm256_loadu_si256((const __m256i *)(key + i)));
+		c = _mm256_add_epi8(c, _mm256_set1_epi8(27));
+		_mm256_storeu_si256((__m256i *)(out + i), ToChars256(Mod27_256(_mm256_sub_epi8(c, k))));
+	}
+	DecodeSSE2(out + i, cipherText + i, key + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i ValidMask256(__m256i chars) {
+	__m256i values = _mm256_sub_epi8(chars, _mm256_set1_epi8('A'));
+	return _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(values, _mm256_set1_epi8(25)), values),
+		_mm256_cmpeq_epi8(chars, _mm256_set1_epi8(' ')));
+}
+
+__attribute__((target("avx2")))
+static size_t ScanAVX2(const char *text, size_t n) {
+	size_t i, j;
+	__m256i ok;
+
+	for (i = 0; i + 128 <= n; i += 128) {
+		ok = _mm256_set1_epi8(-1);
+		for (j = 0; j < 128; j += 32) ok = _mm256_and_si256(ok, ValidMask256(_mm256_loadu_si256((const __m256i *)(text + i + j))));
+		if (_mm256_movemask_epi8(ok) != -1) return i + ScanScalar(text + i, 128);
+	}
+	return i + ScanSSE2(text + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t ScanPairAVX2(const char *text, const char *key, size_t n) {
+	size_t i, j;
+	__m256i ok;
+
+	for (i = 0; i + 128 <= n; i += 128) {
+		ok = _mm256_set1_epi8(-1);
+		for (j = 0; j < 128; j += 32) {
+			ok = _mm256_and_si256(ok, ValidMask256(_mm256_loadu_si256((const __m256i *)(text + i + j))));
+			ok = _mm256_and_si256(ok, ValidMask256(_mm256_loadu_si256((const __m256i *)(key + i + j))));
+		}
+		if (_mm256_movemask_epi8(ok) != -1) return i + ScanPairScalar(text + i, key + i, 128);
+	}
+	return i + ScanPairSSE2(text + i, key + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i ByteMod27_256(__m256i bytes) {
+	bytes = _mm256_min_epu8(bytes, _mm256_sub_epi8(bytes, _mm256_set1_epi8((char)216)));
+	bytes = _mm256_min_epu8(bytes, _mm256_sub_epi8(bytes, _mm256_set1_epi8(108)));
+	bytes = _mm256_min_epu8(bytes, _mm256_sub_epi8(bytes, _mm256_set1_epi8(54)));
+	return Mod27_256(bytes);
+}
+
+// Packs the kept chars 8 at a time with BMI2's parallel bit extract
+__attribute__((target("avx2,bmi2")))
+static size_t KeyFromBytesAVX2(char *out, const unsigned char *bytes, size_t n) {
+	size_t i, count = 0;
+	__m256i raw;
+	uint64_t words[4], byteMask;
+	unsigned keep, keep8;
+	int group;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		raw = _mm256_loadu_si256((const __m256i *)(bytes + i));
+		_mm256_storeu_si256((__m256i *)words, ToChars256(ByteMod27_256(raw)));
+		keep = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(raw, _mm256_set1_epi8(KEY_BYTE_LIMIT - 1)), raw));
+
+		for (group = 0; group < 4; group++) {
+			// Spread the 8 keep bits into byte masks and pull the kept bytes together
+			keep8 = (keep >> (8 * group)) & 0xFF;
+			byteMask = _pdep_u64(keep8, 0x0101010101010101ULL) * 0xFF;
+			words[group] = _pext_u64(words[group], byteMask);
+			memcpy(out + count, &words[group], 8);
+			count += __builtin_popcount(keep8);
+		}
+	}
+	return count + KeyFromBytesSSE2(out + count, bytes + i, n - i);
+}
+
+// Packs 32 chars at a time: the vector maps them to values, then each
+// group of 8 is squeezed to 40 bits with one bit extract. Each group is
+// stored with an 8 byte write whose last 3 bytes the next group overwrites,
+// so the loop stops while a block is left for the scalar tail.
+__attribute__((target("avx2,bmi2")))
+static void PackAVX2(unsigned char *out, const char *text, size_t n) {
+	size_t i;
+	uint64_t values[4], bits;
+	int group;
+
+	for (i = 0; i + 40 <= n; i += 32) {
+		_mm256_storeu_si256((__m256i *)values, ToValues256(_mm256_loadu_si256((const __m256i *)(text + i))));
+		for (group = 0; group < 4; group++) {
+			bits = _pext_u64(values[group], PACK_MASK);
+			memcpy(out + i / 8 * 5 + 5 * group, &bits, 8);
+		}
+	}
+	PackScalar(out + i / 8 * 5, text + i, n - i);
+}
+
+// Unpacks 32 chars at a time, reading all 20 bytes of a block (with 8 byte
+// loads, so again short of the end) before writing any of its chars, so
+// the packed bytes may sit at the end of out
+__attribute__((target("avx2,bmi2")))
+static int UnpackAVX2(char *out, const unsigned char *packed, size_t n) {
+	size_t i;
+	uint64_t bits[4], values[4];
+	__m256i block, bad = _mm256_setzero_si256();
+	int group;
+
+	for (i = 0; i + 40 <= n; i += 32) {
+		memcpy(bits, packed + i / 8 * 5, 8);
+		memcpy(bits + 1, packed + i / 8 * 5 + 5, 8);
+		memcpy(bits + 2, packed + i / 8 * 5 + 10, 8);
+		memcpy(bits + 3, packed + i / 8 * 5 + 15, 8);
+		for (group = 0; group < 4; group++) values[group] = _pdep_u64(bits[group], PACK_MASK);
+		block = _mm256_loadu_si256((const __m256i *)values);
+		bad = _mm256_or_si256(bad, _mm256_cmpgt_epi8(block, _mm256_set1_epi8(26)));
+		_mm256_storeu_si256((__m256i *)(out + i), ToChars256(block));
+	}
+	return UnpackScalar(out + i, packed + i / 8 * 5, n - i) & _mm256_testz_si256(bad, bad);
+}
+
+// AVX-512BW versions, 64 chars at a time using mask registers for the blends
+__attribute__((target("avx512bw")))
+static inline __m512i ToValues512(__m512i chars) {
+	__mmask64 isSpace = _mm512_cmpeq_epi8_mask(chars, _mm512_set1_epi8(' '));
+	return _mm512_mask_blend_epi8(isSpace, _mm512_sub_epi8(chars, _mm512_set1_epi8('A')), _mm512_set1_epi8(26));
+}
+
+__attribute__((target("avx512bw")))
+static inline __m512i Mod27_512(__m512i sum) {
+	return _mm512_min_epu8(sum, _mm512_sub_epi8(sum, _mm512_set1_epi8(27)));
+}
+
+__attribute__((target("avx512bw")))
+static inline __m512i ToChars512(__m512i values) {
+	__mmask64 isSpace = _mm512_cmpeq_epi8_mask(values, _mm512_set1_epi8(26));
+	return _mm512_mask_blend_epi8(isSpace, _mm512_add_epi8(values, _mm512_set1_epi8('A')), _mm512_set1_epi8(' '));
+}
+
+__attribute__((target("avx512bw")))
+static void EncodeAVX512(char *out, const char *plainText, const char *key, size_t n) {
+	size_t i;
+	__m512i p, k;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		p = ToValues512(_mm512_loadu_si512((const void *)(plainText + i)));
+		k = ToValues512(_mm512_loadu_si512((const void *)(key + i)));
+		_mm512_storeu_si512((void *)(out + i), ToChars512(Mod27_512(_mm512_add_epi8(p, k))));
+	}
+	EncodeAVX2(out + i, plainText + i, key + i, n - i);
+}
+
+__attribute__((target("avx512bw")))
+static void DecodeAVX512(char *out, const char *cipherText, const char *key, size_t n) {
+	size_t i;
+	__m512i c, k;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		c = ToValues512(_mm512_loadu_si512((const void *)(cipherText + i)));
+		k = ToValues512(_mm512_loadu_si512((const void *)(key + i)));
+		c = _mm512_add_epi8(c, _mm512_set1_epi8(27));
+		_mm512_storeu_si512((void *)(out + i), ToChars512(Mod27_512(_mm512_sub_epi8(c, k))));
+	}
+	DecodeAVX2(out + i, cipherText + i, key + i, n - i);
+}
+
+// A mask register takes the place of the movemask, and the compare against
+// 25 can be done unsigned directly
+__attribute__((target("avx512bw")))
+static inline __mmask64 ValidMask512(__m512i chars) {
+	return _mm512_cmple_epu8_mask(_mm512_sub_epi8(chars, _mm512_set1_epi8('A')), _mm512_set1_epi8(25)) |
+		_mm512_cmpeq_epi8_mask(chars, _mm512_set1_epi8(' '));
+}
+
+__attribute__((target("avx512bw")))
+static size_t ScanAVX512(const char *text, size_t n) {
+	size_t i, j;
+	__mmask64 ok;
+
+	for (i = 0; i + 256 <= n; i += 256) {
+		ok = ~(__mmask64)0;
+		for (j = 0; j < 256; j += 64) ok &= ValidMask512(_mm512_loadu_si512((const void *)(text + i + j)));
+		if (ok != ~(__mmask64)0) return i + ScanScalar(text + i, 256);
+	}
+	return i + ScanAVX2(text + i, n - i);
+}
+
+__attribute__((target("avx512bw")))
+static size_t ScanPairAVX512(const char *text, const char *key, size_t n) {
+	size_t i, j;
+	__mmask64 ok;
+
+	for (i = 0; i + 256 <= n; i += 256) {
+		ok = ~(__mmask64)0;
+		for (j = 0; j < 256; j += 64) {
+			ok &= ValidMask512(_mm512_loadu_si512((const void *)(text + i + j)));
+			ok &= ValidMask512(_mm512_loadu_si512((const void *)(key + i + j)));
+		}
+		if (ok != ~(__mmask64)0) return i + ScanPairScalar(text + i, key + i, 256);
+	}
+	return i + ScanPairAVX2(text + i, key + i, n - i);
+}
+
+__attribute__((target("avx512bw")))
+static inline __m512i ByteMod27_512(__m512i bytes) {
+	bytes = _mm512_min_epu8(bytes, _mm512_sub_epi8(bytes, _mm512_set1_epi8((char)216)));
+	bytes = _mm512_min_epu8(bytes, _mm512_sub_epi8(bytes, _mm512_set1_epi8(108)));
+	bytes = _mm512_min_epu8(bytes, _mm512_sub_epi8(bytes, _mm512_set1_epi8(54)));
+	return Mod27_512(bytes);
+}
+
+// Packs the kept chars with AVX-512 VBMI2's byte compress
+__attribute__((target("avx512bw,avx512vbmi2")))
+static size_t KeyFromBytesAVX512(char *out, const unsigned char *bytes, size_t n) {
+	size_t i, count = 0;
+	__m512i raw;
+	__mmask64 keep;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		raw = _mm512_loadu_si512((const void *)(bytes + i));
+		keep = _mm512_cmplt_epu8_mask(raw, _mm512_set1_epi8((char)KEY_BYTE_LIMIT));
+		_mm512_storeu_si512((void *)(out + count), _mm512_maskz_compress_epi8(keep, ToChars512(ByteMod27_512(raw))));
+		count += __builtin_popcountll(keep);
+	}
+	return count + KeyFromBytesAVX2(out + count, bytes + i, n - i);
+}
+
+#endif
+
+// Returns the fastest instruction set level this CPU supports
+int CipherBestIsa(void) {
+#ifdef CIPHER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw")) return CIPHER_ISA_AVX512;
+	if (__builtin_cpu_supports("avx2")) return CIPHER_ISA_AVX2;
+	if (__builtin_cpu_supports("sse2")) return CIPHER_ISA_SSE2;
+#endif
+	return CIPHER_ISA_SCALAR;
+}
+
+// Returns the instruction set level the kernels currently use
+int CipherIsa(void) {
+	return currentIsa;
+}
+
+// Switches the kernels to the given instruction set level. Returns 0, or
+// -1 if the CPU does not support it.
+int CipherSetIsa(int isa) {
+	if (isa < CIPHER_ISA_SCALAR || isa > CipherBestIsa()) return -1;
+
+	switch (isa) {
+#ifdef CIPHER_X86
+		case CIPHER_ISA_AVX512:
+			encodeKernel = EncodeAVX512;
+			decodeKernel = DecodeAVX512;
+			keyKernel = KeyFromBytesAVX512;
+			scanKernel = ScanAVX512;
+			pairKernel = ScanPairAVX512;
+			packKernel = PackAVX2;
+			unpackKernel = UnpackAVX2;
+			break;
+		case CIPHER_ISA_AVX2:
+			encodeKernel = EncodeAVX2;
+			decodeKernel = DecodeAVX2;
+			keyKernel = KeyFromBytesAVX2;
+			scanKernel = ScanAVX2;
+			pairKernel = ScanPairAVX2;
+			packKernel = PackAVX2;
+			unpackKernel = UnpackAVX2;
+			break;
+		case CIPHER_ISA_SSE2:
+			encodeKernel = EncodeSSE2;
+			decodeKernel = DecodeSSE2;
+			keyKernel = KeyFromBytesSSE2;
+			scanKernel = ScanSSE2;
+			pairKernel = ScanPairSSE2;
+			packKernel = PackScalar;
+			unpackKernel = UnpackScalar;
+			break;
+#endif
+		default:
+			encodeKernel = EncodeScalar;
+			decodeKernel = DecodeScalar;
+			keyKernel = KeyFromBytesScalar;
+			scanKernel = ScanScalar;
+			pairKernel = ScanPairScalar;
+			packKernel = PackScalar;
+			unpackKernel = UnpackScalar;
+			break;
+	}
+
+#ifdef CIPHER_X86
+	// The key packing steps need more than the level itself promises
+	if (keyKernel == KeyFromBytesAVX512 && !__builtin_cpu_supports("avx512vbmi2")) keyKernel = KeyFromBytesAVX2;
+	if (keyKernel == KeyFromBytesAVX2 && !__builtin_cpu_supports("bmi2")) keyKernel = KeyFromBytesSSE2;
+	if (packKernel == PackAVX2 && !__builtin_cpu_supports("bmi2")) {
+		packKernel = PackScalar;
+		unpackKernel = UnpackScalar;
+	}
+#endif
+	currentIsa = isa;
+	return 0;
+}
+
+// Returns a printable name for an instruction set level
+const char *CipherIsaName(int isa) {
+	static const char *names[CIPHER_ISA_COUNT] = { "scalar", "sse2", "avx2", "avx512bw" };
+	if (isa < 0 || isa >= CIPHER_ISA_COUNT) return "unknown";
+	return names[isa];
+}
+
+// Picks the fastest kernels before main runs. OTP_CIPHER_ISA in the
+// environment can cap the level (e.g. "sse2") for testing.
+__attribute__((constructor))
+static void CipherInit(void) {
+	const char *cap = getenv("OTP_CIPHER_ISA");
+	int isa = CipherBestIsa(), i;
+
+	if (cap != NULL) {
+		for (i = 0; i < CIPHER_ISA_COUNT; i++) {
+			if (strcmp(cap, CipherIsaName(i)) == 0 && i < isa) isa = i;
+		}
+	}
+	CipherSetIsa(isa);
+}
+
+// Generate ciphertext from n chars of plain text and key, writing it to out
+// (out may be the same buffer as key or plainText)
+void EncodeText(char *out, const char *plainText, const char *key, size_t n) {
+	encodeKernel(out, plainText, key, n);
+}
+
+// Decode n chars of cipher text with the key, writing the plain text to out
+// (out may be the same buffer as key or cipherText)
+void DecodeText(char *out, const char *cipherText, const char *key, size_t n) {
+	decodeKernel(out, cipherText, key, n);
+}
+
+// Returns 1 if the n chars are all capital letters or spaces, else 0
+int ValidText(const char *text, size_t n) {
+	return scanKernel(text, n) == n;
+}
+
+// Returns the offset of the first of the n chars that is not a capital
+// letter or space, or n if there is none. A file's text ends at its
+// newline, so scanning the whole file both checks it and finds its length.
+size_t ScanText(const char *text, size_t n) {
+	return scanKernel(text, n);
+}
+
+// Scans n chars of text and key in one pass. Returns the first offset at
+// which either has a bad char, or n. Long inputs can be scanned a chunk at
+// a time, adding each chunk's offset to the result.
+size_t ScanPair(const char *text, const char *key, size_t n) {
+	return pairKernel(text, key, n);
+}
+
+// Turn n random bytes into key chars (capital letters and spaces), dropping
+// bytes of KEY_BYTE_LIMIT and up so every char is equally likely. Returns
+// the number of chars written; out needs room for n.
+size_t KeyFromBytes(char *out, const unsigned char *bytes, size_t n) {
+	return keyKernel(out, bytes, n);
+}
+
+// Packs n chars (capital letters and spaces) 5 bits each into
+// PACKED_SIZE(n) bytes. out may be the same buffer as text.
+void PackText(unsigned char *out, const char *text, size_t n) {
+	packKernel(out, text, n);
+}
+
+// Unpacks n chars from PACKED_SIZE(n) bytes. Returns 1 if every code was a
+// char, else 0. The packed bytes may sit at the end of out (packed ==
+// out + n - PACKED_SIZE(n)), so a chunk can be unpacked where it landed.
+int UnpackText(char *out, const unsigned char *packed, size_t n) {
+	return unpackKernel(out, packed, n);
+}
@@ -0,0 +1,44 @@
+/*
+File: otp_cipher.h
+Author: Adeline Harcourt
+Description: Declarations for the encode/decode kernels shared by the otp
+		daemons, clients and libotp, the kernel keygen uses to turn random
+		bytes into key chars, and the kernels that pack chars 5 bits each
+		for the packed wire format. Each kernel has a scalar version (the
+		original loop) and faster SSE2, AVX2 or AVX-512BW versions; the
+		fastest one the CPU supports is picked when the program starts.
+*/
+#ifndef OTP_CIPHER_H
+#define OTP_CIPHER_H
+
+#include <stddef.h>
+
+// Instruction set levels, from slowest to fastest
+#define CIPHER_ISA_SCALAR 0
+#define CIPHER_ISA_SSE2   1
+#define CIPHER_ISA_AVX2   2
+#define CIPHER_ISA_AVX512 3
+#define CIPHER_ISA_COUNT  4
+
+void EncodeText(char *out, const char *plainText, const char *key, size_t n);
+void DecodeText(char *out, const char *cipherText, const char *key, size_t n);
+
+int ValidText(const char *text, size_t n);
+size_t ScanText(const char *text, size_t n);
+size_t ScanPair(const char *text, const char *key, size_t n);
+
+void PackText(unsigned char *out, const char *text, size_t n);
+int UnpackText(char *out, const unsigned char *packed, size_t n);
+
+// Random bytes at or above this are dropped when making key chars, since
+// 243 is the largest multiple of 27 a byte can hold
+#define KEY_BYTE_LIMIT 243
+
+size_t KeyFromBytes(char *out, const unsigned char *bytes, size_t n);
+
+int CipherBestIsa(void);
+int CipherIsa(void);
+int CipherSetIsa(int isa);
+const char *CipherIsaName(int isa);
+
+#endif
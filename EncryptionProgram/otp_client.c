@@ -0,0 +1,1148 @@
+/*
+File: otp_client.c
+Author: Adeline Harcourt (connection setup based on skeleton client.c code
+		from Professor Benjamin Brewster, OSU CS344 Spring 2017 Semester)
+Description: Connection and transfer code shared by otp_enc and otp_dec.
+		This covers connecting to a daemon (on this host or any other,
+		see otp_net.c) and verifying the handshake,
+		the zero-copy file transfer used by the original protocol (input
+		files are mapped for validation and pushed to the socket with
+		sendfile), and the framed protocol, which pipelines any number
+		of messages over one connection as fixed-size frames of text and
+		key while the results of earlier frames are read back and written
+		out. Pad messages send text alone and are ciphered with the
+		daemon's key store. A message can also go through a shared memory
+		ring on the daemon's ring socket, skipping the socket copies, or
+		be one of many spread over several daemons by a libotp pool.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "otp_client.h"
+
+// Error function used for reporting issues
+void error(const char *msg, int exitVal) {
+	fprintf(stderr, "ERROR: %s\n", msg);
+	exit(exitVal);
+}
+
+// Reports a fatal error prefixed with the client name, e.g.
+// "otp_enc had issue writing to socket"
+static void ClientError(const char *prog, const char *msg) {
+	char message[256];
+	snprintf(message, sizeof(message), "%s %s", prog, msg);
+	error(message, 1);
+}
+
+// Reads from fd until n bytes arrive or the input ends. Returns the number
+// of bytes read, or -1 on error.
+static ssize_t ReadFull(int fd, char *buf, size_t n) {
+	size_t total = 0;
+	ssize_t tempChars;
+
+	while (total < n) {
+		tempChars = read(fd, buf + total, n - total);
+		if (tempChars < 0 && errno == EINTR) continue;
+		if (tempChars < 0) return -1;
+		if (tempChars == 0) break;
+		total += tempChars;
+	}
+	return total;
+}
+
+// Writes all n bytes to fd, exiting on error
+static void WriteFull(const char *prog, int fd, const char *buf, size_t n) {
+	ssize_t tempChars;
+
+	while (n > 0) {
+		tempChars = write(fd, buf, n);
+		if (tempChars < 0 && errno == EINTR) continue;
+		if (tempChars < 0) ClientError(prog, "had issue writing output");
+		buf += tempChars;
+		n -= tempChars;
+	}
+}
+
+// Opens an input file for reading. "-" means standard input.
+int OpenInput(const char *name) {
+	if (strcmp(name, "-") == 0) return STDIN_FILENO;
+	return open(name, O_RDONLY);
+}
+
+// Returns 1 if the named input is standard input or anything else that is
+// not a regular file (a pipe, FIFO, terminal or socket), which cannot be
+// sized up front and so has to be streamed
+int StreamInput(const char *name) {
+	struct stat info;
+
+	if (strcmp(name, "-") == 0) return 1;
+	return stat(name, &info) == 0 && !S_ISREG(info.st_mode);
+}
+
+// Returns 1 if the named input is a regular file holding more text (less
+// its newline) than the original protocol carries
+int LegacyTooLong(const char *name) {
+	struct stat info;
+
+	return stat(name, &info) == 0 && S_ISREG(info.st_mode) && info.st_size - 1 > LEGACY_MAX_CHARS;
+}
+
+// Exits with an error if both inputs are regular files and the key is
+// shorter than the text, matching the check the original protocol makes
+// before connecting
+void CheckKeyLength(int textFD, int keyFD) {
+	struct stat textInfo, keyInfo;
+
+	if (fstat(textFD, &textInfo) < 0 || fstat(keyFD, &keyInfo) < 0) return;
+	if (!S_ISREG(textInfo.st_mode) || !S_ISREG(keyInfo.st_mode)) return;
+	if (keyInfo.st_size < textInfo.st_size) error("Key file is too short", 1);
+}
+
+// Returns the size of a regular file, exiting with an error for anything
+// that cannot be sized (pipes and terminals need the -s streaming mode)
+off_t FileSize(int fd, const char *fileName) {
+	struct stat info;
+	char message[256];
+
+	if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+		snprintf(message, sizeof(message), "%s is not a regular file (use -s to stream it)", fileName);
+		error(message, 1);
+	}
+	return info.st_size;
+}
+
+// Maps the first len bytes of a file read-only. Returns NULL for len 0.
+const char *MapFile(const char *prog, int fd, size_t len) {
+	void *map;
+
+	if (len == 0) return NULL;
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) ClientError(prog, "could not map input file");
+	madvise(map, len, MADV_SEQUENTIAL); // Validation reads it front to back
+	return map;
+}
+
+// Checks n chars of text and key (or of the text alone if key is NULL) in
+// one pass. On a bad char, exits naming the input it is in and where it
+// is, counting from start for a message checked a chunk at a time.
+void CheckInputs(const char *text, const char *key, size_t n, uint64_t start, const char *textName, const char *keyName) {
+	size_t bad = key != NULL ? ScanPair(text, key, n) : ScanText(text, n);
+
+	if (bad == n) return;
+	fprintf(stderr, "ERROR: %s contains bad characters (char %llu)\n", ValidText(text + bad, 1) ? keyName : textName,
+		(unsigned long long)(start + bad));
+	exit(1);
+}
+
+// Sends the first len bytes of a file over the socket with sendfile, so
+// the data goes from the page cache to the socket without passing through
+// this process. Falls back to sending from the mapping (map) if the kernel
+// cannot sendfile this kind of file.
+void SendFileRange(const char *prog, int socketFD, int fd, const char *map, size_t len) {
+	off_t offset = 0;
+	ssize_t tempChars;
+
+	while ((size_t)offset < len) {
+		tempChars = sendfile(socketFD, fd, &offset, len - offset);
+		if (tempChars < 0 && errno == EINTR) continue;
+		if (tempChars < 0 && (errno == EINVAL || errno == ENOSYS)) break;
+		if (tempChars <= 0) ClientError(prog, "had issue writing to socket");
+	}
+
+	// Fallback: send whatever is left from the mapping
+	while ((size_t)offset < len) {
+		tempChars = send(socketFD, map + offset, len - offset, 0);
+		if (tempChars < 0 && errno == EINTR) continue;
+		if (tempChars < 0) ClientError(prog, "had issue writing to socket");
+		offset += tempChars;
+	}
+}
+
+// Receives len bytes from the socket and writes them to outFD in chunks,
+// so the whole reply never has to sit in memory at once
+void ReceiveToFD(const char *prog, int socketFD, int outFD, size_t len) {
+	char buffer[STREAM_CHUNK_SIZE];
+	ssize_t tempChars;
+
+	while (len > 0) {
+		tempChars = recv(socketFD, buffer, len < sizeof(buffer) ? len : sizeof(buffer), 0);
+		if (tempChars < 0 && errno == EINTR) continue;
+		if (tempChars <= 0) ClientError(prog, "had issue reading from socket");
+		WriteFull(prog, outFD, buffer, tempChars);
+		len -= tempChars;
+	}
+}
+
+// TCP options for every connection to a daemon. Small writes (the message
+// size, short texts) are sent right away by default: with Nagle's
+// algorithm on, the text waits behind the unacknowledged size until the
+// daemon's delayed ACK fires, about 40ms per request.
+static struct NetTuning clientTuning = { .noDelay = 1 };
+
+// Sets TCP options for the connections made from now on from a list like
+// "nodelay=0,rcvbuf=1048576" (see ParseTuning). Returns -1 if the list is
+// bad.
+int SetClientTuning(char *options) {
+	return ParseTuning(&clientTuning, options);
+}
+
+// Connects to target, which is a port on localhost, "host:port" (with an
+// IPv6 address in brackets) or, if it contains a slash, the path of a
+// daemon's Unix socket. Each address the host resolves to is tried in
+// turn. Exits with an error if the daemon cannot be reached. Returns the
+// connected socket.
+static int OpenTarget(const char *target) {
+	int socketFD = -1;
+	struct sockaddr_un unixAddress;
+	struct addrinfo *addresses, *address;
+	char host[NET_HOST_SIZE];
+	const char *port, *failure;
+
+	if (strchr(target, '/') != NULL) {
+		memset(&unixAddress, '\0', sizeof(unixAddress));
+		unixAddress.sun_family = AF_UNIX;
+		if (strlen(target) >= sizeof(unixAddress.sun_path)) {
+			fprintf(stderr, "ERROR: bad socket %s\n", target); exit(2);
+		}
+		strcpy(unixAddress.sun_path, target);
+		socketFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (socketFD < 0 || connect(socketFD, (struct sockaddr*)&unixAddress, sizeof(unixAddress)) < 0) {
+			fprintf(stderr, "ERROR: bad socket %s\n", target); exit(2);
+		}
+		return socketFD;
+	}
+
+	// Convert the host (localhost unless given) into its addresses
+	if (SplitEndpoint(target, host, sizeof(host), &port) < 0) {
+		fprintf(stderr, "ERROR: bad port %s\n", target); exit(2);
+	}
+	addresses = ResolveEndpoint(host[0] != '\0' ? host : NET_DEFAULT_HOST, port, 0, &failure);
+	if (addresses == NULL) {
+		fprintf(stderr, "ERROR: could not resolve %s: %s\n", target, failure); exit(2);
+	}
+
+	// Set up the socket and connect to the server, at the first address
+	// that answers
+	for (address = addresses; address != NULL; address = address->ai_next) {
+		socketFD = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol); // Create the socket
+		if (socketFD < 0) continue;
+		TuneSocket(socketFD, &clientTuning);
+		if (connect(socketFD, address->ai_addr, address->ai_addrlen) == 0) break; // Connect socket to address
+		close(socketFD);
+		socketFD = -1;
+	}
+	freeaddrinfo(addresses);
+	if (socketFD < 0) {
+		fprintf(stderr, "ERROR: bad port %s\n", target); exit(2);
+	}
+	return socketFD;
+}
+
+// Connects to the daemon at target (a port or a Unix socket path) and sends
+// the client identifier. Exits with an error if the daemon cannot be
+// reached or does not answer OK. Returns the connected socket.
+int ConnectServer(const char *prog, const char *otherDaemon, const char *target, const char *id) {
+	int socketFD, charsWritten, charsRead, tempChars;
+	char servVer[3], message[128];
+
+	socketFD = OpenTarget(target);
+
+	// Send client identifier to server
+	charsWritten = send(socketFD, id, 3, 0); // Write to the server
+	if (charsWritten != 3) ClientError(prog, "had issue writing to socket");
+
+	// Get OK from server (if allowed to connect)
+	memset(servVer, '\0', sizeof(servVer));
+	charsRead = 0;
+	while (charsRead < 2) {
+		tempChars = recv(socketFD, &servVer[charsRead], 2 - charsRead, 0);
+		if (tempChars <= 0) ClientError(prog, "had issue reading from socket");
+		charsRead += tempChars;
+	}
+	if (strcmp(servVer, ID_BUSY) == 0) {
+		snprintf(message, sizeof(message), "%s was turned away by a busy %s", prog, otherDaemon);
+		error(message, 1);
+	}
+	if (strcmp(servVer, "OK") != 0) {
+		snprintf(message, sizeof(message), "%s is not verified to connect to %s", prog, otherDaemon);
+		error(message, 1);
+	}
+
+	return socketFD;
+}
+
+// Sends one message through a shared memory ring session on a daemon's
+// ring socket (-R) and writes the result to outFD. The text and key are
+// read straight into a sealed memfd that the daemon maps and ciphers in
+// place, so none of the message passes through a socket.
+void RingMessage(const char *prog, const char *otherDaemon, const char *path, char op,
+		int textFD, int keyFD, const char *textName, const char *keyName, int outFD) {
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct RingHeader *header;
+	struct RingSlot *slot;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct pollfd pfds[2];
+	char *data, servVer[3], message[256];
+	int socketFD, memFD, fds[3], charsRead, tempChars;
+	off_t fileSize;
+	size_t messageLength, mapSize;
+	uint64_t count = 1;
+
+	// The last char of the text is the newline, which is not ciphered
+	fileSize = FileSize(textFD, textName);
+	messageLength = fileSize > 0 ? fileSize - 1 : 0;
+	if (FileSize(keyFD, keyName) < fileSize) error("Key file is too short", 1);
+
+	// Size the ring for the one message and seal it so the daemon can map
+	// it safely
+	mapSize = RING_HEADER_SIZE + 2 * messageLength;
+	memFD = memfd_create("otp_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memFD < 0 || ftruncate(memFD, mapSize) < 0 || fcntl(memFD, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+		ClientError(prog, "could not create ring");
+	header = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, memFD, 0);
+	if (header == MAP_FAILED) ClientError(prog, "could not map ring");
+	header->magic = RING_MAGIC;
+	header->dataSize = 2 * messageLength;
+	data = (char *)header + RING_HEADER_SIZE;
+
+	if (ReadFull(textFD, data, messageLength) != (ssize_t)messageLength) ClientError(prog, "had issue reading input");
+	if (ReadFull(keyFD, data + messageLength, messageLength) != (ssize_t)messageLength) ClientError(prog, "had issue reading input");
+	CheckInputs(data, data + messageLength, messageLength, 0, textName, keyName);
+
+	// Pass the ring and its two doorbells to the daemon with the handshake
+	fds[0] = memFD;
+	fds[1] = eventfd(0, EFD_CLOEXEC);
+	fds[2] = eventfd(0, EFD_CLOEXEC);
+	if (fds[1] < 0 || fds[2] < 0) ClientError(prog, "could not create ring");
+	socketFD = OpenTarget(path);
+	memset(&msg, '\0', sizeof(msg));
+	iov.iov_base = (void *)ID_RING;
+	iov.iov_len = 3;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(socketFD, &msg, MSG_NOSIGNAL) != 3) ClientError(prog, "had issue writing to socket");
+
+	memset(servVer, '\0', sizeof(servVer));
+	charsRead = 0;
+	while (charsRead < 2) {
+		tempChars = recv(socketFD, &servVer[charsRead], 2 - charsRead, 0);
+		if (tempChars <= 0) ClientError(prog, "had issue reading from socket");
+		charsRead += tempChars;
+	}
+	if (strcmp(servVer, "OK") != 0) {
+		snprintf(message, sizeof(message), "%s is not verified to connect to %s", prog, otherDaemon);
+		error(message, 1);
+	}
+
+	// Post the message in slot 0 and ring the daemon
+	slot = &header->slots[0];
+	slot->offset = 0;
+	slot->length = messageLength;
+	slot->op = op;
+	slot->status = STATUS_OK;
+	__atomic_store_n(&header->head, 1, __ATOMIC_RELEASE);
+	if (write(fds[1], &count, sizeof(count)) != sizeof(count)) ClientError(prog, "could not signal ring");
+
+	// Wait for the slot to come back. The session socket only becomes
+	// readable if the daemon goes away.
+	while (__atomic_load_n(&header->tail, __ATOMIC_ACQUIRE) != 1) {
+		pfds[0].fd = socketFD;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = fds[2];
+		pfds[1].events = POLLIN;
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			ClientError(prog, "had issue waiting on ring");
+		}
+		if (pfds[1].revents & POLLIN) {
+			if (read(fds[2], &count, sizeof(count)) < 0 && errno != EINTR) ClientError(prog, "had issue waiting on ring");
+		}
+		else if (pfds[0].revents) ClientError(prog, "had issue reading from socket");
+	}
+
+	if (slot->status == STATUS_BUSY) {
+		snprintf(message, sizeof(message), "%s was turned away by a busy %s", prog, otherDaemon);
+		error(message, 1);
+	}
+	if (slot->status == STATUS_OVER_SIZE) {
+		snprintf(message, sizeof(message), "%s sent a message longer than the daemon allows", prog);
+		error(message, 1);
+	}
+	if (slot->status != STATUS_OK) {
+		snprintf(message, sizeof(message), "%s was refused by the daemon (status %d)", prog, slot->status);
+		error(message, 1);
+	}
+
+	// The result overwrote the key
+	WriteFull(prog, outFD, data + messageLength, messageLength);
+	WriteFull(prog, outFD, "\n", 1);
+
+	close(socketFD);
+	close(fds[1]);
+	close(fds[2]);
+	munmap(header, mapSize);
+	close(memFD);
+}
+
+// Exits with the error for a reply frame status other than STATUS_OK
+static void StatusError(const char *prog, int status) {
+	char message[256];
+
+	if (status == STATUS_BUSY) snprintf(message, sizeof(message), "%s was turned away by a busy daemon", prog);
+	else if (status == STATUS_OVER_SIZE) snprintf(message, sizeof(message), "%s sent a message longer than the daemon allows", prog);
+	else snprintf(message, sizeof(message), "%s was refused by the daemon (status %d)", prog, status);
+	error(message, 1);
+}
+
+// Largest frame a client sends: header, text chunk and key chunk
+#define MAX_FRAME_SIZE (FRAME_HEADER_SIZE + 2 * STREAM_CHUNK_SIZE)
+
+// Buffers and progress for a pipelined run of messages over one connection
+struct Stream {
+	const char *prog;
+	char op;
+	int socketFD;
+	struct Message *messages;
+	int count;
+	int defaultOutFD;	// Output for messages without an output file
+	int packed;			// 1 if chunks go both ways packed 5 bits per char
+
+	// Sending side
+	int sendIndex;		// Message that frames are being built from
+	int textFD, keyFD;	// Its open inputs (-1 when none is open)
+	char *textBuf;		// Text read ahead of the next frame
+	size_t have;		// Chars in textBuf
+	int textEOF;		// 1 once the current text input is used up
+	int textStream;		// 1 if the text input is a pipe or the like, read as it comes
+	int textReady;		// 1 once poll has found the streamed text input readable
+	uint64_t sent;		// Chars of the current message sent so far
+	char *sendBuf;		// Frames waiting to go out
+	size_t sendLen, sendDone;
+
+	// Receiving side
+	int replyIndex;		// Message that replies are arriving for
+	int outFD;			// Its open output (-1 when none is open)
+	char *recvBuf;		// Reply bytes received but not yet handled
+	size_t recvLen;
+	char *unpacked;		// A packed reply chunk, unpacked for writing out
+	uint64_t padReplied;	// Chars of the current pad message answered so far
+};
+
+// Opens the inputs of the next message to be sent
+static void StartMessage(struct Stream *stream) {
+	struct Message *msg = &stream->messages[stream->sendIndex];
+	char message[256];
+
+	struct stat info;
+
+	stream->textFD = msg->textFD >= 0 ? msg->textFD : OpenInput(msg->textName);
+	stream->keyFD = msg->pad ? -1 : msg->keyFD >= 0 ? msg->keyFD : OpenInput(msg->keyName);
+	if (stream->textFD < 0 || (!msg->pad && stream->keyFD < 0)) {
+		snprintf(message, sizeof(message), "Can't open %s", stream->textFD < 0 ? msg->textName : msg->keyName);
+		error(message, 1);
+	}
+	if (!msg->pad) CheckKeyLength(stream->textFD, stream->keyFD);
+	stream->textStream = fstat(stream->textFD, &info) == 0 && !S_ISREG(info.st_mode);
+	stream->textReady = 0;
+	stream->have = 0;
+	stream->textEOF = 0;
+	stream->sent = 0;
+}
+
+// Reads the next chunk of text and key and appends a frame around them to
+// the send buffer. The last char of text is held back until the input ends
+// so the trailing newline can be dropped, as the original protocol does.
+// A streamed text input is read once, for whatever it has ready, so its
+// frames go out as the text arrives rather than a full chunk at a time.
+static void NextFrame(struct Stream *stream) {
+	struct Message *msg;
+	struct FrameHeader header;
+	ssize_t tempChars;
+	size_t sendable, chunk, extra, size;
+	uint64_t padField;
+	char *frame;
+
+	msg = &stream->messages[stream->sendIndex];
+	frame = stream->sendBuf + stream->sendLen;
+
+	// Pad frames carry a pad offset after the header and no key. An encoded
+	// message asks for pad for all of its text (the file size is enough)
+	// in its first frame; a decoded one names where each chunk was encoded.
+	extra = msg->pad ? PAD_OFFSET_SIZE : 0;
+	if (msg->pad) {
+		if (stream->op == OP_DECODE) padField = msg->padOffset + stream->sent;
+		else padField = stream->sent == 0 ? (uint64_t)FileSize(stream->textFD, msg->textName) : 0;
+		PackPadOffset((unsigned char *)frame + FRAME_HEADER_SIZE, padField);
+	}
+
+	// Top up the read-ahead buffer
+	if (!stream->textEOF && stream->textStream) {
+		stream->textReady = 0;
+		do tempChars = read(stream->textFD, stream->textBuf + stream->have, STREAM_CHUNK_SIZE + 1 - stream->have);
+		while (tempChars < 0 && errno == EINTR);
+		if (tempChars < 0) ClientError(stream->prog, "had issue reading input");
+		stream->have += tempChars;
+		if (tempChars == 0) {
+			stream->textEOF = 1;
+			if (stream->have > 0 && stream->textBuf[stream->have - 1] == '\n') stream->have--;
+		}
+	}
+	else if (!stream->textEOF) {
+		tempChars = ReadFull(stream->textFD, stream->textBuf + stream->have, STREAM_CHUNK_SIZE + 1 - stream->have);
+		if (tempChars < 0) ClientError(stream->prog, "had issue reading input");
+		stream->have += tempChars;
+		if (stream->have < STREAM_CHUNK_SIZE + 1) {
+			stream->textEOF = 1;
+			if (stream->have > 0 && stream->textBuf[stream->have - 1] == '\n') stream->have--;
+		}
+	}
+	sendable = stream->textEOF ? stream->have : stream->have - 1;
+	chunk = sendable < STREAM_CHUNK_SIZE ? sendable : STREAM_CHUNK_SIZE;
+
+	// Nothing to frame until more of the stream comes
+	if (chunk == 0 && !stream->textEOF) return;
+
+	// Copy in the text and read the matching key
+	memcpy(frame + FRAME_HEADER_SIZE + extra, stream->textBuf, chunk);
+	memmove(stream->textBuf, stream->textBuf + chunk, stream->have - chunk);
+	stream->have -= chunk;
+	if (!msg->pad && ReadFull(stream->keyFD, frame + FRAME_HEADER_SIZE + chunk, chunk) != (ssize_t)chunk)
+		error("Key file is too short", 1);
+
+	// Verify text and key characters are valid, while the chunk is still
+	// in cache from the copy and read
+	CheckInputs(frame + FRAME_HEADER_SIZE + extra, msg->pad ? NULL : frame + FRAME_HEADER_SIZE + chunk, chunk,
+		stream->sent, msg->textName, msg->keyName);
+
+	// A packed connection sends the text and key 5 bits per char, packed
+	// where they lie in the frame
+	size = chunk;
+	if (stream->packed) {
+		size = PACKED_SIZE(chunk);
+		PackText((unsigned char *)frame + FRAME_HEADER_SIZE + extra, frame + FRAME_HEADER_SIZE + extra, chunk);
+		if (!msg->pad) PackText((unsigned char *)frame + FRAME_HEADER_SIZE + size, frame + FRAME_HEADER_SIZE + chunk, chunk);
+	}
+
+	// Fill in the header, marking the final frame of the message
+	memset(&header, '\0', sizeof(header));
+	header.op = stream->op;
+	header.length = chunk;
+	if (stream->textEOF && stream->have == 0) header.flags = FRAME_LAST;
+	if (msg->pad) header.flags |= FRAME_PAD;
+	PackFrameHeader((unsigned char *)frame, &header);
+	stream->sendLen += FRAME_HEADER_SIZE + extra + (msg->pad ? size : 2 * size);
+	stream->sent += chunk;
+
+	// Move on to the next message once this one is fully framed
+	if (header.flags & FRAME_LAST) {
+		close(stream->textFD);
+		if (stream->keyFD >= 0) close(stream->keyFD);
+		stream->textFD = stream->keyFD = -1;
+		stream->sendIndex++;
+	}
+}
+
+// Writes out every complete reply frame in the receive buffer, in order,
+// and keeps any partial frame for the next read. The pad range an encoded
+// pad message used is reported on stderr as "pad OFFSET LENGTH", which is
+// what otp_dec --pad needs to decode it.
+static void HandleReplies(struct Stream *stream) {
+	struct FrameHeader reply;
+	struct Message *msg;
+	size_t pos = 0, extra, size;
+	char *result, message[256];
+
+	while (stream->recvLen - pos >= FRAME_HEADER_SIZE) {
+		// Check the header before waiting on its chunk
+		UnpackFrameHeader((unsigned char *)stream->recvBuf + pos, &reply);
+		if (reply.status != STATUS_OK) StatusError(stream->prog, reply.status);
+		if (reply.length > STREAM_CHUNK_SIZE || stream->replyIndex >= stream->count)
+			ClientError(stream->prog, "received a bad frame");
+		extra = (reply.flags & FRAME_PAD) ? PAD_OFFSET_SIZE : 0;
+		size = stream->packed ? PACKED_SIZE(reply.length) : reply.length;
+		if (stream->recvLen - pos < FRAME_HEADER_SIZE + extra + size) break;
+
+		// Open the output when the first result for a message arrives
+		msg = &stream->messages[stream->replyIndex];
+		if (extra && stream->padReplied == 0)
+			msg->padOffset = UnpackPadOffset((unsigned char *)stream->recvBuf + pos + FRAME_HEADER_SIZE);
+		stream->padReplied += reply.length;
+		if (stream->outFD < 0) {
+			stream->outFD = msg->outName ? open(msg->outName, O_WRONLY | O_CREAT | O_TRUNC, 0644) : stream->defaultOutFD;
+			if (stream->outFD < 0) {
+				snprintf(message, sizeof(message), "Can't open %s", msg->outName);
+				error(message, 1);
+			}
+		}
+		result = stream->recvBuf + pos + FRAME_HEADER_SIZE + extra;
+		if (stream->packed) {
+			if (!UnpackText(stream->unpacked, (unsigned char *)result, reply.length))
+				ClientError(stream->prog, "received a bad frame");
+			result = stream->unpacked;
+		}
+		WriteFull(stream->prog, stream->outFD, result, reply.length);
+
+		// The last frame of a message ends its output with a newline
+		if (reply.flags & FRAME_LAST) {
+			WriteFull(stream->prog, stream->outFD, "\n", 1);
+			if (msg->outName) close(stream->outFD);
+			if (extra && stream->op == OP_ENCODE)
+				fprintf(stderr, "pad %llu %llu\n", (unsigned long long)msg->padOffset, (unsigned long long)stream->padReplied);
+			stream->outFD = -1;
+			stream->padReplied = 0;
+			stream->replyIndex++;
+		}
+		pos += FRAME_HEADER_SIZE + extra + size;
+	}
+
+	memmove(stream->recvBuf, stream->recvBuf + pos, stream->recvLen - pos);
+	stream->recvLen -= pos;
+}
+
+// Sends a run of messages over an established framed connection and
+// writes each result out as its frames come back. Frames for later messages
+// are sent without waiting on replies to earlier ones, and small frames are
+// packed into the same send. Results come back in order, each followed by a
+// newline. Memory use does not depend on the size or number of messages.
+// Text from a pipe or terminal is waited on alongside the socket, so the
+// results of what has been read are written out while more is on its way.
+// packed says the connection was opened with the packed handshake.
+void StreamMessages(const char *prog, int socketFD, char op, int packed, struct Message *messages, int count, int outFD) {
+	struct Stream stream;
+	struct pollfd pfds[2];
+	ssize_t tempChars;
+	int shutDown = 0, numFDs;
+
+	// Create buffers for the read-ahead text, outgoing frames and replies
+	memset(&stream, '\0', sizeof(stream));
+	stream.prog = prog;
+	stream.op = op;
+	stream.socketFD = socketFD;
+	stream.messages = messages;
+	stream.count = count;
+	stream.defaultOutFD = outFD;
+	stream.packed = packed;
+	stream.textFD = stream.keyFD = stream.outFD = -1;
+	stream.textBuf = malloc(STREAM_CHUNK_SIZE + 1);
+	stream.sendBuf = malloc(2 * MAX_FRAME_SIZE);
+	stream.recvBuf = malloc(2 * MAX_FRAME_SIZE);
+	stream.unpacked = malloc(STREAM_CHUNK_SIZE);
+	if (stream.textBuf == NULL || stream.sendBuf == NULL || stream.recvBuf == NULL || stream.unpacked == NULL)
+		ClientError(prog, "could not allocate buffers");
+
+	while (stream.replyIndex < count) {
+		// Queue up frames while there is room for a full-size one
+		if (stream.sendDone == stream.sendLen) stream.sendDone = stream.sendLen = 0;
+		if (stream.sendIndex < count && 2 * MAX_FRAME_SIZE - stream.sendLen < MAX_FRAME_SIZE && stream.sendDone > 0) {
+			memmove(stream.sendBuf, stream.sendBuf + stream.sendDone, stream.sendLen - stream.sendDone);
+			stream.sendLen -= stream.sendDone;
+			stream.sendDone = 0;
+		}
+		while (stream.sendIndex < count && 2 * MAX_FRAME_SIZE - stream.sendLen >= MAX_FRAME_SIZE) {
+			if (stream.textFD < 0) StartMessage(&stream);
+			if (stream.textStream && !stream.textEOF && !stream.textReady) break;
+			NextFrame(&stream);
+		}
+
+		// Let the daemon know nothing more is coming
+		if (!shutDown && stream.sendIndex == count && stream.sendDone == stream.sendLen) {
+			shutdown(socketFD, SHUT_WR);
+			shutDown = 1;
+		}
+
+		// Wait until the socket can take more or has replies waiting, or
+		// more of a streamed text has come
+		pfds[0].fd = socketFD;
+		pfds[0].events = POLLIN;
+		if (stream.sendDone < stream.sendLen) pfds[0].events |= POLLOUT;
+		numFDs = 1;
+		if (stream.sendIndex < count && stream.textStream && !stream.textEOF && !stream.textReady &&
+				2 * MAX_FRAME_SIZE - stream.sendLen >= MAX_FRAME_SIZE) {
+			pfds[1].fd = stream.textFD;
+			pfds[1].events = POLLIN;
+			numFDs = 2;
+		}
+		if (poll(pfds, numFDs, -1) < 0) {
+			if (errno == EINTR) continue;
+			ClientError(prog, "had issue polling socket");
+		}
+		if (numFDs == 2 && pfds[1].revents) stream.textReady = 1;
+
+		if (pfds[0].revents & POLLOUT) {
+			tempChars = send(socketFD, stream.sendBuf + stream.sendDone, stream.sendLen - stream.sendDone, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (tempChars < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				ClientError(prog, "had issue writing to socket");
+			if (tempChars > 0) stream.sendDone += tempChars;
+		}
+		if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			tempChars = recv(socketFD, stream.recvBuf + stream.recvLen, 2 * MAX_FRAME_SIZE - stream.recvLen, MSG_DONTWAIT);
+			if (tempChars < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+			if (tempChars <= 0) ClientError(prog, "had issue reading from socket");
+			stream.recvLen += tempChars;
+			HandleReplies(&stream);
+		}
+	}
+
+	free(stream.textBuf);
+	free(stream.sendBuf);
+	free(stream.recvBuf);
+	free(stream.unpacked);
+}
+
+// One connection of a parallel message and the range of it that the
+// connection carries
+struct Lane {
+	int fd;				// Connection, or -1 once its range is finished
+	size_t start, end;	// Range of the message, in chars
+	size_t framed;		// End of the text framed so far
+	int lastSent;		// 1 once the final frame is fully sent
+	unsigned char header[FRAME_HEADER_SIZE];	// Frame being sent: its header,
+	size_t chunk, frameLen, frameDone;	// text chunk, size and bytes sent
+	unsigned char reply[FRAME_HEADER_SIZE];	// Reply header being read
+	size_t replyDone, replyLeft;
+	int replyLast;		// 1 once the final reply frame's header is in
+	size_t received;	// Result chars received
+};
+
+// A message split across several connections
+struct Fanout {
+	const char *prog;
+	char op;
+	const char *text, *key;	// Mapped inputs
+	char *result;			// Results, reassembled here in order
+	struct Lane *lanes;
+	int numLanes;
+	int flushLane;			// First lane whose results are not all written
+	size_t flushed;			// Result chars written out
+	size_t released;		// Result bytes handed back to the kernel
+	int outFD;
+};
+
+// Sends as much of a lane's range as its socket takes. Frames are sent
+// straight from the mapped inputs with one sendmsg per frame.
+static void SendLane(struct Fanout *fan, struct Lane *lane) {
+	struct FrameHeader header;
+	struct iovec iov[3];
+	struct msghdr msg;
+	size_t skip, chunkStart;
+	ssize_t tempChars;
+	int i;
+
+	while (!lane->lastSent) {
+		// Start the next frame once the last one is out
+		if (lane->frameDone == lane->frameLen) {
+			lane->chunk = lane->end - lane->framed < STREAM_CHUNK_SIZE ? lane->end - lane->framed : STREAM_CHUNK_SIZE;
+			memset(&header, '\0', sizeof(header));
+			header.op = fan->op;
+			header.length = lane->chunk;
+			if (lane->framed + lane->chunk == lane->end) header.flags = FRAME_LAST;
+			PackFrameHeader(lane->header, &header);
+			lane->framed += lane->chunk;
+			lane->frameLen = FRAME_HEADER_SIZE + 2 * lane->chunk;
+			lane->frameDone = 0;
+		}
+
+		// Send what is left of it
+		chunkStart = lane->framed - lane->chunk;
+		iov[0].iov_base = lane->header;
+		iov[0].iov_len = FRAME_HEADER_SIZE;
+		iov[1].iov_base = (char *)fan->text + chunkStart;
+		iov[1].iov_len = lane->chunk;
+		iov[2].iov_base = (char *)fan->key + chunkStart;
+		iov[2].iov_len = lane->chunk;
+		for (i = 0, skip = lane->frameDone; skip >= iov[i].iov_len && i < 2; skip -= iov[i].iov_len, i++);
+		iov[i].iov_base = (char *)iov[i].iov_base + skip;
+		iov[i].iov_len -= skip;
+		memset(&msg, '\0', sizeof(msg));
+		msg.msg_iov = iov + i;
+		msg.msg_iovlen = 3 - i;
+		tempChars = sendmsg(lane->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (tempChars < 0 && errno == EINTR) continue;
+		if (tempChars < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+		if (tempChars < 0) ClientError(fan->prog, "had issue writing to socket");
+		lane->frameDone += tempChars;
+		if (lane->frameDone == lane->frameLen && lane->framed == lane->end) {
+			lane->lastSent = 1;
+			shutdown(lane->fd, SHUT_WR);
+		}
+	}
+}
+
+// Reads what has come back on a lane, taking results straight into their
+// place in the result buffer
+static void ReceiveLane(struct Fanout *fan, struct Lane *lane) {
+	struct FrameHeader reply;
+	ssize_t tempChars;
+
+	while (lane->fd >= 0) {
+		if (lane->replyDone < FRAME_HEADER_SIZE) {
+			tempChars = recv(lane->fd, lane->reply + lane->replyDone, FRAME_HEADER_SIZE - lane->replyDone, MSG_DONTWAIT);
+		}
+		else tempChars = recv(lane->fd, fan->result + lane->start + lane->received, lane->replyLeft, MSG_DONTWAIT);
+		if (tempChars < 0 && errno == EINTR) continue;
+		if (tempChars < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+		if (tempChars <= 0) ClientError(fan->prog, "had issue reading from socket");
+
+		if (lane->replyDone < FRAME_HEADER_SIZE) {
+			lane->replyDone += tempChars;
+			if (lane->replyDone < FRAME_HEADER_SIZE) continue;
+			UnpackFrameHeader(lane->reply, &reply);
+			if (reply.status != STATUS_OK) StatusError(fan->prog, reply.status);
+			if (reply.length > lane->end - lane->start - lane->received) ClientError(fan->prog, "received a bad frame");
+			lane->replyLeft = reply.length;
+			lane->replyLast = (reply.flags & FRAME_LAST) != 0;
+		}
+		else {
+			lane->received += tempChars;
+			lane->replyLeft -= tempChars;
+		}
+
+		// A finished reply frame; the last one finishes the lane
+		if (lane->replyDone == FRAME_HEADER_SIZE && lane->replyLeft == 0) {
+			lane->replyDone = 0;
+			if (lane->replyLast) {
+				if (lane->received != lane->end - lane->start) ClientError(fan->prog, "received a bad frame");
+				close(lane->fd);
+				lane->fd = -1;
+			}
+		}
+	}
+}
+
+// Writes out the results that are now in order: everything received on
+// the first unfinished lane, and past it once it is done. Pages already
+// written are given back so memory stays near the unwritten results.
+static void FlushLanes(struct Fanout *fan) {
+	struct Lane *lane;
+	size_t upTo, page = sysconf(_SC_PAGESIZE), release;
+
+	while (fan->flushLane < fan->numLanes) {
+		lane = &fan->lanes[fan->flushLane];
+		upTo = lane->start + lane->received;
+		if (upTo > fan->flushed) {
+			WriteFull(fan->prog, fan->outFD, fan->result + fan->flushed, upTo - fan->flushed);
+			fan->flushed = upTo;
+		}
+		if (lane->fd >= 0) break;
+		fan->flushLane++;
+	}
+
+	release = fan->flushed / page * page;
+	if (release > fan->released) {
+		madvise(fan->result + fan->released, release - fan->released, MADV_DONTNEED);
+		fan->released = release;
+	}
+}
+
+// Splits a comma separated list of targets in place. Returns the number
+// found, at most max.
+int SplitTargets(char *list, char **targets, int max) {
+	char *savePtr, *target;
+	int count = 0;
+
+	for (target = strtok_r(list, ",", &savePtr); target != NULL && count < max; target = strtok_r(NULL, ",", &savePtr))
+		targets[count++] = target;
+	return count;
+}
+
+// Encodes or decodes one message over several connections at once, so
+// several daemon processes or threads can cipher it in parallel. The text
+// is split into up to numLanes ranges aligned to the frame size, and lane i
+// connects to targets[i % numTargets]. The ranges are sent concurrently
+// with the framed protocol, straight from the mapped inputs, and the
+// results are written to outFD in order, followed by a newline.
+void ParallelMessage(const char *prog, const char *otherDaemon, char *const *targets, int numTargets, int numLanes,
+		char op, const char *text, const char *key, size_t messageLength, int outFD) {
+	struct Fanout fan;
+	struct Lane *lane;
+	struct pollfd *pfds;
+	size_t perLane, chunks;
+	int i, numFDs, flags;
+
+	// Split into whole frames, so every frame but the last is full size
+	chunks = (messageLength + STREAM_CHUNK_SIZE - 1) / STREAM_CHUNK_SIZE;
+	if ((size_t)numLanes > chunks) numLanes = chunks > 0 ? chunks : 1;
+	perLane = (chunks + numLanes - 1) / numLanes * STREAM_CHUNK_SIZE;
+
+	memset(&fan, '\0', sizeof(fan));
+	fan.prog = prog;
+	fan.op = op;
+	fan.text = text;
+	fan.key = key;
+	fan.outFD = outFD;
+	fan.numLanes = numLanes;
+	fan.lanes = calloc(numLanes, sizeof(struct Lane));
+	pfds = calloc(numLanes, sizeof(struct pollfd));
+	fan.result = messageLength > 0 ? mmap(NULL, messageLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : NULL;
+	if (fan.lanes == NULL || pfds == NULL || fan.result == MAP_FAILED) ClientError(prog, "could not allocate buffers");
+
+	for (i = 0; i < numLanes; i++) {
+		lane = &fan.lanes[i];
+		lane->start = lane->framed = i * perLane < messageLength ? i * perLane : messageLength;
+		lane->end = (i + 1) * perLane < messageLength ? (i + 1) * perLane : messageLength;
+		lane->fd = ConnectServer(prog, otherDaemon, targets[i % numTargets], op == OP_ENCODE ? ID_ENCODE_STREAM : ID_DECODE_STREAM);
+		flags = fcntl(lane->fd, F_GETFL);
+		fcntl(lane->fd, F_SETFL, flags | O_NONBLOCK);
+	}
+
+	while (fan.flushLane < numLanes) {
+		for (i = numFDs = 0; i < numLanes; i++) {
+			if (fan.lanes[i].fd < 0) continue;
+			pfds[numFDs].fd = fan.lanes[i].fd;
+			pfds[numFDs].events = POLLIN | (fan.lanes[i].lastSent ? 0 : POLLOUT);
+			numFDs++;
+		}
+		if (numFDs > 0 && poll(pfds, numFDs, -1) < 0) {
+			if (errno == EINTR) continue;
+			ClientError(prog, "had issue polling socket");
+		}
+
+		for (i = numFDs = 0; i < numLanes; i++) {
+			lane = &fan.lanes[i];
+			if (lane->fd < 0) continue;
+			if (pfds[numFDs].revents & POLLOUT) SendLane(&fan, lane);
+			if (pfds[numFDs].revents & (POLLIN | POLLHUP | POLLERR)) ReceiveLane(&fan, lane);
+			numFDs++;
+		}
+		FlushLanes(&fan);
+	}
+	WriteFull(prog, outFD, "\n", 1);
+
+	if (fan.result != NULL) munmap(fan.result, messageLength);
+	free(fan.lanes);
+	free(pfds);
+}
+
+// Messages a pooled run holds in memory at once, loaded and waiting on
+// their results
+#define POOL_WINDOW 256
+
+// A message of a pooled run, read into memory
+struct Pooled {
+	char *text, *key, *out;
+	size_t textSize, keySize;	// Bytes held, for unmapping or freeing
+	int textMapped, keyMapped;	// 1 if held in a mapping rather than malloc'd
+	size_t n;					// Chars in the message
+	int finished, status;
+};
+
+// Reads a whole input for a pooled message: a regular file is mapped, and
+// anything else (standard input, a pipe) read to its end. Sets size to
+// the bytes held.
+static char *LoadInput(const char *prog, int fd, size_t *size, int *mapped) {
+	struct stat info;
+	char *buffer = NULL, *grown;
+	size_t capacity = 0;
+	ssize_t tempChars;
+
+	*size = 0;
+	*mapped = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+	if (*mapped) {
+		*size = info.st_size;
+		return (char *)MapFile(prog, fd, *size);
+	}
+
+	for (;;) {
+		if (*size == capacity) {
+			capacity = capacity ? capacity * 2 : STREAM_CHUNK_SIZE;
+			grown = realloc(buffer, capacity);
+			if (grown == NULL) ClientError(prog, "could not allocate buffers");
+			buffer = grown;
+		}
+		tempChars = ReadFull(fd, buffer + *size, capacity - *size);
+		if (tempChars < 0) ClientError(prog, "had issue reading input");
+		*size += tempChars;
+		if (*size < capacity) return buffer;
+	}
+}
+
+// Releases an input held by LoadInput
+static void ReleaseInput(char *buffer, size_t size, int mapped) {
+	if (!mapped) free(buffer);
+	else if (buffer != NULL) munmap(buffer, size);
+}
+
+// Loads a message's text and key and checks them, as the framed protocol
+// does: a trailing newline on the text is dropped and the key must cover
+// the rest
+static void LoadMessage(const char *prog, struct Message *msg, struct Pooled *slot) {
+	int textFD, keyFD;
+	char message[256];
+
+	textFD = msg->textFD >= 0 ? msg->textFD : OpenInput(msg->textName);
+	keyFD = msg->keyFD >= 0 ? msg->keyFD : OpenInput(msg->keyName);
+	if (textFD < 0 || keyFD < 0) {
+		snprintf(message, sizeof(message), "Can't open %s", textFD < 0 ? msg->textName : msg->keyName);
+		error(message, 1);
+	}
+	CheckKeyLength(textFD, keyFD);
+	slot->text = LoadInput(prog, textFD, &slot->textSize, &slot->textMapped);
+	slot->n = slot->textSize;
+	if (slot->n > 0 && slot->text[slot->n - 1] == '\n') slot->n--;
+	slot->key = LoadInput(prog, keyFD, &slot->keySize, &slot->keyMapped);
+	if (slot->keySize < slot->n) error("Key file is too short", 1);
+	close(textFD);
+	close(keyFD);
+
+	CheckInputs(slot->text, slot->key, slot->n, 0, msg->textName, msg->keyName);
+	slot->out = malloc(slot->n > 0 ? slot->n : 1);
+	if (slot->out == NULL) ClientError(prog, "could not allocate buffers");
+	slot->finished = 0;
+}
+
+// OtpDone for a pooled message
+static void PoolDone(void *arg, int status, char *out, size_t n) {
+	struct Pooled *slot = arg;
+
+	slot->status = status;
+	slot->finished = 1;
+}
+
+// Exits with the error for a pool message or connect that failed
+static void PoolError(const char *prog, const char *otherDaemon, const char *targets, int status) {
+	char message[256];
+
+	if (status >= 0) StatusError(prog, status);
+	if (status == OTP_ERR_BUSY) {
+		snprintf(message, sizeof(message), "%s was turned away by a busy %s", prog, otherDaemon);
+		error(message, 1);
+	}
+	if (status == OTP_ERR_CONNECT) {
+		fprintf(stderr, "ERROR: could not connect to %s\n", targets); exit(2);
+	}
+	if (status == OTP_ERR_NOMEM) ClientError(prog, "could not allocate buffers");
+	ClientError(prog, "had issue reading from socket");
+}
+
+// Sends a run of messages through a libotp pool over the daemons listed in
+// targets (separated by commas), keeping perDaemon connections to each.
+// Each message goes to the daemon the balance rule picks, and one cut off
+// by a daemon that fails is sent again to another. Up to POOL_WINDOW
+// messages are held at once; results are written out in manifest order,
+// each followed by a newline.
+void PoolMessages(const char *prog, const char *otherDaemon, const char *targets, int perDaemon, int balance,
+		char op, struct Message *messages, int count, int outFD) {
+	struct OtpPool *pool;
+	struct Pooled *slots, *slot;
+	struct Message *msg;
+	int next = 0, written = 0, status, fd;
+	char message[256];
+
+	slots = calloc(POOL_WINDOW, sizeof(struct Pooled));
+	if (slots == NULL) ClientError(prog, "could not allocate buffers");
+	status = OtpPoolOpen(&pool, targets, perDaemon, balance, op);
+	if (status != STATUS_OK) PoolError(prog, otherDaemon, targets, status);
+
+	while (written < count) {
+		// Keep the window full
+		while (next < count && next - written < POOL_WINDOW) {
+			slot = &slots[next % POOL_WINDOW];
+			LoadMessage(prog, &messages[next], slot);
+			status = OtpPoolSubmit(pool, op, slot->text, slot->key, slot->out, slot->n, PoolDone, slot);
+			if (status != STATUS_OK) PoolError(prog, otherDaemon, targets, status);
+			next++;
+		}
+
+		// Wait for the oldest result, then write out all that are in order
+		slot = &slots[written % POOL_WINDOW];
+		if (!slot->finished && OtpPoolPoll(pool, -1) < 0) ClientError(prog, "had issue polling socket");
+		while (written < count && (slot = &slots[written % POOL_WINDOW])->finished) {
+			if (slot->status != STATUS_OK) PoolError(prog, otherDaemon, targets, slot->status);
+			msg = &messages[written];
+			fd = msg->outName ? open(msg->outName, O_WRONLY | O_CREAT | O_TRUNC, 0644) : outFD;
+			if (fd < 0) {
+				snprintf(message, sizeof(message), "Can't open %s", msg->outName);
+				error(message, 1);
+			}
+			WriteFull(prog, fd, slot->out, slot->n);
+			WriteFull(prog, fd, "\n", 1);
+			if (msg->outName) close(fd);
+
+			ReleaseInput(slot->text, slot->textSize, slot->textMapped);
+			ReleaseInput(slot->key, slot->keySize, slot->keyMapped);
+			free(slot->out);
+			slot->finished = 0;
+			written++;
+		}
+	}
+
+	OtpPoolClose(pool);
+	free(slots);
+}
+
+// Reads a batch manifest: one message per line, naming the text file, the
+// key file and optionally an output file. Blank lines and lines starting
+// with # are skipped. Returns the messages and sets count.
+struct Message *ReadManifest(const char *prog, const char *path, int *count) {
+	FILE *manifest = fopen(path, "r");
+	struct Message *messages = NULL, *msg;
+	char *line = NULL, *fields[3], *savePtr;
+	size_t lineSize = 0;
+	int capacity = 0, numFields;
+	char message[256];
+
+	if (manifest == NULL) {
+		snprintf(message, sizeof(message), "Can't open manifest %s", path);
+		error(message, 1);
+	}
+
+	*count = 0;
+	while (getline(&line, &lineSize, manifest) != -1) {
+		// Split the line into its fields
+		numFields = 0;
+		fields[0] = strtok_r(line, " \t\r\n", &savePtr);
+		while (numFields < 3 && fields[numFields] != NULL) {
+			numFields++;
+			if (numFields < 3) fields[numFields] = strtok_r(NULL, " \t\r\n", &savePtr);
+		}
+		if (numFields == 0 || fields[0][0] == '#') continue;
+		if (numFields < 2) {
+			snprintf(message, sizeof(message), "manifest line %d needs a text file and a key file", *count + 1);
+			error(message, 1);
+		}
+
+		// Grow the list as needed
+		if (*count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			messages = realloc(messages, capacity * sizeof(struct Message));
+			if (messages == NULL) ClientError(prog, "could not allocate manifest");
+		}
+		msg = &messages[(*count)++];
+		msg->textName = strdup(fields[0]);
+		msg->keyName = strdup(fields[1]);
+		msg->outName = numFields > 2 ? strdup(fields[2]) : NULL;
+		msg->textFD = msg->keyFD = -1;
+		msg->pad = 0;
+	}
+
+	free(line);
+	fclose(manifest);
+	return messages;
+}
@@ -0,0 +1,61 @@
+/*
+File: otp_client.h
+Author: Adeline Harcourt
+Description: Declarations for the connection and transfer code shared by
+		the otp_enc and otp_dec clients.
+*/
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "otp_proto.h"
+#include "otp_cipher.h"
+#include "otp_net.h"
+#include "otp.h"
+
+// One message for StreamMessages: its text and key inputs and where the
+// result goes. A descriptor of -1 means the file is opened by name, and an
+// outName of NULL sends the result to the stream's output. A pad message
+// has no key input; the daemon ciphers it with its key store, at padOffset
+// when decoding.
+struct Message {
+	const char *textName, *keyName, *outName;
+	int textFD, keyFD;
+	int pad;
+	uint64_t padOffset;
+};
+
+// Most connections (and daemons) a --parallel message is split across
+#define MAX_PARALLEL 64
+
+// Connections a pooled run keeps to each daemon unless --pool says, and
+// the most it may ask for
+#define DEFAULT_POOL_SIZE 2
+#define MAX_POOL_SIZE 64
+
+void error(const char *msg, int exitVal);
+
+int SetClientTuning(char *options);
+int ConnectServer(const char *prog, const char *otherDaemon, const char *target, const char *id);
+void RingMessage(const char *prog, const char *otherDaemon, const char *path, char op,
+	int textFD, int keyFD, const char *textName, const char *keyName, int outFD);
+int OpenInput(const char *name);
+int StreamInput(const char *name);
+int LegacyTooLong(const char *name);
+void CheckKeyLength(int textFD, int keyFD);
+off_t FileSize(int fd, const char *fileName);
+const char *MapFile(const char *prog, int fd, size_t len);
+void CheckInputs(const char *text, const char *key, size_t n, uint64_t start, const char *textName, const char *keyName);
+void SendFileRange(const char *prog, int socketFD, int fd, const char *map, size_t len);
+void ReceiveToFD(const char *prog, int socketFD, int outFD, size_t len);
+int SplitTargets(char *list, char **targets, int max);
+void ParallelMessage(const char *prog, const char *otherDaemon, char *const *targets, int numTargets, int numLanes,
+	char op, const char *text, const char *key, size_t messageLength, int outFD);
+void PoolMessages(const char *prog, const char *otherDaemon, const char *targets, int perDaemon, int balance,
+	char op, struct Message *messages, int count, int outFD);
+void StreamMessages(const char *prog, int socketFD, char op, int packed, struct Message *messages, int count, int outFD);
+struct Message *ReadManifest(const char *prog, const char *path, int *count);
+
+#endif
@@ -0,0 +1,27 @@
+/* 
+File: otp_d.c
+Author: Adeline Harcourt
+Description: A daemon that serves both otp_enc and otp_dec from one process.
+		Each client names the operation it wants in its handshake (and
+		framed clients in every frame header), so encoding and decoding
+		share the same listening sockets, engine and worker pool. Several
+		ports may be given; every one accepts both kinds of client. The
+		sockets, protocol and engines live in the shared server core
+		(otp_server.c), and the cipher in otp_cipher.c.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "otp_server.h"
+
+int main(int argc, char *argv[])
+{
+	struct ServerConfig config;
+
+	// Describe this daemon to the server core, then check input format from user
+	InitServerConfig(&config, "otp_d", SERVE_ENCODE | SERVE_DECODE);
+	ParseServerArgs(&config, argc, argv);
+
+	// Keep the daemon running
+	return RunServer(&config); 
+}
@@ -15,134 +15,225 @@ Description: A program that runs in the foreground and connects to otp_enc_d. Th
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h> 
-
-// Error function used for reporting issues
-void error(const char *msg, int exitVal) { 
-	fprintf(stderr, "ERROR: %s\n", msg); 
-	exit(exitVal); 
-} 
+#include <fcntl.h>
+#include <getopt.h>
+#include "otp_client.h"
 
 int main(int argc, char *argv[])
 {
-	int i, bufferSize, fileSizeC, socketFD, portNumber, tempChars, charsWritten, charsRead;
-	char servVer[3];
-	memset(servVer, '\0', sizeof(servVer));
-	struct sockaddr_in serverAddress;
-	struct hostent* serverHostInfo;
+	int opt, bufferSize, socketFD, charsWritten;
+	int streamMode = 0, padMode = 0, ringMode = 0, packed = 0, parallel = 0, numTargets, textFD, keyFD, count;
+	int pooled, poolSize = 0, balance = OTP_BALANCE_LEAST;
+	const char *manifestName = NULL, *target, *streamID;
+	struct Message single, *messages;
+	char *targets[MAX_PARALLEL];
+	static struct option longOptions[] = {
+		{ "batch", required_argument, NULL, 'b' },
+		{ "pad", no_argument, NULL, 'p' },
+		{ "ring", no_argument, NULL, 'r' },
+		{ "parallel", required_argument, NULL, 'n' },
+		{ "packed", no_argument, NULL, 'k' },
+		{ "tcp", required_argument, NULL, 't' },
+		{ "pool", required_argument, NULL, 'P' },
+		{ "balance", required_argument, NULL, 'B' },
+		{ NULL, 0, NULL, 0 }
+	};
+	off_t fileSizeC;
+	size_t messageLength;
+	const char *plainText, *key;
 	
-	// Check user input format
-	if (argc < 4) { 
-		fprintf(stderr,"USAGE: %s plaintextfile keyfile port\n", argv[0]); 
+	// Check user input format (-s streams the file in chunks, --batch
+	// sends every message in a manifest over one connection, --pad uses
+	// the daemon's key store instead of a key file, --ring passes the
+	// message through shared memory on the daemon's ring socket, --parallel
+	// splits it across several connections, --packed sends the chunks 5
+	// bits per char, --tcp sets TCP options such as nodelay=0 or
+	// rcvbuf=bytes, --pool keeps N connections to each daemon listed and
+	// --balance picks between them). A port may be given as host:port for
+	// a daemon on another host.
+	while ((opt = getopt_long(argc, argv, "s", longOptions, NULL)) != -1) {
+		if (opt == 's') streamMode = 1;
+		else if (opt == 'b') manifestName = optarg;
+		else if (opt == 'r') ringMode = 1;
+		else if (opt == 'k') packed = 1;
+		else if (opt == 't') {
+			if (SetClientTuning(optarg) < 0) argc = 0;
+		}
+		else if (opt == 'n') {
+			parallel = atoi(optarg);
+			if (parallel < 1 || parallel > MAX_PARALLEL) argc = 0;
+		}
+		else if (opt == 'P') {
+			poolSize = atoi(optarg);
+			if (poolSize < 1 || poolSize > MAX_POOL_SIZE) argc = 0;
+		}
+		else if (opt == 'B') {
+			if (strcmp(optarg, "least") == 0) balance = OTP_BALANCE_LEAST;
+			else if (strcmp(optarg, "p2c") == 0) balance = OTP_BALANCE_TWO;
+			else argc = 0;
+		}
+		else if (opt == 'p') padMode = 1;
+		else argc = 0;
+	}
+	if (packed && (ringMode || parallel)) argc = 0; // Only the framed paths pack
+	if (poolSize && (packed || padMode || ringMode || parallel)) argc = 0; // Pools send plain framed messages
+	if (argc - optind < (manifestName ? 1 : padMode ? 2 : 3)) { 
+		fprintf(stderr,"USAGE: %s [-s] [--tcp nodelay=0|1,sndbuf=N,rcvbuf=N] plaintextfile|- keyfile [host:]port\n", argv[0]); 
+		fprintf(stderr,"       %s --packed [--batch|--pad] ... port\n", argv[0]); 
+		fprintf(stderr,"       %s --ring plaintextfile keyfile ringsocket\n", argv[0]); 
+		fprintf(stderr,"       %s --parallel N plaintextfile keyfile [host:]port[,[host:]port...]\n", argv[0]); 
+		fprintf(stderr,"       %s [--pool N] [--balance least|p2c] [--batch manifest | plaintextfile keyfile] [host:]port,[host:]port...\n", argv[0]); 
+		fprintf(stderr,"       %s --batch manifest port\n", argv[0]); 
+		fprintf(stderr,"       %s --pad plaintextfile port\n", argv[0]); 
 		exit(0); 
 	} // Check usage & args
+	target = argv[argc - 1]; // A port, host:port, or the path of the daemon's Unix socket
+	pooled = !parallel && !ringMode && (poolSize > 0 || strchr(target, ',') != NULL);
+	if (pooled && (packed || padMode)) error("a list of daemons takes plain framed messages (no --packed or --pad)", 1);
+	if (!manifestName && !padMode && strcmp(argv[optind], "-") == 0 && strcmp(argv[optind + 1], "-") == 0)
+		error("the text and key cannot both come from stdin", 1);
+	streamID = packed ? ID_ENCODE_PACKED : ID_ENCODE_STREAM;
+
+	// In ring mode the text and key are read into memory shared with the
+	// daemon, which ciphers them in place
+	if (ringMode) {
+		textFD = OpenInput(argv[optind]);
+		keyFD = OpenInput(argv[optind + 1]);
+		if (textFD < 0) error("Can't open plaintext file", 1);
+		if (keyFD < 0) error("Can't open key file", 1);
+		RingMessage("otp_enc", "otp_dec_d", target, OP_ENCODE, textFD, keyFD, argv[optind], argv[optind + 1], STDOUT_FILENO);
+		return 0;
+	}
+
+	// With several daemons listed (or --pool), messages go out over a pool
+	// of connections to each, every one to the daemon with the fewest
+	// outstanding (or the less loaded of two picked at random with
+	// --balance p2c). A daemon that fails is set aside for a while and its
+	// messages are sent again to another.
+	if (pooled) {
+		if (manifestName) messages = ReadManifest("otp_enc", manifestName, &count);
+		else {
+			memset(&single, '\0', sizeof(single));
+			single.textName = argv[optind];
+			single.keyName = argv[optind + 1];
+			single.textFD = single.keyFD = -1;
+			messages = &single;
+			count = 1;
+		}
+		PoolMessages("otp_enc", "otp_dec_d", target, poolSize > 0 ? poolSize : DEFAULT_POOL_SIZE, balance, OP_ENCODE,
+			messages, count, STDOUT_FILENO);
+		return 0;
+	}
+
+	// In batch mode each manifest line names a text file, a key file and an
+	// optional output file. The messages are pipelined over one connection.
+	if (manifestName) {
+		messages = ReadManifest("otp_enc", manifestName, &count);
+		socketFD = ConnectServer("otp_enc", "otp_dec_d", target, streamID);
+		StreamMessages("otp_enc", socketFD, OP_ENCODE, packed, messages, count, STDOUT_FILENO);
+
+		close(socketFD); // Close the socket
+		return 0;
+	}
+
+	// In pad mode only the text is sent, and the daemon ciphers it with its
+	// key store. The pad range used is printed to stderr as
+	// "pad OFFSET LENGTH". The first frame reserves pad for the whole text
+	// so the range is unbroken, which needs its size up front.
+	if (padMode) {
+		if (StreamInput(argv[optind]))
+			error("--pad needs the plaintext in a regular file, so its pad can be reserved up front", 1);
+		textFD = OpenInput(argv[optind]);
+		if (textFD < 0) error("Can't open plaintext file", 1);
+
+		memset(&single, '\0', sizeof(single));
+		single.textName = argv[optind];
+		single.textFD = textFD;
+		single.keyFD = -1;
+		single.pad = 1;
+		single.padOffset = 0;
+		socketFD = ConnectServer("otp_enc", "otp_dec_d", target, streamID);
+		StreamMessages("otp_enc", socketFD, OP_ENCODE, packed, &single, 1, STDOUT_FILENO);
+
+		close(socketFD); // Close the socket
+		return 0;
+	}
+
+	// In streaming mode the file is sent frame by frame as it is read, and
+	// the result is written out as each frame comes back. Input from stdin
+	// ("-"), a pipe or a terminal is always streamed, since it cannot be
+	// sized up front; the key can come from a pipe or FIFO as well, and is
+	// read a chunk at a time to match the text. A text longer than the
+	// original protocol carries goes as frames too.
+	if (streamMode || packed || (!parallel && (StreamInput(argv[optind]) || StreamInput(argv[optind + 1])
+			|| LegacyTooLong(argv[optind])))) {
+		textFD = OpenInput(argv[optind]);
+		keyFD = OpenInput(argv[optind + 1]);
+		if (textFD < 0) error("Can't open plaintext file", 1);
+		if (keyFD < 0) error("Can't open key file", 1);
+		CheckKeyLength(textFD, keyFD);
+
+		single.textName = argv[optind];
+		single.keyName = argv[optind + 1];
+		single.outName = NULL;
+		single.textFD = textFD;
+		single.keyFD = keyFD;
+		single.pad = 0;
+		socketFD = ConnectServer("otp_enc", "otp_dec_d", target, streamID);
+		StreamMessages("otp_enc", socketFD, OP_ENCODE, packed, &single, 1, STDOUT_FILENO);
+
+		close(socketFD); // Close the socket
+		return 0;
+	}
 
 	// Open plaintext file and key file
-	FILE *plainFile = fopen(argv[1], "r");
-	FILE *keyFile = fopen(argv[2], "r");
+	textFD = open(argv[optind], O_RDONLY);
+	keyFD = open(argv[optind + 1], O_RDONLY);
 	
 	// Print error if files could not open
-	if (plainFile == NULL) error("Can't open plaintext file", 1);
-	if (keyFile == NULL) error("Can't open key file", 1);
+	if (textFD < 0) error("Can't open plaintext file", 1);
+	if (keyFD < 0) error("Can't open key file", 1);
 	
-	// Get size of plain text file
-	fseek(plainFile, 0L, SEEK_END);
-	fileSizeC = ftell(plainFile);
-	fseek(plainFile, 0L, SEEK_SET);
+	// Get size of plaintext file; the last char is the newline, which is not sent
+	fileSizeC = FileSize(textFD, argv[optind]);
+	messageLength = fileSizeC > 0 ? fileSizeC - 1 : 0;
+	bufferSize = messageLength + 1;
 	
 	// If key file is too short, display error and exit
-	fseek(keyFile, 0L, SEEK_END);
-	if (ftell(keyFile) < fileSizeC) error("Key file is too short", 1);
-	fseek(keyFile, 0L, SEEK_SET);
-
-	// Create buffers for plain text and key text
-	char buffer[fileSizeC];
-	char key[fileSizeC];
-
-	// Input plain text into buffer
-	memset(buffer, '\0', sizeof(buffer)); 
-	fread(buffer, fileSizeC, 1, plainFile);
-	buffer[fileSizeC-1] = '\0';
-	fclose(plainFile);
-	bufferSize = sizeof(buffer);
-
-	// Input key text into buffer
-	memset(key, '\0', sizeof(key)); 
-	fread(key, fileSizeC, 1, keyFile);
-	key[fileSizeC-1] = '\0';
-	fclose(keyFile);
-
-	// Verify plain text and key characters are valid
-	for (i = 0; i < (sizeof(buffer) -1); i++) {
-		if (((int)buffer[i] < 65 || (int)buffer[i] > 90) && (int)buffer[i] != 32) {
-			fprintf(stderr, "ERROR: %s contains bad characters\n", argv[1]); exit(1); 
-		}
-		if (((int)key[i] < 65 || (int)key[i] > 90) && (int)key[i] != 32) {
-			fprintf(stderr, "ERROR: %s contains bad characters\n", argv[2]); exit(1); 
-		}
-	}	
-
-	// Set up the server address struct
-	memset((char*)&serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
-	portNumber = atoi(argv[3]); // Get the port number, convert to an integer from a string
-	serverAddress.sin_family = AF_INET; // Create a network-capable socket
-	serverAddress.sin_port = htons(portNumber); // Store the port number
-	serverHostInfo = gethostbyname("localhost"); // Convert the machine name into a special form of address
-	memcpy((char*)&serverAddress.sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length); // Copy in the address
-
-	// Set up the socket
-	socketFD = socket(AF_INET, SOCK_STREAM, 0); // Create the socket
-	if (socketFD < 0) {
-		fprintf(stderr, "ERROR: bad port %d\n", portNumber); exit(2); 
-	} 
-	
-	// Connect to server
-	if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) { // Connect socket to address
-		fprintf(stderr, "ERROR: bad port %d\n", portNumber); exit(2); 
-	} 
-	
-	// Send client identifier to server
-	charsWritten = 0;
-	charsWritten = send(socketFD, "ENC", 3, 0); // Write to the server
-	if (charsWritten != 3) error("otp_enc had issue writing to socket", 1);
-	
-	// Get OK from server (if allowed to connect)
-	charsRead = 0;
-	charsRead = recv(socketFD, servVer, 2, 0); 
-	if (charsRead != 2) error("otp_enc had issue reading from socket", 1);
-	if (strcmp(servVer, "OK") != 0) error("otp_enc is not verified to connect to otp_dec_d", 1);
+	if (FileSize(keyFD, argv[optind + 1]) < fileSizeC) error("Key file is too short", 1);
+
+	// Map both files so they can be checked in place, without copying them
+	plainText = MapFile("otp_enc", textFD, messageLength);
+	key = MapFile("otp_enc", keyFD, messageLength);
+
+	// Verify plaintext and key characters are valid, both in one pass
+	CheckInputs(plainText, key, messageLength, 0, argv[optind], argv[optind + 1]);
+
+	// In parallel mode the message is split over several connections, to
+	// one daemon or spread across all of those listed (ports or sockets,
+	// separated by commas), and the results are put back in order
+	if (parallel > 0) {
+		numTargets = SplitTargets(argv[argc - 1], targets, MAX_PARALLEL);
+		if (numTargets == 0) error("no port given", 1);
+		ParallelMessage("otp_enc", "otp_dec_d", targets, numTargets, parallel, OP_ENCODE, plainText, key, messageLength, STDOUT_FILENO);
+		return 0;
+	}
+
+	// Connect to server and verify the handshake
+	socketFD = ConnectServer("otp_enc", "otp_dec_d", target, ID_ENCODE);
 	
-	// Send plain text buffer size to server
+	// Send plaintext buffer size to server
 	charsWritten = 0;
 	charsWritten = send(socketFD, &bufferSize, sizeof(int), 0); // Write to the server
 	if (charsWritten != sizeof(int)) error("otp_enc had issue writing to socket", 1);
 	
-	// Send plain text to server
-	charsWritten = 0;
-	while (charsWritten < sizeof(buffer) - 1) {
-		tempChars = send(socketFD, &buffer[charsWritten], sizeof(buffer) - charsWritten - 1, 0); 
-		if (tempChars < 0) error("otp_enc had issue writing to socket", 1);
-		charsWritten += tempChars;
-	}
-	
-	// Send key text to server
-	charsWritten = 0;
-	while (charsWritten < sizeof(key) - 1) {
-		tempChars = send(socketFD, &key[charsWritten], sizeof(key) - charsWritten - 1, 0); 
-		if (tempChars < 0) error("otp_enc had issue writing to socket", 1);
-		charsWritten += tempChars;
-	}
-	
-	// Get return ciphertext from server
-	memset(buffer, '\0', sizeof(buffer));
-	charsRead = 0;
-	while (charsRead < sizeof(buffer)-1) {
-		tempChars = recv(socketFD, &buffer[charsRead], sizeof(buffer) - charsRead - 1, 0); 
-		if (tempChars < 0) error("otp_enc had issue reading from socket", 1);
-		charsRead += tempChars;
-	}
+	// Send plaintext and key text to server straight from the page cache
+	SendFileRange("otp_enc", socketFD, textFD, plainText, messageLength);
+	SendFileRange("otp_enc", socketFD, keyFD, key, messageLength);
 	
-	// Print ciphertext to stdout
-	printf("%s\n", buffer);
+	// Get the result from server, passing it on to stdout as it arrives
+	ReceiveToFD("otp_enc", socketFD, STDOUT_FILENO, messageLength);
+	printf("\n");
 
 	close(socketFD); // Close the socket
 	return 0;
@@ -0,0 +1,359 @@
+/*
+File: otp_epoll.c
+Author: Adeline Harcourt
+Description: The epoll engine for the otp daemons. A single reactor
+		thread accepts connections and moves each one through the protocol
+		state machine in otp_server.c with non-blocking sockets. Once a
+		message has fully arrived, the encode/decode step is handed to a
+		fixed pool of worker threads, which pass the connection back to the
+		reactor through an eventfd so the reply can be written. Requests
+		waiting for admission are parked off epoll and retried after
+		every wakeup. Connections waiting on their clients sit on a timer
+		wheel, and epoll_wait wakes each tick while any do so that those
+		past their deadlines can be dropped.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include "otp_server.h"
+
+#define MAX_EVENTS 256
+
+// Shared state between the reactor thread and the cipher workers
+struct Reactor {
+	struct ServerConfig *config;
+	int epollFD;				// epoll instance watching every socket
+	int wakeFD;					// eventfd the workers signal when a cipher finishes
+	pthread_mutex_t lock;		// Protects both queues below
+	pthread_cond_t jobReady;	// Signalled when a job is queued for the workers
+	struct Conn *jobHead, *jobTail;		// Messages waiting on a worker
+	struct Conn *doneHead, *doneTail;	// Messages a worker has finished
+	struct Conn *waitHead, *waitTail;	// Requests waiting for admission (reactor only)
+	struct TimerWheel wheel;	// Deadlines of connections waiting on clients (reactor only)
+};
+
+// Marker stored in epoll_event.data for the eventfd. Listeners are stored
+// as pointers into config->listenFDs, and anything else is a connection.
+static char wakeMarker;
+
+// Returns the listening socket an epoll event is for, or -1 if it is not
+// for a listener
+static int ListenerFor(struct Reactor *reactor, void *ptr) {
+	int *listenFDs = reactor->config->listenFDs;
+	if ((int *)ptr >= listenFDs && (int *)ptr < listenFDs + reactor->config->numListeners) return *(int *)ptr;
+	return -1;
+}
+
+// Appends a connection to a queue given its head and tail pointers
+static void PushConn(struct Conn **head, struct Conn **tail, struct Conn *conn) {
+	conn->next = NULL;
+	if (*tail != NULL) (*tail)->next = conn;
+	else *head = conn;
+	*tail = conn;
+}
+
+// Removes and returns the first connection in a queue (NULL if empty)
+static struct Conn *PopConn(struct Conn **head, struct Conn **tail) {
+	struct Conn *conn = *head;
+	if (conn == NULL) return NULL;
+	*head = conn->next;
+	if (*head == NULL) *tail = NULL;
+	conn->next = NULL;
+	return conn;
+}
+
+// Worker thread: takes fully received messages off the job queue, runs the
+// cipher and hands the connection back to the reactor
+static void *CipherWorker(void *arg) {
+	struct Reactor *reactor = arg;
+	struct Conn *conn;
+	uint64_t one = 1;
+	sigset_t mask;
+
+	// Leave SIGUSR1 to the reactor, whose wait it interrupts
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	while (1) {
+		// Wait for a job
+		pthread_mutex_lock(&reactor->lock);
+		while (reactor->jobHead == NULL)
+			pthread_cond_wait(&reactor->jobReady, &reactor->lock);
+		conn = PopConn(&reactor->jobHead, &reactor->jobTail);
+		pthread_mutex_unlock(&reactor->lock);
+
+		CipherConn(reactor->config, conn);
+
+		// Return the connection to the reactor and wake it up
+		pthread_mutex_lock(&reactor->lock);
+		PushConn(&reactor->doneHead, &reactor->doneTail, conn);
+		pthread_mutex_unlock(&reactor->lock);
+		if (write(reactor->wakeFD, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			perror("eventfd write");
+	}
+	return NULL;
+}
+
+// Changes the epoll events a connection is registered for, skipping the
+// syscall when nothing changes. Events of 0 removes it from epoll entirely.
+static int WatchConn(struct Reactor *reactor, struct Conn *conn, int events) {
+	struct epoll_event event;
+	int op;
+
+	if (events == conn->events) return 0;
+	if (events == 0) op = EPOLL_CTL_DEL;
+	else if (conn->events == 0) op = EPOLL_CTL_ADD;
+	else op = EPOLL_CTL_MOD;
+
+	memset(&event, '\0', sizeof(event));
+	event.events = events;
+	event.data.ptr = conn;
+	if (epoll_ctl(reactor->epollFD, op, conn->fd, &event) < 0) return -1;
+	conn->events = events;
+	return 0;
+}
+
+// Runs a connection's state machine for as long as the socket allows. Stops
+// when a transfer would block, when the message goes to a worker, or when
+// the connection is finished and freed.
+static void DriveConn(struct Reactor *reactor, struct Conn *conn) {
+	struct ServerConfig *config = reactor->config;
+	char *buf;
+	size_t len;
+	ssize_t tempChars;
+	int dir;
+
+	while (1) {
+		if (conn->state == CONN_DONE || conn->state == CONN_FAILED) {
+			FreeConn(conn); // Closing the socket also removes it from epoll
+			return;
+		}
+
+		// Small messages are quicker to cipher here than to hand off
+		if (conn->state == CONN_CIPHER) {
+			if (config->workers == 0 || conn->length <= INLINE_CIPHER_LIMIT) {
+				CipherConn(config, conn);
+				continue;
+			}
+
+			// Stop watching the socket while a worker owns the connection
+			if (WatchConn(reactor, conn, 0) < 0) {
+				FreeConn(conn);
+				return;
+			}
+			TimerRemove(conn);
+			ConnCork(config, conn, 0);
+			pthread_mutex_lock(&reactor->lock);
+			PushConn(&reactor->jobHead, &reactor->jobTail, conn);
+			pthread_cond_signal(&reactor->jobReady);
+			pthread_mutex_unlock(&reactor->lock);
+			return;
+		}
+
+		// Park a request that must wait for admission, off epoll so its
+		// unread bytes stay in the socket
+		if (conn->state == CONN_ADMIT) {
+			if (WatchConn(reactor, conn, 0) < 0) {
+				FreeConn(conn);
+				return;
+			}
+			TimerRemove(conn);
+			ConnCork(config, conn, 0);
+			PushConn(&reactor->waitHead, &reactor->waitTail, conn);
+			return;
+		}
+
+		// Transfer as much of the current field as the socket will take.
+		// Reads go through the connection's read buffer.
+		dir = ConnWant(conn, &buf, &len);
+		if (dir == IO_READ) tempChars = ConnRecv(config, conn);
+		else {
+			ConnCork(config, conn, 1);
+			tempChars = send(conn->fd, buf, len, MSG_NOSIGNAL);
+		}
+
+		if (tempChars < 0 && errno == EINTR) continue;
+		if (tempChars < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// Wait for the socket to become ready in the needed direction,
+			// until the connection's deadline. Replies held back go out
+			// before waiting on the client.
+			if (dir == IO_READ) ConnCork(config, conn, 0);
+			if (WatchConn(reactor, conn, dir == IO_READ ? EPOLLIN : EPOLLOUT) < 0) FreeConn(conn);
+			else TimerWatch(config, &reactor->wheel, conn);
+			return;
+		}
+		if (tempChars < 0) {
+			// Socket error
+			FreeConn(conn);
+			return;
+		}
+		if (tempChars == 0 && dir == IO_READ) {
+			// The client closed its side; finished or cut short
+			ConnEOF(conn);
+			continue;
+		}
+		if (dir == IO_WRITE) ConnAdvance(config, conn, tempChars);
+	}
+}
+
+// Accepts every pending connection on a listening socket
+static void AcceptConns(struct Reactor *reactor, int listenSocketFD) {
+	struct Conn *conn;
+	int establishedConnectionFD;
+
+	while (1) {
+		establishedConnectionFD = accept4(listenSocketFD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (establishedConnectionFD < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+			return;
+		}
+		CountAccept(reactor->config);
+
+		conn = NewConn(establishedConnectionFD);
+		if (conn == NULL) {
+			close(establishedConnectionFD);
+			continue;
+		}
+
+		// The client speaks first, so try reading right away
+		DriveConn(reactor, conn);
+	}
+}
+
+// Picks up connections the workers have finished with and starts their replies
+static void DrainFinished(struct Reactor *reactor) {
+	struct Conn *finished, *conn;
+	uint64_t count;
+
+	if (read(reactor->wakeFD, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("eventfd read");
+
+	// Take the whole list at once to keep the lock short
+	pthread_mutex_lock(&reactor->lock);
+	finished = reactor->doneHead;
+	reactor->doneHead = reactor->doneTail = NULL;
+	pthread_mutex_unlock(&reactor->lock);
+
+	while (finished != NULL) {
+		conn = finished;
+		finished = conn->next;
+		conn->next = NULL;
+		DriveConn(reactor, conn);
+	}
+}
+
+// Retries every parked request, oldest first. Admitted and timed out
+// requests carry on; the rest are parked again.
+static void RetryWaiting(struct Reactor *reactor) {
+	struct Conn *waiting = reactor->waitHead, *conn;
+
+	reactor->waitHead = reactor->waitTail = NULL;
+	while (waiting != NULL) {
+		conn = waiting;
+		waiting = conn->next;
+		if (ConnRetryAdmit(reactor->config, conn)) DriveConn(reactor, conn);
+		else PushConn(&reactor->waitHead, &reactor->waitTail, conn);
+	}
+}
+
+// Drops every connection whose deadline has passed
+static void ExpireConns(struct Reactor *reactor) {
+	struct Conn *expired = TimerExpire(reactor->config, &reactor->wheel, NowMs()), *conn;
+
+	while (expired != NULL) {
+		conn = expired;
+		expired = conn->timerNext;
+		conn->timerNext = NULL;
+		ConnTimeout(conn);
+		FreeConn(conn);
+	}
+}
+
+// Returns how long epoll_wait may block: until the next timer tick while
+// connections have deadlines, and no longer than ADMIT_TICK_MS while
+// requests are parked, since room can be freed by other shards and waits
+// can run out
+static int WaitTimeout(struct Reactor *reactor) {
+	int timeout = TimerWait(&reactor->wheel);
+
+	if (reactor->waitHead != NULL && (timeout < 0 || timeout > ADMIT_TICK_MS)) timeout = ADMIT_TICK_MS;
+	return timeout;
+}
+
+// Registers a descriptor with epoll for read events under a marker
+static void WatchMarker(struct Reactor *reactor, int fd, void *marker) {
+	struct epoll_event event;
+
+	memset(&event, '\0', sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = marker;
+	if (epoll_ctl(reactor->epollFD, EPOLL_CTL_ADD, fd, &event) < 0)
+		error("could not register with epoll", 1);
+}
+
+// The epoll engine: one reactor thread for all socket I/O and a fixed pool
+// of workers for the cipher step
+int RunEpollEngine(struct ServerConfig *config) {
+	struct Reactor reactor;
+	struct epoll_event events[MAX_EVENTS];
+	pthread_t threadID;
+	int i, numEvents, listenSocketFD;
+
+	memset(&reactor, '\0', sizeof(reactor));
+	reactor.config = config;
+	TimerInit(&reactor.wheel);
+	pthread_mutex_init(&reactor.lock, NULL);
+	pthread_cond_init(&reactor.jobReady, NULL);
+
+	// Set up epoll, the worker wake-up eventfd and non-blocking listeners
+	reactor.epollFD = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor.epollFD < 0) error("could not create epoll instance", 1);
+	reactor.wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (reactor.wakeFD < 0) error("could not create eventfd", 1);
+	for (i = 0; i < config->numListeners; i++) {
+		if (fcntl(config->listenFDs[i], F_SETFL, fcntl(config->listenFDs[i], F_GETFL) | O_NONBLOCK) < 0)
+			error("could not make listener non-blocking", 1);
+		WatchMarker(&reactor, config->listenFDs[i], &config->listenFDs[i]);
+	}
+	WatchMarker(&reactor, reactor.wakeFD, &wakeMarker);
+
+	// Start the cipher workers
+	for (i = 0; i < config->workers; i++) {
+		if (pthread_create(&threadID, NULL, CipherWorker, &reactor) != 0)
+			error("could not start worker thread", 1);
+		pthread_detach(threadID);
+	}
+
+	// Keep the daemon running
+	while (1) {
+		// Wake up regularly while requests are parked or deadlines are set
+		numEvents = epoll_wait(reactor.epollFD, events, MAX_EVENTS, WaitTimeout(&reactor));
+		if (numEvents < 0) {
+			CheckReport(config);
+			if (errno == EINTR) continue;
+			error("epoll_wait failed", 1);
+		}
+
+		for (i = 0; i < numEvents; i++) {
+			listenSocketFD = ListenerFor(&reactor, events[i].data.ptr);
+			if (listenSocketFD >= 0) AcceptConns(&reactor, listenSocketFD);
+			else if (events[i].data.ptr == &wakeMarker) DrainFinished(&reactor);
+			else DriveConn(&reactor, events[i].data.ptr);
+		}
+		if (reactor.waitHead != NULL) RetryWaiting(&reactor);
+		if (reactor.wheel.count > 0) ExpireConns(&reactor);
+	}
+	return 0;
+}
@@ -0,0 +1,51 @@
+/*
+File: otp_lib.c
+Author: Adeline Harcourt
+Description: The in-process half of libotp: encoding and decoding a buffer,
+		or a batch of them, with the kernels from otp_cipher.c. The text
+		and key are checked together (one scan of both) and ciphered a
+		block at a time, so each block is still in cache when the kernel
+		reads it after the check and the data streams through memory
+		once.
+*/
+#include <stddef.h>
+#include "otp.h"
+#include "otp_cipher.h"
+
+// Chars checked and ciphered at a time: the text, key and output blocks
+// together stay well within a typical L2 cache
+#define CIPHER_BLOCK 32768
+
+// Checks and ciphers n chars a block at a time. Returns a STATUS_ or
+// OTP_ERR_ code.
+static int CipherBlocks(char op, const char *text, const char *key, char *out, size_t n) {
+	size_t offset, chunk, bad;
+
+	for (offset = 0; offset < n; offset += chunk) {
+		chunk = n - offset < CIPHER_BLOCK ? n - offset : CIPHER_BLOCK;
+		bad = ScanPair(text + offset, key + offset, chunk);
+		if (bad < chunk) return ValidText(text + offset + bad, 1) ? OTP_ERR_KEY : OTP_ERR_TEXT;
+		if (op == OP_ENCODE) EncodeText(out + offset, text + offset, key + offset, chunk);
+		else DecodeText(out + offset, text + offset, key + offset, chunk);
+	}
+	return STATUS_OK;
+}
+
+int OtpEncode(const char *plainText, const char *key, char *out, size_t n) {
+	return CipherBlocks(OP_ENCODE, plainText, key, out, n);
+}
+
+int OtpDecode(const char *cipherText, const char *key, char *out, size_t n) {
+	return CipherBlocks(OP_DECODE, cipherText, key, out, n);
+}
+
+size_t OtpCipherBatch(struct OtpJob *jobs, size_t count) {
+	size_t i, failed = 0;
+
+	for (i = 0; i < count; i++) {
+		if (jobs[i].op != OP_ENCODE && jobs[i].op != OP_DECODE) jobs[i].status = STATUS_WRONG_OP;
+		else jobs[i].status = CipherBlocks(jobs[i].op, jobs[i].text, jobs[i].key, jobs[i].out, jobs[i].n);
+		if (jobs[i].status != STATUS_OK) failed++;
+	}
+	return failed;
+}
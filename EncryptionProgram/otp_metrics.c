@@ -0,0 +1,293 @@
+/*
+File: otp_metrics.c
+Author: Adeline Harcourt
+Description: Metrics for the otp daemons: request and byte counts, active
+		connections, errors by kind and a latency histogram for each
+		phase of a request (accept to handshake, handshake to message
+		received, cipher, reply flushed). Every thread counts into its own
+		slot with plain stores, so the hot path takes no lock and shares
+		no cache line. The slots live in memory shared by every shard and
+		forked child; forked children, and threads past the last slot,
+		share one overflow slot with atomic adds. The slots are only
+		summed when someone asks: over the Unix socket given with -M, in
+		the Prometheus text format (a bare connection or an HTTP GET both
+		work), and on SIGUSR1.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include "otp_server.h"
+
+// Histogram buckets: bucket i counts phases under 2^i microseconds, and the
+// last one everything slower
+#define METRIC_BUCKETS 25
+
+// Slots in the shared region. The last is the shared overflow slot.
+#define METRIC_SLOTS 64
+
+// How long a scrape connection may take to send its request line
+#define METRICS_REQUEST_MS 100
+
+// One thread's counters, on cache lines of their own
+struct MetricsSlot {
+	unsigned long counters[METRIC_COUNT];
+	unsigned long errors[ERROR_COUNT];
+	unsigned long phaseBuckets[PHASE_COUNT][METRIC_BUCKETS];
+	unsigned long phaseNanos[PHASE_COUNT];
+} __attribute__((aligned(64)));
+
+struct Metrics {
+	int claimed;			// Slots handed out so far
+	struct MetricsSlot slots[METRIC_SLOTS];
+};
+
+// The daemon's metrics, and the slot this thread counts into
+static struct Metrics *metrics;
+static __thread struct MetricsSlot *threadSlot;
+static __thread int threadShared;
+
+static const char *phaseNames[PHASE_COUNT] = {"handshake", "receive", "cipher", "reply"};
+
+// Error kind labels; kinds without one are never counted
+static const char *errorNames[ERROR_COUNT] = {
+	[ERROR_REFUSED] = "refused",
+	[ERROR_BAD_MESSAGE] = "bad_message",
+	[ERROR_SOCKET] = "socket",
+	[ERROR_TIMEOUT] = "timeout",
+	[ERROR_STATUS + STATUS_WRONG_OP] = "wrong_op",
+	[ERROR_STATUS + STATUS_TOO_LARGE] = "too_large",
+	[ERROR_STATUS + STATUS_NO_PAD] = "no_pad",
+	[ERROR_STATUS + STATUS_PAD_USED] = "pad_used",
+	[ERROR_STATUS + STATUS_BAD_PAD] = "bad_pad",
+	[ERROR_STATUS + STATUS_BUSY] = "busy",
+	[ERROR_STATUS + STATUS_OVER_SIZE] = "over_size",
+	[ERROR_STATUS + STATUS_BAD_RANGE] = "bad_range",
+	[ERROR_STATUS + STATUS_BAD_TEXT] = "bad_text",
+};
+
+// Sets up the shared slots. Called once before any shard or child is
+// forked.
+void OpenMetrics(struct ServerConfig *config) {
+	metrics = mmap(NULL, sizeof(struct Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (metrics == MAP_FAILED) error("could not allocate metrics", 1);
+	memset(metrics, '\0', sizeof(*metrics));
+}
+
+// Moves a forked child onto the overflow slot, since a child per
+// connection would soon use up the slots
+void MetricsForked(void) {
+	threadSlot = &metrics->slots[METRIC_SLOTS - 1];
+	threadShared = 1;
+}
+
+// Returns this thread's slot, claiming one on first use
+static struct MetricsSlot *Slot(void) {
+	int index;
+
+	if (threadSlot != NULL) return threadSlot;
+	index = __atomic_fetch_add(&metrics->claimed, 1, __ATOMIC_RELAXED);
+	if (index >= METRIC_SLOTS - 1) {
+		index = METRIC_SLOTS - 1;
+		threadShared = 1;
+	}
+	threadSlot = &metrics->slots[index];
+	return threadSlot;
+}
+
+// Adds to a counter in this thread's slot. An owned slot has one writer, so
+// a plain store is enough for readers to see a whole value.
+static void Add(unsigned long *counter, unsigned long n) {
+	if (threadShared) __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+	else __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+// Returns the current time in nanoseconds from a monotonic clock
+long long MetricsNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void MetricCount(int counter, unsigned long n) {
+	Add(&Slot()->counters[counter], n);
+}
+
+void MetricError(int kind) {
+	Add(&Slot()->errors[kind], 1);
+}
+
+// Records how long the connection spent in a phase, which ends now and
+// starts the next one
+void MetricPhase(struct Conn *conn, int phase) {
+	struct MetricsSlot *slot = Slot();
+	long long now = MetricsNow(), nanos = now - conn->phaseMark;
+	unsigned long long micros = nanos > 0 ? nanos / 1000 : 0;
+	int bucket = micros == 0 ? 0 : 64 - __builtin_clzll(micros);
+
+	if (bucket >= METRIC_BUCKETS) bucket = METRIC_BUCKETS - 1;
+	Add(&slot->phaseBuckets[phase][bucket], 1);
+	Add(&slot->phaseNanos[phase], nanos > 0 ? nanos : 0);
+	conn->phaseMark = now;
+}
+
+// Sums every slot into one
+static void SumSlots(struct MetricsSlot *total) {
+	struct MetricsSlot *slot;
+	int i, j, k;
+
+	memset(total, '\0', sizeof(*total));
+	for (i = 0; i < METRIC_SLOTS; i++) {
+		slot = &metrics->slots[i];
+		for (j = 0; j < METRIC_COUNT; j++) total->counters[j] += __atomic_load_n(&slot->counters[j], __ATOMIC_RELAXED);
+		for (j = 0; j < ERROR_COUNT; j++) total->errors[j] += __atomic_load_n(&slot->errors[j], __ATOMIC_RELAXED);
+		for (j = 0; j < PHASE_COUNT; j++) {
+			for (k = 0; k < METRIC_BUCKETS; k++)
+				total->phaseBuckets[j][k] += __atomic_load_n(&slot->phaseBuckets[j][k], __ATOMIC_RELAXED);
+			total->phaseNanos[j] += __atomic_load_n(&slot->phaseNanos[j], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// Writes the HELP and TYPE lines for a metric
+static void Describe(FILE *out, const char *name, const char *type, const char *help) {
+	fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Writes every metric in the Prometheus text format
+void WriteMetrics(struct ServerConfig *config, FILE *out) {
+	struct Admission *admission = config->admission;
+	struct MetricsSlot total;
+	unsigned long count, accepts, closes;
+	const char *name = config->name;
+	int i, j;
+
+	SumSlots(&total);
+	accepts = total.counters[METRIC_ACCEPTS];
+	closes = total.counters[METRIC_CLOSES];
+
+	Describe(out, "otp_requests_total", "counter", "Messages ciphered (each frame counts).");
+	fprintf(out, "otp_requests_total{daemon=\"%s\",op=\"encode\"} %lu\n", name, total.counters[METRIC_ENCODES]);
+	fprintf(out, "otp_requests_total{daemon=\"%s\",op=\"decode\"} %lu\n", name, total.counters[METRIC_DECODES]);
+	Describe(out, "otp_chars_total", "counter", "Chars ciphered.");
+	fprintf(out, "otp_chars_total{daemon=\"%s\"} %lu\n", name, total.counters[METRIC_CHARS]);
+	Describe(out, "otp_received_bytes_total", "counter", "Bytes read from clients.");
+	fprintf(out, "otp_received_bytes_total{daemon=\"%s\"} %lu\n", name, total.counters[METRIC_BYTES_IN]);
+	Describe(out, "otp_sent_bytes_total", "counter", "Bytes written to clients.");
+	fprintf(out, "otp_sent_bytes_total{daemon=\"%s\"} %lu\n", name, total.counters[METRIC_BYTES_OUT]);
+	Describe(out, "otp_connections_total", "counter", "Connections accepted.");
+	fprintf(out, "otp_connections_total{daemon=\"%s\"} %lu\n", name, accepts);
+	Describe(out, "otp_connections_active", "gauge", "Connections open.");
+	fprintf(out, "otp_connections_active{daemon=\"%s\"} %lu\n", name, accepts > closes ? accepts - closes : 0);
+
+	Describe(out, "otp_errors_total", "counter", "Requests refused, turned away or dropped, by kind.");
+	for (i = 0; i < ERROR_COUNT; i++) {
+		if (errorNames[i] != NULL)
+			fprintf(out, "otp_errors_total{daemon=\"%s\",type=\"%s\"} %lu\n", name, errorNames[i], total.errors[i]);
+	}
+
+	Describe(out, "otp_phase_seconds", "histogram", "Time spent in each phase of a request.");
+	for (i = 0; i < PHASE_COUNT; i++) {
+		count = 0;
+		for (j = 0; j < METRIC_BUCKETS; j++) {
+			count += total.phaseBuckets[i][j];
+			if (j < METRIC_BUCKETS - 1)
+				fprintf(out, "otp_phase_seconds_bucket{daemon=\"%s\",phase=\"%s\",le=\"%g\"} %lu\n",
+					name, phaseNames[i], (double)(1UL << j) / 1e6, count);
+			else fprintf(out, "otp_phase_seconds_bucket{daemon=\"%s\",phase=\"%s\",le=\"+Inf\"} %lu\n", name, phaseNames[i], count);
+		}
+		fprintf(out, "otp_phase_seconds_sum{daemon=\"%s\",phase=\"%s\"} %.9f\n", name, phaseNames[i], total.phaseNanos[i] / 1e9);
+		fprintf(out, "otp_phase_seconds_count{daemon=\"%s\",phase=\"%s\"} %lu\n", name, phaseNames[i], count);
+	}
+
+	Describe(out, "otp_admission_active", "gauge", "Requests admitted and not yet answered.");
+	fprintf(out, "otp_admission_active{daemon=\"%s\"} %d\n", name, __atomic_load_n(&admission->active, __ATOMIC_RELAXED));
+	Describe(out, "otp_admission_queued", "gauge", "Requests waiting for room.");
+	fprintf(out, "otp_admission_queued{daemon=\"%s\"} %d\n", name, __atomic_load_n(&admission->queued, __ATOMIC_RELAXED));
+	Describe(out, "otp_admission_held_bytes", "gauge", "Text and key bytes held by admitted requests.");
+	fprintf(out, "otp_admission_held_bytes{daemon=\"%s\"} %lu\n", name, __atomic_load_n(&admission->bytes, __ATOMIC_RELAXED));
+	Describe(out, "otp_admission_waited_total", "counter", "Requests that had to wait for room.");
+	fprintf(out, "otp_admission_waited_total{daemon=\"%s\"} %lu\n", name, __atomic_load_n(&admission->waited, __ATOMIC_RELAXED));
+	Describe(out, "otp_admission_timed_out_total", "counter", "Waiting requests turned away when time ran out.");
+	fprintf(out, "otp_admission_timed_out_total{daemon=\"%s\"} %lu\n", name, __atomic_load_n(&admission->timedOut, __ATOMIC_RELAXED));
+}
+
+// Answers one scrape. A client that sends an HTTP request within
+// METRICS_REQUEST_MS gets an HTTP reply; anything else gets the bare text.
+static void AnswerScrape(struct ServerConfig *config, int fd) {
+	struct pollfd pfd = {fd, POLLIN, 0};
+	char request[1024];
+	ssize_t tempChars = 0;
+	FILE *out;
+
+	if (poll(&pfd, 1, METRICS_REQUEST_MS) > 0) tempChars = recv(fd, request, sizeof(request), MSG_DONTWAIT);
+	out = fdopen(fd, "w");
+	if (out == NULL) {
+		close(fd);
+		return;
+	}
+	if (tempChars >= 4 && memcmp(request, "GET ", 4) == 0)
+		fputs("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n", out);
+	WriteMetrics(config, out);
+	fclose(out);
+}
+
+// Metrics thread: answers scrapes one at a time, off the engine's threads
+static void *MetricsServer(void *arg) {
+	struct ServerConfig *config = arg;
+	int fd;
+
+	while (1) {
+		fd = accept4(config->metricsFD, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED) perror("metrics accept");
+			continue;
+		}
+		AnswerScrape(config, fd);
+	}
+	return NULL;
+}
+
+// Opens the Unix socket named by -M and starts the thread that serves it.
+// Runs in the process that stays up: the shard supervisor, or the daemon
+// itself.
+void StartMetricsServer(struct ServerConfig *config) {
+	struct sockaddr_un address;
+	sigset_t all, old;
+	pthread_t threadID;
+	char message[256];
+
+	memset(&address, '\0', sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(config->metricsPath) >= sizeof(address.sun_path)) {
+		snprintf(message, sizeof(message), "%s metrics socket path is too long", config->name);
+		error(message, 1);
+	}
+	strcpy(address.sun_path, config->metricsPath);
+
+	// A socket left by an earlier run would block the bind
+	unlink(config->metricsPath);
+	config->metricsFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (config->metricsFD < 0 || bind(config->metricsFD, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+			listen(config->metricsFD, 16) < 0) {
+		snprintf(message, sizeof(message), "%s could not open metrics socket", config->name);
+		error(message, 1);
+	}
+
+	// The thread takes no signals, so they go to the engine as before
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&threadID, NULL, MetricsServer, config) != 0) error("could not start metrics thread", 1);
+	pthread_detach(threadID);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
@@ -0,0 +1,120 @@
+/*
+File: otp_net.c
+Author: Adeline Harcourt
+Description: Address and socket option code shared by the otp daemons and
+		clients. An endpoint is a port (on the loopback), "host:port" or
+		"[IPv6 address]:port", and is resolved with getaddrinfo, so a
+		client can reach a daemon on another host over IPv4 or IPv6 and a
+		daemon can bind one chosen address. The TCP options are given as
+		a comma separated list, "nodelay=0,sndbuf=262144" for example,
+		and applied with setsockopt.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "otp_net.h"
+
+// Splits an endpoint into its host and port. The host is left empty when
+// only a port is given. Returns -1 if the endpoint is malformed.
+int SplitEndpoint(const char *endpoint, char *host, size_t hostSize, const char **port) {
+	const char *colon, *close;
+	size_t hostLength;
+
+	// A bracketed IPv6 address, which has colons of its own
+	if (endpoint[0] == '[') {
+		close = strchr(endpoint, ']');
+		if (close == NULL || close[1] != ':') return -1;
+		hostLength = close - endpoint - 1;
+		endpoint++;
+		colon = close + 1;
+	}
+	else {
+		colon = strchr(endpoint, ':');
+		if (colon == NULL) {
+			host[0] = '\0';
+			*port = endpoint;
+			return (*port)[0] != '\0' ? 0 : -1;
+		}
+		if (strchr(colon + 1, ':') != NULL) return -1; // IPv6 addresses need brackets
+		hostLength = colon - endpoint;
+	}
+
+	if (hostLength == 0 || hostLength >= hostSize || colon[1] == '\0') return -1;
+	memcpy(host, endpoint, hostLength);
+	host[hostLength] = '\0';
+	*port = colon + 1;
+	return 0;
+}
+
+// Looks up the stream socket addresses for a host and port, or with
+// passive set the addresses a daemon may bind (a NULL host meaning every
+// IPv4 address, as before). Returns the list for freeaddrinfo, or NULL
+// with failure set to why.
+struct addrinfo *ResolveEndpoint(const char *host, const char *port, int passive, const char **failure) {
+	struct addrinfo hints, *addresses;
+	int status;
+
+	memset(&hints, '\0', sizeof(hints));
+	hints.ai_family = passive && host == NULL ? AF_INET : AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	status = getaddrinfo(host, port, &hints, &addresses);
+	if (status != 0) {
+		*failure = gai_strerror(status);
+		return NULL;
+	}
+	return addresses;
+}
+
+// Reads a comma separated list of TCP options into tuning: nodelay, cork
+// (each alone or =0/=1), sndbuf=bytes and rcvbuf=bytes. Options not named
+// are left as they were. The list is cut up in place. Returns -1 if an
+// option is unknown or its value bad.
+int ParseTuning(struct NetTuning *tuning, char *options) {
+	static char *const names[] = { "nodelay", "cork", "sndbuf", "rcvbuf", NULL };
+	char *value, *end;
+	long number;
+	int which;
+
+	while (*options != '\0') {
+		which = getsubopt(&options, names, &value);
+		if (which < 0) return -1;
+
+		// Flags may be given alone to turn them on
+		number = 1;
+		if (value != NULL) {
+			number = strtol(value, &end, 10);
+			if (end == value || *end != '\0' || number < 0 || number > 1 << 30) return -1;
+		}
+		else if (which >= 2) return -1;
+
+		switch (which) {
+			case 0: tuning->noDelay = number != 0; break;
+			case 1: tuning->cork = number != 0; break;
+			case 2: tuning->sendBuffer = (int)number; break;
+			case 3: tuning->recvBuffer = (int)number; break;
+		}
+	}
+	return 0;
+}
+
+// Applies the TCP options to a socket. Buffer sizes must be set on a
+// listener, before connections are accepted, for the window to scale to
+// them; accepted connections inherit them and TCP_NODELAY. Returns -1 if
+// the kernel refused any.
+int TuneSocket(int fd, const struct NetTuning *tuning) {
+	int status = 0;
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &tuning->noDelay, sizeof(tuning->noDelay)) < 0) status = -1;
+	if (tuning->sendBuffer > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &tuning->sendBuffer, sizeof(tuning->sendBuffer)) < 0)
+		status = -1;
+	if (tuning->recvBuffer > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &tuning->recvBuffer, sizeof(tuning->recvBuffer)) < 0)
+		status = -1;
+	return status;
+}
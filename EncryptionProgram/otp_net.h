@@ -0,0 +1,37 @@
+/*
+File: otp_net.h
+Author: Adeline Harcourt
+Description: Declarations for the address and socket option code shared by
+		the otp daemons and clients: turning "host:port" endpoints into
+		addresses with getaddrinfo, and the TCP options (-o on a daemon,
+		--tcp on a client) applied to their sockets.
+*/
+#ifndef OTP_NET_H
+#define OTP_NET_H
+
+#include <stddef.h>
+
+struct addrinfo;
+
+// Longest host name or address in an endpoint
+#define NET_HOST_SIZE 256
+
+// Host an endpoint given as a bare port connects to: the IPv4 loopback,
+// which daemons bound to every IPv4 address (the default) answer on
+#define NET_DEFAULT_HOST "127.0.0.1"
+
+// TCP options for a socket. Buffer sizes of 0 keep the kernel's default
+// (and its autotuning).
+struct NetTuning {
+	int noDelay;		// 1 sends small writes at once (TCP_NODELAY), 0 leaves Nagle on
+	int sendBuffer;		// SO_SNDBUF in bytes
+	int recvBuffer;		// SO_RCVBUF in bytes
+	int cork;			// 1 corks replies while more requests wait, so they share segments (TCP_CORK, daemons only)
+};
+
+int SplitEndpoint(const char *endpoint, char *host, size_t hostSize, const char **port);
+struct addrinfo *ResolveEndpoint(const char *host, const char *port, int passive, const char **failure);
+int ParseTuning(struct NetTuning *tuning, char *options);
+int TuneSocket(int fd, const struct NetTuning *tuning);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+File: otp_pad.c
+Author: Adeline Harcourt
+Description: The key store behind the daemons' -k option. A large pad file
+		(for example from keygen --out) is mapped read-only, and pad frames
+		are ciphered against it instead of key text sent by the client.
+		Encoding takes fresh pad chars from a cursor kept in a small file
+		next to the pad (pad.cursor). The cursor file is mapped shared, so
+		every shard, forked child and worker thread hands out from the
+		same place with compare-and-swap. The cursor is saved ahead of use,
+		up to PAD_RESERVE_AHEAD chars at a time with msync, and a restarted
+		daemon starts from the saved mark. A crash can waste pad, but the
+		same chars are never handed out twice. Decoding names the offset
+		a message was encoded at, and only chars already handed out may
+		be decoded with, since decoding with unused pad would reveal it.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include "otp_server.h"
+
+// The cursor file's contents. Every field only ever goes up.
+struct PadCursor {
+	uint64_t next;		// Next pad char to hand out
+	uint64_t reserved;	// End of the range reservers have claimed
+	uint64_t saved;		// End of the range known to be on disk
+};
+
+struct Pad {
+	const char *chars;			// The mapped pad
+	uint64_t size;				// Usable pad chars (without the trailing newline)
+	uint64_t ahead;				// Chars reserved past the end of each request
+	struct PadCursor *cursor;	// The mapped cursor file
+};
+
+// Reports a fatal key store error for the named file
+static void PadError(struct ServerConfig *config, const char *path, const char *msg) {
+	char message[4352];
+	snprintf(message, sizeof(message), "%s %s %s", config->name, msg, path);
+	error(message, 1);
+}
+
+// Maps the pad named by config->padPath and its cursor file. Called once
+// before any shard or child is forked, so they all share the mappings.
+void OpenPad(struct ServerConfig *config) {
+	struct Pad *pad = calloc(1, sizeof(struct Pad));
+	struct stat info;
+	char cursorPath[4096];
+	void *map;
+	int padFD, cursorFD;
+
+	if (pad == NULL) error("could not allocate key store", 1);
+
+	// Map the pad. keygen ends it with a newline, which is not pad.
+	padFD = open(config->padPath, O_RDONLY);
+	if (padFD < 0 || fstat(padFD, &info) < 0 || !S_ISREG(info.st_mode))
+		PadError(config, config->padPath, "could not open pad");
+	pad->size = info.st_size;
+	if (pad->size > 0) {
+		map = mmap(NULL, pad->size, PROT_READ, MAP_SHARED, padFD, 0);
+		if (map == MAP_FAILED) PadError(config, config->padPath, "could not map pad");
+		pad->chars = map;
+		if (pad->chars[pad->size - 1] == '\n') pad->size--;
+	}
+	close(padFD);
+
+	// A restart throws away what was reserved, so small pads reserve less
+	pad->ahead = pad->size / 256 < PAD_RESERVE_AHEAD ? pad->size / 256 : PAD_RESERVE_AHEAD;
+
+	// Map the cursor, creating it for a new pad. The lock stays held for
+	// the life of the daemon, so two daemons never hand out the same pad.
+	snprintf(cursorPath, sizeof(cursorPath), "%s.cursor", config->padPath);
+	cursorFD = open(cursorPath, O_RDWR | O_CREAT, 0600);
+	if (cursorFD < 0) PadError(config, cursorPath, "could not open pad cursor");
+	if (flock(cursorFD, LOCK_EX | LOCK_NB) < 0) PadError(config, cursorPath, "found another daemon using pad cursor");
+	if (fstat(cursorFD, &info) < 0 || (info.st_size < (off_t)sizeof(struct PadCursor) &&
+			ftruncate(cursorFD, sizeof(struct PadCursor)) < 0))
+		PadError(config, cursorPath, "could not size pad cursor");
+	map = mmap(NULL, sizeof(struct PadCursor), PROT_READ | PROT_WRITE, MAP_SHARED, cursorFD, 0);
+	if (map == MAP_FAILED) PadError(config, cursorPath, "could not map pad cursor");
+	pad->cursor = map;
+
+	// Anything up to the last reservation may have been handed out before
+	// a restart, so start after it (at the end, if the pad was used up or
+	// has since been replaced by a shorter one)
+	pad->cursor->next = pad->cursor->saved = pad->cursor->reserved;
+	if (pad->cursor->next > pad->size) pad->cursor->next = pad->size;
+	config->pad = pad;
+}
+
+// Hands out n unused pad chars, setting offset to the first. Returns
+// STATUS_OK, or STATUS_PAD_USED if the pad does not have n chars left.
+int PadReserve(struct Pad *pad, uint64_t n, uint64_t *offset) {
+	struct PadCursor *cursor = pad->cursor;
+	uint64_t start, end, reserved, saved, mark;
+
+	// Take the chars only if they are all there, so the cursor never passes
+	// the end of the pad (or wraps) and a failed request uses up nothing
+	start = __atomic_load_n(&cursor->next, __ATOMIC_RELAXED);
+	do {
+		if (n > pad->size - start) return STATUS_PAD_USED;
+	} while (!__atomic_compare_exchange_n(&cursor->next, &start, start + n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	end = start + n;
+
+	// The chars may only be used once a saved mark covers them. Whoever
+	// moves the reservation past the mark saves it; anyone else waits.
+	while ((saved = __atomic_load_n(&cursor->saved, __ATOMIC_ACQUIRE)) < end) {
+		reserved = __atomic_load_n(&cursor->reserved, __ATOMIC_RELAXED);
+		if (reserved >= end) {
+			sched_yield();
+			continue;
+		}
+
+		mark = pad->size - end > pad->ahead ? end + pad->ahead : pad->size;
+		if (!__atomic_compare_exchange_n(&cursor->reserved, &reserved, mark, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+		msync(cursor, sizeof(struct PadCursor), MS_SYNC);
+
+		// Saves can finish out of order, so only ever raise the mark
+		saved = __atomic_load_n(&cursor->saved, __ATOMIC_RELAXED);
+		while (saved < mark && !__atomic_compare_exchange_n(&cursor->saved, &saved, mark, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	*offset = start;
+	return STATUS_OK;
+}
+
+// Checks that n pad chars at offset have been handed out, so they may be
+// used for decoding. Returns STATUS_OK or STATUS_BAD_PAD.
+int PadCheckIssued(struct Pad *pad, uint64_t offset, uint64_t n) {
+	uint64_t issued = __atomic_load_n(&pad->cursor->saved, __ATOMIC_ACQUIRE);
+	uint64_t next = __atomic_load_n(&pad->cursor->next, __ATOMIC_RELAXED);
+
+	// Chars past the cursor, or past a saved mark, were never handed out
+	if (issued > next) issued = next;
+	if (offset > issued || n > issued - offset) return STATUS_BAD_PAD;
+	return STATUS_OK;
+}
+
+// Returns the number of usable chars in the pad
+uint64_t PadSize(struct Pad *pad) {
+	return pad->size;
+}
+
+// Returns the pad chars starting at offset
+const char *PadChars(struct Pad *pad, uint64_t offset) {
+	return pad->chars + offset;
+}
@@ -0,0 +1,458 @@
+/*
+File: otp_pool.c
+Author: Adeline Harcourt
+Description: The connection pool half of libotp, for spreading messages
+		over several daemons without a proxy in front of them. A pool
+		keeps a few warm OtpClient connections to each daemon it is
+		given and sends each message to the daemon the balance rule
+		picks: the one with the fewest messages outstanding, or the less
+		loaded of two picked at random, which costs the same however
+		many daemons there are. Within a daemon the message goes on its
+		least loaded connection. A daemon that cannot be connected to is
+		set aside, for twice as long each time it fails in a row, and
+		tried again once that time is up. Messages caught on a
+		connection that fails or was closed under them (a daemon's idle
+		deadline, say) are queued and sent again from the next poll, so
+		no connection is ever closed from inside its own callbacks.
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "otp.h"
+
+#define BACKOFF_MS 100			// First time a failed daemon is set aside for
+#define BACKOFF_MAX_MS 30000	// Longest
+
+struct Endpoint;
+
+// One connection slot. client is NULL while the slot is empty.
+struct PoolConn {
+	struct OtpClient *client;
+	int broken;				// Failed; closed and emptied at the next poll
+	struct Endpoint *endpoint;
+};
+
+// One daemon and its connections
+struct Endpoint {
+	const char *name;
+	struct PoolConn *conns;
+	size_t outstanding;		// Messages sent to it and not finished
+	int failures;			// Connects failed in a row
+	long long downUntil;	// Set aside until then (monotonic ms), or 0
+};
+
+// One submitted message, kept so it can be sent again
+struct PoolRequest {
+	struct OtpPool *pool;
+	struct PoolConn *conn;	// Connection it is on
+	char op;
+	const char *text, *key;
+	char *out;
+	size_t n;
+	OtpDone done;
+	void *arg;
+	int tries;
+	struct PoolRequest *next;
+};
+
+struct OtpPool {
+	char *names;			// The endpoint list, cut up into the names
+	struct Endpoint *endpoints;
+	int numEndpoints, perDaemon, balance;
+	int down;				// Daemons set aside
+	int next;				// Where the least outstanding scan starts, to share out ties
+	char op;
+	unsigned int random;	// xorshift state for OTP_BALANCE_TWO
+	int *eligible;			// Scratch: daemons not set aside
+	struct pollfd *pfds;	// Scratch: one per connection
+	struct PoolConn **polled;
+	int polling;			// 1 while connections are being moved along
+	int closing;
+	size_t pending, finished;
+	struct PoolRequest *retryHead, *retryTail;	// Messages to send again
+	struct PoolRequest *freeList;
+};
+
+// Returns a monotonic clock in milliseconds
+static long long PoolNow(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static unsigned int NextRandom(struct OtpPool *pool) {
+	pool->random ^= pool->random << 13;
+	pool->random ^= pool->random >> 17;
+	pool->random ^= pool->random << 5;
+	return pool->random;
+}
+
+// Returns 1 if the daemon has hung up on an idle connection (or sent
+// something no message asked for), without waiting
+static int HungUp(struct OtpClient *client) {
+	char c;
+	ssize_t tempChars = recv(OtpClientFD(client), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+	return tempChars >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+// Closes a slot's connection and empties the slot. Messages still on it
+// are queued to go again (by Finished, which marks the slot broken, so
+// that is cleared after).
+static void Empty(struct PoolConn *conn) {
+	struct OtpClient *client = conn->client;
+
+	conn->client = NULL;
+	if (client != NULL) OtpClose(client);
+	conn->broken = 0;
+}
+
+// Sets a daemon aside after a failed connect
+static void Eject(struct OtpPool *pool, struct Endpoint *endpoint) {
+	int shift = endpoint->failures < 16 ? endpoint->failures : 16;
+	long long backoff = (long long)BACKOFF_MS << shift;
+
+	if (endpoint->downUntil == 0) pool->down++;
+	endpoint->failures++;
+	endpoint->downUntil = PoolNow() + (backoff < BACKOFF_MAX_MS ? backoff : BACKOFF_MAX_MS);
+}
+
+// Picks the daemon with the fewest messages outstanding that is not set
+// aside, starting the scan past the last one picked so ties are shared
+static struct Endpoint *PickLeast(struct OtpPool *pool, long long now) {
+	struct Endpoint *endpoint, *best = NULL;
+	int i;
+
+	for (i = 0; i < pool->numEndpoints; i++) {
+		endpoint = &pool->endpoints[(pool->next + i) % pool->numEndpoints];
+		if (endpoint->downUntil > now) continue;
+		if (best == NULL || endpoint->outstanding < best->outstanding) best = endpoint;
+	}
+	if (best != NULL) pool->next = (best - pool->endpoints + 1) % pool->numEndpoints;
+	return best;
+}
+
+// Picks two daemons at random that are not set aside and returns the one
+// with fewer messages outstanding
+static struct Endpoint *PickTwo(struct OtpPool *pool, long long now) {
+	struct Endpoint *first, *second;
+	int i, count, a, b;
+
+	if (pool->down == 0) count = pool->numEndpoints;
+	else {
+		for (i = count = 0; i < pool->numEndpoints; i++)
+			if (pool->endpoints[i].downUntil <= now) pool->eligible[count++] = i;
+	}
+	if (count == 0) return NULL;
+	if (count == 1) return &pool->endpoints[pool->down == 0 ? 0 : pool->eligible[0]];
+
+	a = NextRandom(pool) % count;
+	b = NextRandom(pool) % (count - 1);
+	if (b >= a) b++;
+	first = &pool->endpoints[pool->down == 0 ? a : pool->eligible[a]];
+	second = &pool->endpoints[pool->down == 0 ? b : pool->eligible[b]];
+	return second->outstanding < first->outstanding ? second : first;
+}
+
+// Picks the connection to a daemon to send on: an idle one, else an empty
+// slot (which is connected), else the least loaded. Returns NULL, with
+// status set, if there is none and a connect failed.
+static struct PoolConn *PickConn(struct OtpPool *pool, struct Endpoint *endpoint, int *status) {
+	struct PoolConn *conn, *best = NULL, *empty = NULL;
+	size_t pending, bestPending = 0;
+	int i;
+
+	for (i = 0; i < pool->perDaemon; i++) {
+		conn = &endpoint->conns[i];
+
+		// An idle connection may have been closed by the daemon. Outside a
+		// poll a failed connection can be closed and its slot filled again
+		// right away; inside one it waits for the poll to finish.
+		if (conn->client != NULL && !conn->broken && OtpPending(conn->client) == 0 && HungUp(conn->client))
+			conn->broken = 1;
+		if (conn->broken && !pool->polling) Empty(conn);
+		if (conn->client == NULL) {
+			if (empty == NULL) empty = conn;
+			continue;
+		}
+		if (conn->broken) continue;
+
+		pending = OtpPending(conn->client);
+		if (pending == 0) return conn;
+		if (best == NULL || pending < bestPending) {
+			best = conn;
+			bestPending = pending;
+		}
+	}
+
+	if (empty != NULL) {
+		*status = OtpConnectTo(&empty->client, endpoint->name, pool->op);
+		if (*status == STATUS_OK) return empty;
+		return NULL;
+	}
+	*status = OTP_ERR_CONNECT;
+	return best;
+}
+
+// Runs a message's callback and recycles it
+static void Complete(struct OtpPool *pool, struct PoolRequest *req, int status) {
+	pool->pending--;
+	pool->finished++;
+	req->next = pool->freeList;
+	pool->freeList = req;
+	req->done(req->arg, status, req->out, req->n);
+}
+
+// OtpDone for every message on a pool connection. One cut off by a failed
+// or closed connection is queued to go again, if it has tries left.
+static void Finished(void *arg, int status, char *out, size_t n) {
+	struct PoolRequest *req = arg;
+	struct OtpPool *pool = req->pool;
+
+	req->conn->endpoint->outstanding--;
+	if ((status == OTP_ERR_IO || status == OTP_ERR_CLOSED) && !pool->closing) {
+		req->conn->broken = 1;
+		if (req->tries < OTP_POOL_TRIES) {
+			req->next = NULL;
+			if (pool->retryTail != NULL) pool->retryTail->next = req;
+			else pool->retryHead = req;
+			pool->retryTail = req;
+			return;
+		}
+		status = OTP_ERR_IO;
+	}
+	Complete(pool, req, status);
+}
+
+// Sends a message on the connection the balance rule picks. Daemons that
+// cannot be connected to are set aside and the pick made again. Returns
+// STATUS_OK or an OTP_ERR_ code.
+static int Dispatch(struct OtpPool *pool, struct PoolRequest *req) {
+	struct Endpoint *endpoint;
+	struct PoolConn *conn;
+	int status, failure = OTP_ERR_CONNECT;
+	long long now;
+
+	for (;;) {
+		// The clock is only needed to see if a daemon's time out is up
+		now = pool->down > 0 ? PoolNow() : 0;
+		endpoint = pool->balance == OTP_BALANCE_TWO ? PickTwo(pool, now) : PickLeast(pool, now);
+		if (endpoint == NULL) return failure;
+
+		conn = PickConn(pool, endpoint, &status);
+		if (conn == NULL) {
+			failure = status;
+			Eject(pool, endpoint);
+			continue;
+		}
+		status = OtpSubmit(conn->client, req->op, req->text, req->key, req->out, req->n, Finished, req);
+		if (status == OTP_ERR_IO) {
+			conn->broken = 1;
+			continue;
+		}
+		if (status != STATUS_OK) return status;
+
+		// A daemon back from being set aside is in rotation again
+		if (endpoint->downUntil != 0) {
+			endpoint->downUntil = 0;
+			pool->down--;
+		}
+		endpoint->failures = 0;
+		endpoint->outstanding++;
+		req->conn = conn;
+		req->tries++;
+		return STATUS_OK;
+	}
+}
+
+// Closes the connections that have failed, emptying their slots, and sends
+// the messages they cut off again. A message that cannot go anywhere
+// finishes with the reason.
+static void Resubmit(struct OtpPool *pool) {
+	struct PoolRequest *req;
+	int i, j, status;
+
+	for (i = 0; i < pool->numEndpoints; i++) {
+		for (j = 0; j < pool->perDaemon; j++)
+			if (pool->endpoints[i].conns[j].broken) Empty(&pool->endpoints[i].conns[j]);
+	}
+
+	while ((req = pool->retryHead) != NULL) {
+		pool->retryHead = req->next;
+		if (pool->retryHead == NULL) pool->retryTail = NULL;
+		status = Dispatch(pool, req);
+		if (status != STATUS_OK) Complete(pool, req, status);
+	}
+}
+
+int OtpPoolOpen(struct OtpPool **pool, const char *endpoints, int perDaemon, int balance, char op) {
+	struct OtpPool *p;
+	struct Endpoint *endpoint;
+	char *name, *savePtr;
+	int i, j, count, status, failure = OTP_ERR_CONNECT;
+
+	p = calloc(1, sizeof(struct OtpPool));
+	if (p == NULL) return OTP_ERR_NOMEM;
+	p->perDaemon = perDaemon > 0 ? perDaemon : 1;
+	p->balance = balance;
+	p->op = op;
+	p->random = (unsigned int)PoolNow() ^ (unsigned int)getpid() << 16;
+	if (p->random == 0) p->random = 1;
+
+	// Split up the list, then make room for its daemons and their
+	// connections
+	p->names = strdup(endpoints);
+	if (p->names == NULL) goto failed;
+	for (i = 0, count = 1; endpoints[i] != '\0'; i++) count += endpoints[i] == ',';
+	p->endpoints = calloc(count, sizeof(struct Endpoint));
+	p->eligible = calloc(count, sizeof(int));
+	p->pfds = calloc(count * p->perDaemon, sizeof(struct pollfd));
+	p->polled = calloc(count * p->perDaemon, sizeof(struct PoolConn *));
+	if (p->endpoints == NULL || p->eligible == NULL || p->pfds == NULL || p->polled == NULL) goto failed;
+	for (name = strtok_r(p->names, ",", &savePtr); name != NULL; name = strtok_r(NULL, ",", &savePtr)) {
+		endpoint = &p->endpoints[p->numEndpoints++];
+		endpoint->name = name;
+		endpoint->conns = calloc(p->perDaemon, sizeof(struct PoolConn));
+		if (endpoint->conns == NULL) goto failed;
+		for (j = 0; j < p->perDaemon; j++) endpoint->conns[j].endpoint = endpoint;
+	}
+	if (p->numEndpoints == 0) goto failed;
+
+	// Warm every connection now; a daemon that fails is set aside and
+	// its remaining slots are filled once it is back
+	for (i = 0; i < p->numEndpoints; i++) {
+		endpoint = &p->endpoints[i];
+		for (j = 0; j < p->perDaemon; j++) {
+			status = OtpConnectTo(&endpoint->conns[j].client, endpoint->name, op);
+			if (status == STATUS_OK) continue;
+			failure = status;
+			Eject(p, endpoint);
+			break;
+		}
+	}
+	if (p->down == p->numEndpoints) {
+		OtpPoolClose(p);
+		return failure;
+	}
+
+	*pool = p;
+	return STATUS_OK;
+
+failed:
+	status = p->names != NULL && p->numEndpoints == 0 ? OTP_ERR_CONNECT : OTP_ERR_NOMEM;
+	OtpPoolClose(p);
+	return status;
+}
+
+int OtpPoolSubmit(struct OtpPool *pool, char op, const char *text, const char *key, char *out, size_t n,
+		OtpDone done, void *arg) {
+	struct PoolRequest *req;
+	int status;
+
+	if (pool->freeList != NULL) {
+		req = pool->freeList;
+		pool->freeList = req->next;
+	}
+	else if ((req = malloc(sizeof(struct PoolRequest))) == NULL) return OTP_ERR_NOMEM;
+	req->pool = pool;
+	req->op = op;
+	req->text = text;
+	req->key = key;
+	req->out = out;
+	req->n = n;
+	req->done = done;
+	req->arg = arg;
+	req->tries = 0;
+
+	status = Dispatch(pool, req);
+	if (status != STATUS_OK) {
+		req->next = pool->freeList;
+		pool->freeList = req;
+		return status;
+	}
+	pool->pending++;
+	return STATUS_OK;
+}
+
+int OtpPoolPoll(struct OtpPool *pool, int timeoutMs) {
+	struct PoolConn *conn;
+	size_t finished = pool->finished;
+	int i, j, count = 0;
+
+	Resubmit(pool);
+
+	// Wait on every connection with messages outstanding. One that has
+	// failed already wants no events, but is moved along at once so its
+	// messages are finished.
+	for (i = 0; i < pool->numEndpoints; i++) {
+		for (j = 0; j < pool->perDaemon; j++) {
+			conn = &pool->endpoints[i].conns[j];
+			if (conn->client == NULL || OtpPending(conn->client) == 0) continue;
+			pool->pfds[count].fd = OtpClientFD(conn->client);
+			pool->pfds[count].events = OtpClientEvents(conn->client);
+			pool->pfds[count].revents = 0;
+			if (pool->pfds[count].events == 0) timeoutMs = 0;
+			pool->polled[count++] = conn;
+		}
+	}
+	if (count == 0) return (int)(pool->finished - finished);
+	if (poll(pool->pfds, count, timeoutMs) < 0 && errno != EINTR) return OTP_ERR_IO;
+
+	pool->polling = 1;
+	for (i = 0; i < count; i++) {
+		if (pool->pfds[i].revents == 0 && pool->pfds[i].events != 0) continue;
+		if (OtpPoll(pool->polled[i]->client, 0) < 0) pool->polled[i]->broken = 1;
+	}
+	pool->polling = 0;
+
+	Resubmit(pool);
+	return (int)(pool->finished - finished);
+}
+
+int OtpPoolDrain(struct OtpPool *pool) {
+	while (pool->pending > 0) {
+		if (OtpPoolPoll(pool, -1) < 0) return OTP_ERR_IO;
+	}
+	return STATUS_OK;
+}
+
+size_t OtpPoolPending(const struct OtpPool *pool) {
+	return pool->pending;
+}
+
+int OtpPoolHealthy(const struct OtpPool *pool) {
+	return pool->numEndpoints - pool->down;
+}
+
+void OtpPoolClose(struct OtpPool *pool) {
+	struct PoolRequest *req;
+	int i, j;
+
+	pool->closing = 1;
+	for (i = 0; i < pool->numEndpoints; i++) {
+		for (j = 0; j < pool->perDaemon; j++)
+			if (pool->endpoints[i].conns[j].client != NULL) OtpClose(pool->endpoints[i].conns[j].client);
+		free(pool->endpoints[i].conns);
+	}
+	while ((req = pool->retryHead) != NULL) {
+		pool->retryHead = req->next;
+		Complete(pool, req, OTP_ERR_CLOSED);
+	}
+	while ((req = pool->freeList) != NULL) {
+		pool->freeList = req->next;
+		free(req);
+	}
+	free(pool->endpoints);
+	free(pool->eligible);
+	free(pool->pfds);
+	free(pool->polled);
+	free(pool->names);
+	free(pool);
+}
@@ -0,0 +1,125 @@
+/*
+File: otp_prefork.c
+Author: Adeline Harcourt
+Description: The prefork engine for the otp daemons (-e prefork). Like the
+		fork engine it serves every connection in a process apart from
+		the daemon, but the processes are forked ahead of time rather
+		than once per accept. The master keeps a pool of -p workers. Each
+		one blocks in accept on the shared listeners and serves one
+		connection after another with blocking calls, keeping its
+		connection buffers from each to the next. After -n connections a
+		worker exits, so whatever it has grown or leaked is given back,
+		and the master, which sits blocked in waitpid, reaps it and forks
+		a replacement. A worker that is killed is replaced the same way;
+		one that exits with an error stops the daemon, since a new one
+		would only hit the same error.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include "otp_server.h"
+
+// Accepts and serves connections until the worker has served its share,
+// then exits
+static void RunWorker(struct ServerConfig *config, pid_t master) {
+	struct Conn *conn = NULL;
+	const char *failure;
+	int fd, served = 0;
+
+	// Go down with the master, and leave reporting to it. A master that
+	// died before the prctl sends no signal, so check it is still there.
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() != master) _exit(0);
+	signal(SIGUSR1, SIG_IGN);
+
+	if (config->metricsFD >= 0) close(config->metricsFD);
+	if (config->ringFD >= 0) close(config->ringFD);
+	MetricsForked();
+
+	while (config->recycleAfter == 0 || served < config->recycleAfter) {
+		// Accept a connection, blocking if one is not available until one connects
+		fd = AcceptNext(config);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) continue;
+			error("prefork worker could not accept connection", 1);
+		}
+		CountAccept(config);
+
+		// The first connection gets a Conn, and the rest reuse it
+		if (conn == NULL) conn = NewConn(fd);
+		else ReuseConn(conn, fd);
+		if (conn == NULL) error("prefork worker could not allocate connection", 1);
+
+		// A bad connection is reported and closed, and the worker carries on
+		failure = ServeBlocking(config, conn);
+		CloseConn(conn);
+		if (failure != NULL) fprintf(stderr, "ERROR: %s %s\n", config->name, failure);
+		served++;
+	}
+
+	if (conn != NULL) FreeConn(conn);
+	exit(0);
+}
+
+// Forks a worker and returns its pid
+static pid_t StartWorker(struct ServerConfig *config) {
+	pid_t master = getpid(), spawnpid = fork();
+
+	if (spawnpid < 0) error("could not start prefork worker", 1);
+	if (spawnpid == 0) RunWorker(config, master);
+	return spawnpid;
+}
+
+// The prefork engine: fork the pool, then replace each worker as it exits
+int RunPreforkEngine(struct ServerConfig *config) {
+	pid_t *workers, pid;
+	int i, status, exitVal = 0;
+
+	// With several listeners the workers poll them all, and the one that
+	// loses the race for a connection must not then block in accept
+	if (config->numListeners > 1) {
+		for (i = 0; i < config->numListeners; i++)
+			fcntl(config->listenFDs[i], F_SETFL, fcntl(config->listenFDs[i], F_GETFL) | O_NONBLOCK);
+	}
+
+	workers = malloc(config->poolSize * sizeof(pid_t));
+	if (workers == NULL) error("could not allocate prefork pool", 1);
+	for (i = 0; i < config->poolSize; i++) workers[i] = StartWorker(config);
+
+	// Keep the daemon running. waitpid returns as each worker exits, and
+	// SIGUSR1 interrupts it for a report.
+	while (1) {
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno != EINTR) break;
+			CheckReport(config);
+			continue;
+		}
+
+		for (i = 0; i < config->poolSize; i++) {
+			if (workers[i] != pid) continue;
+			if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+				fprintf(stderr, "%s prefork worker exited with status %d, stopping\n", config->name, WEXITSTATUS(status));
+				exitVal = 1;
+				break;
+			}
+			if (WIFSIGNALED(status))
+				fprintf(stderr, "%s prefork worker was killed by signal %d, restarting\n", config->name, WTERMSIG(status));
+			workers[i] = StartWorker(config);
+		}
+		if (exitVal != 0) break;
+	}
+
+	// Stop the pool
+	for (i = 0; i < config->poolSize; i++) kill(workers[i], SIGTERM);
+	while (waitpid(-1, NULL, 0) > 0 || errno == EINTR);
+	free(workers);
+	return exitVal;
+}
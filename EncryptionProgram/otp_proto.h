@@ -0,0 +1,178 @@
+/*
+File: otp_proto.h
+Author: Adeline Harcourt
+Description: Wire protocol constants shared by the otp clients and daemons.
+		Every connection starts with a 3 char client identifier answered by
+		OK, NO, or BZ when an original protocol client would be turned
+		away by a busy daemon. The identifier picks the protocol for the
+		rest of the connection:
+		  ENC / DEC - the original protocol. An int message size (text
+		              length + newline), the text, the key, then the
+		              result is sent back in one piece.
+		  ENS / DES - the framed protocol. After the one handshake the
+		              connection carries any number of messages. Each
+		              message is a series of frames, each an 8 byte
+		              header followed by up to STREAM_CHUNK_SIZE chars
+		              of text and then the same number of key chars;
+		              the last frame of a message has FRAME_LAST set.
+		              Every frame is answered, in order, by a frame
+		              holding the result for that chunk, so clients may
+		              pipeline requests without waiting on replies. The
+		              client ends the connection by closing its side.
+		  ENP / DEP - the framed protocol with every text, key and
+		              result chunk packed 5 bits per char (see
+		              PackText in otp_cipher.h), which cuts the bytes on
+		              the wire by more than a third. Frame lengths still
+		              count chars; each chunk takes PACKED_SIZE(length)
+		              bytes.
+		A framed message may instead use the daemon's key store (-k) by
+		setting FRAME_PAD on its frames. A pad frame carries an 8 byte pad
+		offset after the header, then the text alone, with no key. Its
+		reply carries the offset its chunk was ciphered at, then the
+		result. When encoding, the offset field of the first frame holds
+		the number of pad chars to reserve for the whole message, and
+		later frames leave it 0. The message's chunks then use
+		consecutive pad chars. When decoding, every frame names the
+		offset its chunk was encoded at.
+		Clients on the daemon's host can also use a shared memory ring
+		(-R): they connect to the ring's Unix socket and send RNG with
+		SCM_RIGHTS carrying a sealed memfd laid out as a RingHeader then
+		a data area, and two eventfds. After the OK, each request is a
+		RingSlot naming text and key in the data area; the client bumps
+		head and signals the first eventfd, and the daemon ciphers in
+		place, sets the slot's status, bumps tail and signals the second.
+		The session ends when the client closes the socket.
+*/
+#ifndef OTP_PROTO_H
+#define OTP_PROTO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// Client identifiers sent in the handshake
+#define ID_ENCODE        "ENC"
+#define ID_DECODE        "DEC"
+#define ID_ENCODE_STREAM "ENS"
+#define ID_DECODE_STREAM "DES"
+#define ID_ENCODE_PACKED "ENP"
+#define ID_DECODE_PACKED "DEP"
+#define ID_RING          "RNG"
+
+// Handshake answer to an original protocol client that a busy daemon
+// turns away
+#define ID_BUSY "BZ"
+
+// Operation codes carried in frame headers
+#define OP_ENCODE 'E'
+#define OP_DECODE 'D'
+
+// Frame header flags
+#define FRAME_LAST 0x01		// Final chunk of a message
+#define FRAME_PAD  0x02		// Key comes from the daemon's pad, not the frame
+
+// Frame header status codes (always STATUS_OK in requests)
+#define STATUS_OK        0
+#define STATUS_WRONG_OP  1	// Operation not served by this daemon
+#define STATUS_TOO_LARGE 2	// Chunk longer than STREAM_CHUNK_SIZE, or pad asked for past the limit
+#define STATUS_NO_PAD    3	// Pad frame sent to a daemon without a key store
+#define STATUS_PAD_USED  4	// Not enough unused pad left for the message
+#define STATUS_BAD_PAD   5	// Pad range not handed out, or past the reservation
+#define STATUS_BUSY      6	// Daemon at its request or byte limit, and no room came
+#define STATUS_OVER_SIZE 7	// Message longer than the daemon allows
+#define STATUS_BAD_RANGE 8	// Ring slot text and key run past the data area
+#define STATUS_BAD_TEXT  9	// Packed chunk holds a code that is not a char
+
+#define FRAME_HEADER_SIZE 8
+#define STREAM_CHUNK_SIZE 65536
+#define PAD_OFFSET_SIZE 8
+
+// Longest message the original protocol carries unless a daemon's -m says
+// otherwise. The daemon holds all of such a message at once, and turns
+// longer ones away; otp_enc and otp_dec send them as frames instead.
+#define LEGACY_MAX_CHARS (64 << 20)
+
+// Bytes n chars take on the wire when packed 5 bits each
+#define PACKED_SIZE(n) (((n) * 5 + 7) / 8)
+
+// Shared memory ring layout. The memfd must be sealed against shrinking
+// (F_SEAL_SHRINK) and at least RING_HEADER_SIZE bytes; the data area is
+// the rest of it.
+#define RING_MAGIC 0x4F545052	// "OTPR"
+#define RING_SLOTS 256
+#define RING_HEADER_SIZE 8192
+
+// One ring request: length chars of text at offset in the data area,
+// followed by length chars of key, which the result overwrites
+struct RingSlot {
+	uint64_t offset;
+	uint32_t length;
+	uint8_t op;			// OP_ENCODE or OP_DECODE
+	uint8_t unused;
+	uint16_t status;	// STATUS_ code, set by the daemon
+};
+
+// Start of the ring memfd. head is written only by the client and tail
+// only by the daemon; both count slots from the start of the session and
+// sit on their own cache lines.
+struct RingHeader {
+	uint32_t magic;
+	uint32_t unused;
+	uint64_t dataSize;		// Bytes after RING_HEADER_SIZE, set by the client
+	uint32_t head __attribute__((aligned(64)));	// Slots submitted
+	uint32_t tail __attribute__((aligned(64)));	// Slots answered
+	struct RingSlot slots[RING_SLOTS] __attribute__((aligned(64)));
+};
+
+// One frame header, as laid out in host order
+struct FrameHeader {
+	uint8_t op;			// OP_ENCODE or OP_DECODE
+	uint8_t flags;		// FRAME_ flags
+	uint16_t status;	// STATUS_ code (replies only)
+	uint32_t length;	// Chars of text (and key) in this frame
+};
+
+// Writes a frame header into its 8 byte wire form
+static inline void PackFrameHeader(unsigned char *buf, const struct FrameHeader *header) {
+	uint16_t status = htons(header->status);
+	uint32_t length = htonl(header->length);
+
+	buf[0] = header->op;
+	buf[1] = header->flags;
+	memcpy(buf + 2, &status, sizeof(status));
+	memcpy(buf + 4, &length, sizeof(length));
+}
+
+// Reads a frame header from its 8 byte wire form
+static inline void UnpackFrameHeader(const unsigned char *buf, struct FrameHeader *header) {
+	uint16_t status;
+	uint32_t length;
+
+	memcpy(&status, buf + 2, sizeof(status));
+	memcpy(&length, buf + 4, sizeof(length));
+	header->op = buf[0];
+	header->flags = buf[1];
+	header->status = ntohs(status);
+	header->length = ntohl(length);
+}
+
+// Writes a pad offset into its 8 byte wire form (most significant byte first)
+static inline void PackPadOffset(unsigned char *buf, uint64_t offset) {
+	int i;
+
+	for (i = PAD_OFFSET_SIZE - 1; i >= 0; i--) {
+		buf[i] = offset & 0xFF;
+		offset >>= 8;
+	}
+}
+
+// Reads a pad offset from its 8 byte wire form
+static inline uint64_t UnpackPadOffset(const unsigned char *buf) {
+	uint64_t offset = 0;
+	int i;
+
+	for (i = 0; i < PAD_OFFSET_SIZE; i++) offset = (offset << 8) | buf[i];
+	return offset;
+}
+
+#endif
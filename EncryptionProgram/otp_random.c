@@ -0,0 +1,159 @@
+/*
+File: otp_random.c
+Author: Adeline Harcourt
+Description: A ChaCha20 random generator for keygen. The 256-bit key comes
+		from getrandom(), a stream number fills the nonce and a 64-bit
+		block counter runs through the keystream. Blocks are made eight at
+		a time with GCC vector types, one block per lane, and written out
+		lane by lane (word 0 of every block, then word 1, and so on), so
+		the byte order differs from RFC 8439 but is the same on every CPU.
+		The block function is built for plain x86-64, AVX2 and AVX-512VL
+		(which has a rotate instruction) and the fastest is picked when a
+		stream starts.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/random.h>
+#include "otp_random.h"
+#include "otp_cipher.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RANDOM_X86
+#endif
+
+typedef uint32_t Lanes __attribute__((vector_size(4 * RANDOM_LANES)));
+typedef void (*BlockFunction)(struct RandomStream *random, unsigned char *out, size_t batches);
+
+#define ROTATE(v, bits) (((v) << (bits)) | ((v) >> (32 - (bits))))
+
+#define QUARTER_ROUND(a, b, c, d) \
+	a += b; d ^= a; d = ROTATE(d, 16); \
+	c += d; b ^= c; b = ROTATE(b, 12); \
+	a += b; d ^= a; d = ROTATE(d, 8); \
+	c += d; b ^= c; b = ROTATE(b, 7);
+
+// Writes batches * RANDOM_BATCH bytes of keystream to out and moves the
+// counter on. Inlined into each of the builds below.
+static inline __attribute__((always_inline)) void MakeBlocks(struct RandomStream *random, unsigned char *out, size_t batches) {
+	static const uint32_t sigma[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+	Lanes in[16], x[16];
+	uint64_t counter;
+	int i, lane;
+
+	for (i = 0; i < 4; i++) in[i] = (Lanes){0} + sigma[i];
+	for (i = 0; i < 8; i++) in[4 + i] = (Lanes){0} + random->key[i];
+	in[14] = (Lanes){0} + (uint32_t)random->stream;
+	in[15] = (Lanes){0} + (uint32_t)(random->stream >> 32);
+
+	while (batches-- > 0) {
+		for (lane = 0; lane < RANDOM_LANES; lane++) {
+			counter = random->counter + lane;
+			in[12][lane] = (uint32_t)counter;
+			in[13][lane] = (uint32_t)(counter >> 32);
+		}
+		random->counter += RANDOM_LANES;
+
+		for (i = 0; i < 16; i++) x[i] = in[i];
+		for (i = 0; i < 10; i++) {
+			// Column round, then diagonal round
+			QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+			QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+			QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+			QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+			QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+			QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+			QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+			QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+		}
+		for (i = 0; i < 16; i++) {
+			x[i] += in[i];
+			memcpy(out + i * sizeof(Lanes), &x[i], sizeof(Lanes));
+		}
+		out += RANDOM_BATCH;
+	}
+}
+
+static void MakeBlocksDefault(struct RandomStream *random, unsigned char *out, size_t batches) {
+	MakeBlocks(random, out, batches);
+}
+
+#ifdef RANDOM_X86
+__attribute__((target("avx2")))
+static void MakeBlocksAVX2(struct RandomStream *random, unsigned char *out, size_t batches) {
+	MakeBlocks(random, out, batches);
+}
+
+__attribute__((target("avx2,avx512f,avx512vl")))
+static void MakeBlocksAVX512(struct RandomStream *random, unsigned char *out, size_t batches) {
+	MakeBlocks(random, out, batches);
+}
+#endif
+
+// Picks the fastest block function for the cipher kernels' instruction set
+// level, so OTP_CIPHER_ISA caps this too
+static BlockFunction PickBlocks(void) {
+#ifdef RANDOM_X86
+	if (CipherIsa() >= CIPHER_ISA_AVX512) return MakeBlocksAVX512;
+	if (CipherIsa() >= CIPHER_ISA_AVX2) return MakeBlocksAVX2;
+#endif
+	return MakeBlocksDefault;
+}
+
+// Fills seed with RANDOM_SEED_SIZE bytes from the kernel
+void RandomSeed(unsigned char *seed) {
+	size_t filled = 0;
+	ssize_t n;
+
+	while (filled < RANDOM_SEED_SIZE) {
+		n = getrandom(seed + filled, RANDOM_SEED_SIZE - filled, 0);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("getrandom");
+			exit(1);
+		}
+		filled += n;
+	}
+}
+
+// Starts a stream from a seed. Different stream numbers give unrelated
+// keystreams from the same seed.
+void RandomInit(struct RandomStream *random, const unsigned char *seed, uint64_t stream) {
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		random->key[i] = (uint32_t)seed[4 * i] | (uint32_t)seed[4 * i + 1] << 8 |
+			(uint32_t)seed[4 * i + 2] << 16 | (uint32_t)seed[4 * i + 3] << 24;
+	}
+	random->stream = stream;
+	random->counter = 0;
+	random->blocks = PickBlocks();
+}
+
+// Writes n bytes of keystream to out
+void RandomBytes(struct RandomStream *random, unsigned char *out, size_t n) {
+	unsigned char tail[RANDOM_BATCH];
+	size_t whole = n / RANDOM_BATCH;
+
+	random->blocks(random, out, whole);
+	n -= whole * RANDOM_BATCH;
+	if (n > 0) {
+		random->blocks(random, tail, 1);
+		memcpy(out + whole * RANDOM_BATCH, tail, n);
+	}
+}
+
+// Writes n key chars to out
+void RandomKey(struct RandomStream *random, char *out, size_t n) {
+	size_t count = 0, want;
+
+	// Some bytes are dropped, so keep going until there are enough chars.
+	// Never convert more bytes than there is room left for.
+	while (count < n) {
+		want = n - count;
+		if (want > RANDOM_RAW_SIZE) want = RANDOM_RAW_SIZE;
+		RandomBytes(random, random->raw, want);
+		count += KeyFromBytes(out + count, random->raw, want);
+	}
+}
@@ -0,0 +1,36 @@
+/*
+File: otp_random.h
+Author: Adeline Harcourt
+Description: Declarations for the random generator behind keygen: a
+		ChaCha20 keystream seeded from the kernel with getrandom(), whose
+		bytes are turned into key chars by KeyFromBytes.
+*/
+#ifndef OTP_RANDOM_H
+#define OTP_RANDOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RANDOM_SEED_SIZE 32
+
+// ChaCha20 blocks are made this many at a time, one per vector lane
+#define RANDOM_LANES 8
+#define RANDOM_BATCH (RANDOM_LANES * 64)
+
+// Raw bytes made per round of key generation
+#define RANDOM_RAW_SIZE (32 * RANDOM_BATCH)
+
+struct RandomStream {
+	uint32_t key[8];
+	uint64_t stream;	// Goes in the nonce, so streams from one seed never overlap
+	uint64_t counter;	// Next block number
+	void (*blocks)(struct RandomStream *random, unsigned char *out, size_t batches);
+	unsigned char raw[RANDOM_RAW_SIZE];
+};
+
+void RandomSeed(unsigned char *seed);
+void RandomInit(struct RandomStream *random, const unsigned char *seed, uint64_t stream);
+void RandomBytes(struct RandomStream *random, unsigned char *out, size_t n);
+void RandomKey(struct RandomStream *random, char *out, size_t n);
+
+#endif
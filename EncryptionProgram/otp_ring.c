@@ -0,0 +1,271 @@
+/*
+File: otp_ring.c
+Author: Adeline Harcourt
+Description: Shared memory ring sessions for clients on the daemon's host
+		(-R). A thread accepts on the ring's Unix socket and takes each
+		client's handshake: RNG, with a memfd and two eventfds passed by
+		SCM_RIGHTS. The memfd must be sealed against shrinking so the
+		client cannot cut the mapping out from under the daemon. Each
+		session then gets a thread of its own, which waits on the submit
+		eventfd, ciphers every new slot in place in the shared memory (so
+		text, key and result never pass through a socket) and signals the
+		completion eventfd once it has caught up. Slots go through the
+		same admission limits and metrics as socket requests. Runs in the
+		process that stays up, like the metrics server.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "otp_server.h"
+#include "otp_cipher.h"
+
+_Static_assert(sizeof(struct RingHeader) <= RING_HEADER_SIZE, "ring header does not fit");
+
+#define RING_FDS 3				// memfd, submit eventfd, completion eventfd
+#define RING_HANDSHAKE_SECS 1	// Time a new client has to send its handshake
+
+// One client's ring
+struct RingSession {
+	struct ServerConfig *config;
+	int fd;						// Session socket; the client closing it ends the session
+	int memFD, submitFD, completeFD;
+	struct RingHeader *header;	// The mapped memfd
+	char *data;					// Its data area
+	size_t mapSize;
+	uint64_t dataSize;
+};
+
+// Unmaps the ring and closes everything but the session socket
+static void CloseRing(struct RingSession *session) {
+	if (session->header != NULL) munmap(session->header, session->mapSize);
+	if (session->memFD >= 0) close(session->memFD);
+	if (session->submitFD >= 0) close(session->submitFD);
+	if (session->completeFD >= 0) close(session->completeFD);
+}
+
+// Reads the handshake and the descriptors passed with it, then checks and
+// maps the ring. Returns 1 if the client may have its session.
+static int OpenRing(struct RingSession *session) {
+	union {
+		char buf[CMSG_SPACE(RING_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct timeval timeout = { RING_HANDSHAKE_SECS, 0 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct stat info;
+	char id[3];
+	int fds[RING_FDS], seals;
+
+	session->memFD = session->submitFD = session->completeFD = -1;
+	setsockopt(session->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	memset(&msg, '\0', sizeof(msg));
+	iov.iov_base = id;
+	iov.iov_len = sizeof(id);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	if (recvmsg(session->fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) != sizeof(id)) return 0;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return 0;
+	if (cmsg->cmsg_len != CMSG_LEN(RING_FDS * sizeof(int))) {
+		// Close whatever did come, so it does not leak
+		for (int *fd = (int *)CMSG_DATA(cmsg); (char *)fd < (char *)cmsg + cmsg->cmsg_len; fd++) close(*fd);
+		return 0;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	session->memFD = fds[0];
+	session->submitFD = fds[1];
+	session->completeFD = fds[2];
+	if (memcmp(id, ID_RING, 3) != 0 || (msg.msg_flags & MSG_CTRUNC)) return 0;
+
+	// Only a ring that cannot shrink is safe to map. Anything but a memfd
+	// fails F_GET_SEALS, and -1 would pass the bit test.
+	seals = fcntl(session->memFD, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_SHRINK)) return 0;
+	if (fstat(session->memFD, &info) < 0 || info.st_size < RING_HEADER_SIZE) return 0;
+	session->mapSize = info.st_size;
+	session->header = mmap(NULL, session->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, session->memFD, 0);
+	if (session->header == MAP_FAILED) {
+		session->header = NULL;
+		return 0;
+	}
+	session->data = (char *)session->header + RING_HEADER_SIZE;
+	session->dataSize = session->mapSize - RING_HEADER_SIZE;
+	if (session->header->magic != RING_MAGIC) return 0;
+
+	// Session sockets block for as long as the session lasts
+	timeout.tv_sec = 0;
+	setsockopt(session->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	return 1;
+}
+
+// Ciphers one slot in place and sets its status. The slot is copied out
+// first, since the client can change the shared copy at any time.
+static void CipherSlot(struct RingSession *session, struct Conn *conn, struct RingSlot *shared) {
+	struct ServerConfig *config = session->config;
+	struct RingSlot slot;
+	char *text, *key;
+	int status;
+
+	memcpy(&slot, shared, sizeof(slot));
+	conn->phaseMark = MetricsNow();
+	if (!((slot.op == OP_ENCODE && (config->serves & SERVE_ENCODE)) ||
+			(slot.op == OP_DECODE && (config->serves & SERVE_DECODE))))
+		status = STATUS_WRONG_OP;
+	else if (2 * (uint64_t)slot.length > session->dataSize || slot.offset > session->dataSize - 2 * (uint64_t)slot.length)
+		status = STATUS_BAD_RANGE;
+	else {
+		conn->op = slot.op;
+		conn->length = slot.length;
+		status = AdmitRequest(config, conn, slot.length);
+		if (status == ADMIT_WAIT) status = AdmitWait(config, conn);
+	}
+
+	if (status == STATUS_OK) {
+		text = session->data + slot.offset;
+		key = text + slot.length;
+		if (slot.op == OP_ENCODE) EncodeText(key, text, key, slot.length);
+		else DecodeText(key, text, key, slot.length);
+		AdmitRelease(conn);
+		MetricPhase(conn, PHASE_CIPHER);
+		MetricCount(slot.op == OP_ENCODE ? METRIC_ENCODES : METRIC_DECODES, 1);
+		MetricCount(METRIC_CHARS, slot.length);
+	}
+	else MetricError(ERROR_STATUS + status);
+	shared->status = status;
+}
+
+// Serves one session until the client closes its socket. Slots are
+// answered in order; the completion eventfd is signalled once per batch.
+static void *ServeRing(void *arg) {
+	struct RingSession *session = arg;
+	struct RingHeader *header = session->header;
+	struct pollfd pfds[2];
+	struct Conn *conn = NewConn(session->fd);
+	uint32_t head, tail = 0;
+	uint64_t count;
+
+	if (conn == NULL) {
+		close(session->fd);
+		CloseRing(session);
+		free(session);
+		return NULL;
+	}
+	__atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+
+	while (1) {
+		pfds[0].fd = session->fd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = session->submitFD;
+		pfds[1].events = POLLIN;
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		// Nothing more is sent on the socket, so anything on it is the end
+		if (pfds[0].revents) {
+			conn->state = CONN_DONE;
+			break;
+		}
+		if (!(pfds[1].revents & POLLIN)) continue;
+		if (read(session->submitFD, &count, sizeof(count)) < 0 && errno != EAGAIN) break;
+
+		head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+		if (head - tail > RING_SLOTS) {
+			conn->state = CONN_FAILED; // More slots than the ring holds
+			break;
+		}
+		while (tail != head) {
+			CipherSlot(session, conn, &header->slots[tail % RING_SLOTS]);
+			tail++;
+			__atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+		}
+		count = 1;
+		if (write(session->completeFD, &count, sizeof(count)) < 0) break;
+	}
+
+	FreeConn(conn); // Closes the session socket
+	CloseRing(session);
+	free(session);
+	return NULL;
+}
+
+// Takes a new client's handshake and starts its session thread
+static void StartSession(struct ServerConfig *config, int fd) {
+	struct RingSession *session = calloc(1, sizeof(struct RingSession));
+	pthread_t threadID;
+	int ok;
+
+	if (session == NULL) {
+		close(fd);
+		return;
+	}
+	session->config = config;
+	session->fd = fd;
+	ok = OpenRing(session);
+	CountAccept(config);
+	if (!ok) MetricError(ERROR_REFUSED);
+	if (send(fd, ok ? "OK" : "NO", 2, MSG_NOSIGNAL) != 2) ok = 0;
+	if (ok && pthread_create(&threadID, NULL, ServeRing, session) == 0) {
+		pthread_detach(threadID);
+		return;
+	}
+
+	MetricCount(METRIC_CLOSES, 1);
+	close(fd);
+	CloseRing(session);
+	free(session);
+}
+
+// Accepts ring clients. Handshakes are taken here one at a time, each
+// with a short timeout.
+static void *RingServer(void *arg) {
+	struct ServerConfig *config = arg;
+	int fd;
+
+	while (1) {
+		fd = accept4(config->ringFD, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED) perror("ring accept");
+			continue;
+		}
+		StartSession(config, fd);
+	}
+	return NULL;
+}
+
+// Opens the Unix socket named by -R and starts the thread that accepts
+// ring clients
+void StartRingServer(struct ServerConfig *config) {
+	sigset_t all, old;
+	pthread_t threadID;
+
+	config->ringFD = OpenUnixListener(config, config->ringPath, config->backlog);
+	fcntl(config->ringFD, F_SETFD, FD_CLOEXEC);
+
+	// Neither it nor the session threads take signals, so they go to the
+	// engine as before
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&threadID, NULL, RingServer, config) != 0) error("could not start ring thread", 1);
+	pthread_detach(threadID);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
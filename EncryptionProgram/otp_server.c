@@ -0,0 +1,1073 @@
+/*
+File: otp_server.c
+Author: Adeline Harcourt (listener setup based on skeleton server.c code from
+		Professor Benjamin Brewster, OSU CS344 Spring 2017 Semester)
+Description: The server core shared by otp_enc_d, otp_dec_d and otp_d. This
+		file parses the daemon command line, opens the listening sockets,
+		holds the per-connection protocol state machine and runs the
+		original fork-per-connection engine. The prefork engine lives in
+		otp_prefork.c, the epoll engine in otp_epoll.c, the io_uring
+		engine in otp_uring.c, the shard
+		supervisor in otp_shard.c, the key store in otp_pad.c, the
+		admission limits in otp_admit.c, the metrics in otp_metrics.c,
+		the deadline timer wheel in otp_timer.c, the address and socket
+		option code in otp_net.c and the shared memory rings in
+		otp_ring.c. Each
+		request names its operation in the handshake (or frame header), so
+		one daemon can serve encoding and decoding from the same sockets
+		and workers.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include "otp_server.h"
+#include "otp_cipher.h"
+
+// Error function used for reporting issues with custom exit value
+void error(const char *msg, int exitVal) {
+	fprintf(stderr, "ERROR: %s\n", msg);
+	exit(exitVal);
+}
+
+// Reports a fatal error prefixed with the daemon name, e.g.
+// "otp_enc_d could not open socket"
+static void ServerError(struct ServerConfig *config, const char *msg) {
+	char message[256];
+	snprintf(message, sizeof(message), "%s %s", config->name, msg);
+	error(message, 1);
+}
+
+// Fills in the defaults for a daemon. The name is used in error messages
+// and serves says which operations (SERVE_ENCODE, SERVE_DECODE) clients
+// may ask for.
+void InitServerConfig(struct ServerConfig *config, const char *name, int serves) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	memset(config, '\0', sizeof(*config));
+	config->name = name;
+	config->serves = serves;
+	config->engine = ENGINE_EPOLL;
+	config->workers = cpus > 0 ? (int)cpus : 1;
+	config->shards = 1;
+	config->backlog = DEFAULT_BACKLOG;
+	config->poolSize = PREFORK_DEFAULT_POOL;
+	config->recycleAfter = PREFORK_DEFAULT_RECYCLE;
+	config->metricsFD = -1;
+	config->unixFD = -1;
+	config->ringFD = -1;
+	config->deadlines[DEADLINE_HANDSHAKE] = DEFAULT_HANDSHAKE_MS;
+	config->deadlines[DEADLINE_RECEIVE] = DEFAULT_RECEIVE_MS;
+	config->deadlines[DEADLINE_REPLY] = DEFAULT_REPLY_MS;
+	config->deadlines[DEADLINE_IDLE] = DEFAULT_IDLE_MS;
+	config->minRate = DEFAULT_MIN_RATE;
+	config->legacyMax = LEGACY_MAX_CHARS;
+
+	// Replies go out as soon as they are written. Small replies otherwise
+	// wait behind the last unacknowledged one until the client's delayed
+	// ACK fires, about 40ms per frame on a busy connection.
+	config->tuning.noDelay = 1;
+}
+
+// Prints the daemon usage message and exits
+static void ServerUsage(const char *prog) {
+	fprintf(stderr, "USAGE: %s [-e fork|prefork|epoll|uring] [-w workers] [-p processes] [-n connections]\n"
+		"\t[-s shards] [-b backlog] [-k padfile] [-c requests] [-i bytes] [-m chars] [-q ms]\n"
+		"\t[-t handshake,receive,reply[,idle]] [-r bytes/s] [-a address] [-o nodelay=0|1,cork=0|1,sndbuf=N,rcvbuf=N]\n"
+		"\t[-M metricssocket] [-U socket] [-R ringsocket]\n"
+		"\tport [port ...]\n", prog);
+	exit(1);
+}
+
+// Reads the comma separated deadlines given to -t, in the order of the
+// DEADLINE_ kinds. Kinds left off keep their defaults. Returns -1 if the
+// list is malformed.
+static int ParseDeadlines(struct ServerConfig *config, const char *list) {
+	char *end;
+	long ms;
+	int kind;
+
+	for (kind = 0; kind < DEADLINE_COUNT; kind++) {
+		ms = strtol(list, &end, 10);
+		if (end == list || ms < 0) return -1;
+		config->deadlines[kind] = (int)ms;
+		if (*end == '\0') return 0;
+		if (*end != ',') return -1;
+		list = end + 1;
+	}
+	return -1;
+}
+
+// Reads the daemon options and port numbers from the command line
+void ParseServerArgs(struct ServerConfig *config, int argc, char *argv[]) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, workersGiven = 0;
+
+	while ((opt = getopt(argc, argv, "e:w:p:n:s:b:k:c:i:m:q:t:r:a:o:M:U:R:")) != -1) {
+		switch (opt) {
+			case 'e':
+				// Pick the engine that drives connections
+				if (strcmp(optarg, "fork") == 0) config->engine = ENGINE_FORK;
+				else if (strcmp(optarg, "prefork") == 0) config->engine = ENGINE_PREFORK;
+				else if (strcmp(optarg, "epoll") == 0) config->engine = ENGINE_EPOLL;
+				else if (strcmp(optarg, "uring") == 0) config->engine = ENGINE_URING;
+				else ServerUsage(argv[0]);
+				break;
+			case 'w':
+				// Number of cipher worker threads (0 ciphers on the reactor
+				// thread). The io_uring engine always ciphers on its ring thread.
+				config->workers = atoi(optarg);
+				if (config->workers < 0) ServerUsage(argv[0]);
+				workersGiven = 1;
+				break;
+			case 'p':
+				// Worker processes kept by the prefork engine
+				config->poolSize = atoi(optarg);
+				if (config->poolSize < 1) ServerUsage(argv[0]);
+				break;
+			case 'n':
+				// Connections a prefork worker serves before it is replaced
+				// (0 keeps workers for good)
+				config->recycleAfter = atoi(optarg);
+				if (config->recycleAfter < 0) ServerUsage(argv[0]);
+				break;
+			case 's':
+				// Number of shard processes (0 for one per CPU)
+				config->shards = atoi(optarg);
+				if (config->shards == 0) config->shards = cpus > 0 ? (int)cpus : 1;
+				if (config->shards < 1) ServerUsage(argv[0]);
+				break;
+			case 'b':
+				config->backlog = atoi(optarg);
+				if (config->backlog < 1) ServerUsage(argv[0]);
+				break;
+			case 'k':
+				// Serve pad frames from this key store
+				config->padPath = optarg;
+				break;
+			case 'c':
+				// Requests admitted at once across the whole daemon
+				config->maxRequests = atoi(optarg);
+				if (config->maxRequests < 0) ServerUsage(argv[0]);
+				break;
+			case 'i':
+				// Text and key bytes admitted requests may hold at once
+				config->maxBytes = strtoul(optarg, NULL, 10);
+				break;
+			case 'm':
+				// Longest message, in chars, for either protocol. It
+				// replaces the original protocol's own default limit.
+				config->maxSize = strtoul(optarg, NULL, 10);
+				config->legacyMax = config->maxSize;
+				break;
+			case 'q':
+				// Milliseconds an over-limit request waits for room before
+				// being turned away (0 turns it away at once)
+				config->queueTimeout = atoi(optarg);
+				if (config->queueTimeout < 0) ServerUsage(argv[0]);
+				break;
+			case 't':
+				// Milliseconds a client has for the handshake, for each
+				// message, for each reply and between framed messages
+				// (0 waits for ever)
+				if (ParseDeadlines(config, optarg) < 0) ServerUsage(argv[0]);
+				break;
+			case 'r':
+				// Slowest a client may send or read once past a deadline's
+				// base time (0 lets it take as long as it likes)
+				config->minRate = strtoul(optarg, NULL, 10);
+				break;
+			case 'a':
+				// Bind the ports on this address (or the addresses of this
+				// host name) rather than every IPv4 address
+				config->bindHost = optarg;
+				break;
+			case 'o':
+				// TCP options for the ports and the connections on them
+				if (ParseTuning(&config->tuning, optarg) < 0) ServerUsage(argv[0]);
+				break;
+			case 'M':
+				// Serve metrics on this Unix socket
+				config->metricsPath = optarg;
+				break;
+			case 'U':
+				// Also serve both protocols on this Unix socket
+				config->unixPath = optarg;
+				break;
+			case 'R':
+				// Serve shared memory ring sessions on this Unix socket
+				config->ringPath = optarg;
+				break;
+			default:
+				ServerUsage(argv[0]);
+		}
+	}
+
+	// Shards already spread the load over the cores, so unless asked for,
+	// they cipher on their own threads rather than each starting a pool
+	if (config->shards > 1 && !workersGiven) config->workers = 0;
+
+	// Check input format from user
+	if (optind >= argc || argc - optind > MAX_PORTS) ServerUsage(argv[0]);
+	for (config->numPorts = 0; optind < argc; optind++) {
+		config->ports[config->numPorts++] = atoi(argv[optind]); // Get the port number, convert to an integer from a string
+	}
+}
+
+// Creates, binds and starts a listening socket on the given port, on the
+// address given by -a (the first of a host name's addresses that binds) or
+// on every IPv4 address
+int OpenListener(struct ServerConfig *config, int port) {
+	int listenSocketFD = -1, yes = 1;
+	struct addrinfo *addresses, *address;
+	const char *failure;
+	char portName[16], message[NET_HOST_SIZE + 64];
+
+	// Set up the address structs for this process (the server)
+	snprintf(portName, sizeof(portName), "%d", port);
+	addresses = ResolveEndpoint(config->bindHost, portName, 1, &failure);
+	if (addresses == NULL) {
+		snprintf(message, sizeof(message), "could not resolve %s: %s", config->bindHost, failure);
+		ServerError(config, message);
+	}
+
+	for (address = addresses; address != NULL; address = address->ai_next) {
+		// Set up the socket
+		listenSocketFD = socket(address->ai_family, address->ai_socktype, address->ai_protocol); // Create the socket
+		if (listenSocketFD < 0) ServerError(config, "could not open socket");
+		setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)); // Allow quick restarts
+		if (config->shards > 1 && setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0)
+			ServerError(config, "could not share port between shards"); // Each shard binds its own listener
+
+		// Connections inherit the buffer sizes and TCP_NODELAY, so they
+		// are set once here rather than on every accept
+		if (TuneSocket(listenSocketFD, &config->tuning) < 0) ServerError(config, "could not set socket options");
+
+		if (bind(listenSocketFD, address->ai_addr, address->ai_addrlen) == 0) break; // Connect socket to port
+		close(listenSocketFD);
+		listenSocketFD = -1;
+	}
+	freeaddrinfo(addresses);
+
+	// Enable the socket to begin listening
+	if (listenSocketFD < 0) ServerError(config, "could not bind socket");
+	if (listen(listenSocketFD, config->backlog) < 0) // Flip the socket on - it can now queue up to backlog connections
+		ServerError(config, "could not listen on socket");
+
+	return listenSocketFD;
+}
+
+// Creates, binds and starts a listening Unix socket at path, replacing any
+// socket left there by an earlier run
+int OpenUnixListener(struct ServerConfig *config, const char *path, int backlog) {
+	struct sockaddr_un address;
+	int listenSocketFD;
+
+	memset(&address, '\0', sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) ServerError(config, "Unix socket path is too long");
+	strcpy(address.sun_path, path);
+
+	unlink(path);
+	listenSocketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenSocketFD < 0) ServerError(config, "could not open Unix socket");
+	if (bind(listenSocketFD, (struct sockaddr *)&address, sizeof(address)) < 0)
+		ServerError(config, "could not bind Unix socket");
+	if (listen(listenSocketFD, backlog) < 0) ServerError(config, "could not listen on Unix socket");
+	return listenSocketFD;
+}
+
+// Set by SIGUSR1 in a daemon that is not sharded
+static volatile sig_atomic_t reportRequested = 0;
+
+static void CatchReport(int signo) {
+	reportRequested = 1;
+}
+
+// Prints the admission counters and metrics if SIGUSR1 asked for them.
+// The engines call this from their event loops, which the signal
+// interrupts.
+void CheckReport(struct ServerConfig *config) {
+	if (!reportRequested) return;
+	reportRequested = 0;
+	fprintf(stderr, "%s:\n", config->name);
+	PrintAdmission(config, stderr);
+	WriteMetrics(config, stderr);
+}
+
+// Opens the listeners and hands them to the engine chosen on the command
+// line. A sharded daemon hands over to the shard supervisor instead, which
+// runs this again in each shard. The key store, admission counters and
+// metrics are set up first so that every shard shares them, and the
+// metrics and ring sockets are served from the process that stays up. A
+// Unix socket cannot be bound once per shard like a port, so it is opened
+// here too and every shard accepts from it.
+int RunServer(struct ServerConfig *config) {
+	struct sigaction reportAction = {0};
+	int i;
+
+	if (config->padPath != NULL && config->pad == NULL) OpenPad(config);
+	if (config->admission == NULL) OpenAdmission(config);
+	if (config->stats == NULL) {
+		OpenMetrics(config);
+		if (config->metricsPath != NULL) StartMetricsServer(config);
+		if (config->ringPath != NULL) StartRingServer(config);
+		if (config->unixPath != NULL) {
+			// Non-blocking, since shards share it and another may take a
+			// connection first
+			config->unixFD = OpenUnixListener(config, config->unixPath, config->backlog);
+			fcntl(config->unixFD, F_SETFL, fcntl(config->unixFD, F_GETFL) | O_NONBLOCK);
+		}
+	}
+	if (config->shards > 1 && config->stats == NULL) return RunShards(config);
+
+	for (i = 0; i < config->numPorts; i++) {
+		config->listenFDs[i] = OpenListener(config, config->ports[i]);
+	}
+	config->numListeners = config->numPorts;
+	if (config->unixFD >= 0) config->listenFDs[config->numListeners++] = config->unixFD;
+
+	// Writes to a client that hung up should fail, not kill the daemon
+	signal(SIGPIPE, SIG_IGN);
+
+	// A daemon that is not sharded reports its counters itself on SIGUSR1.
+	// Without SA_RESTART the signal interrupts the engine's wait.
+	if (config->stats == NULL) {
+		reportAction.sa_handler = CatchReport;
+		sigfillset(&reportAction.sa_mask);
+		sigaction(SIGUSR1, &reportAction, NULL);
+	}
+
+	if (config->engine == ENGINE_FORK) return RunForkEngine(config);
+	if (config->engine == ENGINE_PREFORK) return RunPreforkEngine(config);
+	if (config->engine == ENGINE_URING) return RunUringEngine(config);
+	return RunEpollEngine(config);
+}
+
+// Counts an accepted connection for the shard
+void CountAccept(struct ServerConfig *config) {
+	MetricCount(METRIC_ACCEPTS, 1);
+	if (config->stats != NULL) __atomic_fetch_add(&config->stats->accepts, 1, __ATOMIC_RELAXED);
+}
+
+// Returns 1 if the daemon is configured to serve the operation
+static int Serves(struct ServerConfig *config, char op) {
+	if (op == OP_ENCODE) return (config->serves & SERVE_ENCODE) != 0;
+	if (op == OP_DECODE) return (config->serves & SERVE_DECODE) != 0;
+	return 0;
+}
+
+// Starts the connection on a new wait of the given DEADLINE_ kind. Its
+// clock starts when the engine first checks its deadline, which is when
+// it is first left waiting on the client.
+static void ConnStartWait(struct Conn *conn, int kind) {
+	conn->deadlineKind = kind;
+	conn->waitStart = 0;
+	conn->waitBytes = conn->seenBytes = 0;
+}
+
+// Allocates the protocol state for a newly accepted connection
+struct Conn *NewConn(int fd) {
+	struct Conn *conn = calloc(1, sizeof(struct Conn));
+	if (conn == NULL) return NULL;
+	conn->fd = fd;
+	conn->state = CONN_HANDSHAKE;
+	conn->phaseMark = MetricsNow();
+	ConnStartWait(conn, DEADLINE_HANDSHAKE);
+	return conn;
+}
+
+// Counts the connection's close, gives back any room it holds under the
+// admission limits and closes its socket. The Conn and its buffers stay.
+void CloseConn(struct Conn *conn) {
+	// A connection closed before it finished was cut off by an error
+	MetricCount(METRIC_CLOSES, 1);
+	if (conn->timedOut) MetricError(ERROR_TIMEOUT);
+	else if (conn->state == CONN_FAILED) MetricError(ERROR_BAD_MESSAGE);
+	else if (conn->state != CONN_DONE) MetricError(ERROR_SOCKET);
+
+	TimerRemove(conn);
+	AdmitRelease(conn);
+	if (conn->fd >= 0) close(conn->fd);
+	conn->fd = -1;
+}
+
+// Closes the connection socket and releases its buffers and any room it
+// holds under the admission limits
+void FreeConn(struct Conn *conn) {
+	CloseConn(conn);
+	free(conn->text);
+	free(conn->key);
+	free(conn->in);
+	free(conn);
+}
+
+// Readies a closed Conn for a newly accepted connection. Its buffers are
+// kept, so a process that serves one connection after another does not
+// allocate them again for each.
+void ReuseConn(struct Conn *conn, int fd) {
+	char *text = conn->text, *key = conn->key, *in = conn->in;
+	size_t bufferSize = conn->bufferSize, inSize = conn->inSize;
+
+	memset(conn, '\0', sizeof(*conn));
+	conn->text = text;
+	conn->key = key;
+	conn->bufferSize = bufferSize;
+	conn->in = in;
+	conn->inSize = inSize;
+	conn->fd = fd;
+	conn->state = CONN_HANDSHAKE;
+	conn->phaseMark = MetricsNow();
+	ConnStartWait(conn, DEADLINE_HANDSHAKE);
+}
+
+// Returns the start of the field the connection is currently transferring,
+// its total size and the direction of the transfer
+static int ConnField(struct Conn *conn, char **base, size_t *size) {
+	switch (conn->state) {
+		case CONN_HANDSHAKE:
+			*base = conn->idBuffer;
+			*size = 3;
+			return IO_READ;
+		case CONN_VERIFY:
+			*base = conn->idBuffer;
+			*size = 2;
+			return IO_WRITE;
+		case CONN_LENGTH:
+			*base = (char *)&conn->fileSize;
+			*size = sizeof(conn->fileSize);
+			return IO_READ;
+		case CONN_FRAME:
+			*base = (char *)conn->header;
+			*size = FRAME_HEADER_SIZE;
+			return IO_READ;
+		case CONN_TEXT:
+			// Packed chunks land at the end of their buffer and are
+			// unpacked in place
+			*size = conn->packed ? PACKED_SIZE(conn->length) : conn->length;
+			*base = conn->text + conn->length - *size;
+			return IO_READ;
+		case CONN_OFFSET:
+			*base = (char *)conn->padField;
+			*size = PAD_OFFSET_SIZE;
+			return IO_READ;
+		case CONN_KEY:
+			*size = conn->packed ? PACKED_SIZE(conn->length) : conn->length;
+			*base = conn->key + REPLY_ROOM + conn->length - *size;
+			return IO_READ;
+		case CONN_REPLY:
+			// Framed replies go out with their frame header (and pad offset)
+			// in front
+			*base = conn->key + REPLY_ROOM;
+			*size = conn->packed ? PACKED_SIZE(conn->length) : conn->length;
+			if (conn->framed) {
+				*base -= (conn->frame.flags & FRAME_PAD) ? REPLY_ROOM : FRAME_HEADER_SIZE;
+				*size += (conn->frame.flags & FRAME_PAD) ? REPLY_ROOM : FRAME_HEADER_SIZE;
+			}
+			return IO_WRITE;
+	}
+	*base = NULL;
+	*size = 0;
+	return IO_NONE;
+}
+
+// Reports where the next transfer for a connection should go. Sets buf and
+// len to the unfinished part of the current field and returns IO_READ or
+// IO_WRITE, or IO_NONE if the connection is not waiting on the socket.
+int ConnWant(struct Conn *conn, char **buf, size_t *len) {
+	char *base;
+	size_t size;
+	int dir = ConnField(conn, &base, &size);
+
+	*buf = base + conn->done;
+	*len = size - conn->done;
+	return dir;
+}
+
+// Returns the DEADLINE_ kind a connection in the given state is held to.
+// The wait for a message starts idle on a framed connection and becomes a
+// receive once the first byte of the frame arrives (see ConnAdvance).
+static int DeadlineFor(int state) {
+	switch (state) {
+		case CONN_HANDSHAKE:
+		case CONN_VERIFY:
+			return DEADLINE_HANDSHAKE;
+		case CONN_LENGTH:
+		case CONN_OFFSET:
+		case CONN_TEXT:
+		case CONN_KEY:
+			return DEADLINE_RECEIVE;
+		case CONN_FRAME:
+			return DEADLINE_IDLE;
+		case CONN_REPLY:
+			return DEADLINE_REPLY;
+	}
+	return DEADLINE_NONE;
+}
+
+// Moves a connection to a new state and resets the transfer count. A
+// message that has fully arrived ends the receive phase. A state that waits
+// on the client for a different reason starts a new wait; one that carries
+// on the same wait (text after length, say) keeps its deadline.
+static void ConnSetState(struct Conn *conn, int state) {
+	int kind = DeadlineFor(state);
+
+	if (state == CONN_CIPHER) MetricPhase(conn, PHASE_RECEIVE);
+	conn->state = state;
+	conn->done = 0;
+	if (kind != conn->deadlineKind) ConnStartWait(conn, kind);
+}
+
+// Returns when the connection's current wait runs out (monotonic ms), or
+// -1 if it has no deadline. A wait gets its base time, plus the time the
+// bytes moved so far would take at the minimum rate, but never more than
+// its base time since bytes last moved. The engines check the deadline
+// whenever they leave a connection waiting, so the clock is read then (as
+// now) rather than for every transfer: the first check starts the wait,
+// and a check that finds more bytes moved marks them as moving now.
+long long ConnDeadline(struct ServerConfig *config, struct Conn *conn, long long now) {
+	long long base, deadline, stalled;
+
+	if (conn->deadlineKind == DEADLINE_NONE) return -1;
+	base = config->deadlines[conn->deadlineKind];
+	if (base == 0) return -1;
+
+	if (conn->waitStart == 0) conn->waitStart = conn->lastMoved = now;
+	else if (conn->waitBytes != conn->seenBytes) conn->lastMoved = now;
+	conn->seenBytes = conn->waitBytes;
+
+	deadline = conn->waitStart + base;
+	if (config->minRate > 0) deadline += (long long)(conn->waitBytes * 1000ULL / config->minRate);
+	stalled = conn->lastMoved + base;
+	return deadline < stalled ? deadline : stalled;
+}
+
+// Corks the connection's socket before a reply goes out, when the daemon
+// batches replies (-o cork), and uncorks it before the daemon stops to
+// wait, so pipelined replies share segments and none is held back for
+// long. Only TCP sockets can be corked; on others this does nothing.
+void ConnCork(struct ServerConfig *config, struct Conn *conn, int on) {
+	if (!config->tuning.cork || conn->corked == on) return;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+	conn->corked = on;
+}
+
+// Fails a connection that has missed its deadline. It is counted as a
+// timeout when closed.
+void ConnTimeout(struct Conn *conn) {
+	conn->timedOut = 1;
+	ConnSetState(conn, CONN_FAILED);
+}
+
+// Allocates the text and key buffers for messages of up to size chars,
+// unless the ones the connection kept from before are big enough. The key
+// buffer has room in front for a frame header and pad offset so that a
+// reply can go out in one piece.
+static int ConnAllocBuffers(struct Conn *conn, size_t size) {
+	if (conn->text != NULL && conn->key != NULL && conn->bufferSize >= size) return 0;
+	free(conn->text);
+	free(conn->key);
+	conn->text = malloc(size > 0 ? size : 1);
+	conn->key = malloc(REPLY_ROOM + size);
+	conn->bufferSize = size;
+	return (conn->text != NULL && conn->key != NULL) ? 0 : -1;
+}
+
+// Answers a bad frame with a header-only reply carrying the status, then
+// hangs up
+static void ConnRejectFrame(struct Conn *conn, int status) {
+	struct FrameHeader reply;
+
+	MetricError(ERROR_STATUS + status);
+	conn->frame.flags &= ~FRAME_PAD;
+	reply = conn->frame;
+	reply.status = status;
+	reply.length = 0;
+	PackFrameHeader((unsigned char *)conn->key + PAD_OFFSET_SIZE, &reply);
+	conn->length = 0;
+	conn->closing = 1;
+	ConnSetState(conn, CONN_REPLY);
+}
+
+// Works out the pad chars a pad frame is ciphered with. A decode frame
+// names them, and they must have been handed out. The first frame of a
+// message being encoded reserves pad for the whole message, and each of
+// its frames takes the next chars of that reservation. Returns a STATUS_
+// code.
+static int ConnPadFrame(struct ServerConfig *config, struct Conn *conn) {
+	uint64_t field = UnpackPadOffset(conn->padField);
+	int status;
+
+	if (conn->op == OP_DECODE) {
+		conn->padOffset = field;
+		return PadCheckIssued(config->pad, field, conn->length);
+	}
+
+	// The reservation asked for is the client's word, so hold it to the
+	// longest message the daemon allows, and at most the whole pad
+	if (!conn->padOpen) {
+		if (field > PadSize(config->pad) || (config->maxSize > 0 && field > config->maxSize)) return STATUS_TOO_LARGE;
+		if (field < conn->length) field = conn->length;
+		status = PadReserve(config->pad, field, &conn->padNext);
+		if (status != STATUS_OK) return status;
+		conn->padLeft = field;
+		conn->padOpen = 1;
+	}
+	if (conn->length > conn->padLeft) return STATUS_BAD_PAD;
+
+	conn->padOffset = conn->padNext;
+	conn->padNext += conn->length;
+	conn->padLeft -= conn->length;
+	if (conn->frame.flags & FRAME_LAST) conn->padOpen = 0;
+	return STATUS_OK;
+}
+
+// Moves an admitted request on to reading its text. Original protocol
+// requests get their buffers now that they may have them.
+static void ConnStartRequest(struct Conn *conn) {
+	if (!conn->framed) {
+		if (ConnAllocBuffers(conn, conn->length) < 0) ConnSetState(conn, CONN_FAILED);
+		else ConnSetState(conn, conn->length > 0 ? CONN_TEXT : CONN_CIPHER);
+		return;
+	}
+
+	// Count the frame towards its message's size limit
+	conn->messageChars += conn->length;
+	if (conn->frame.flags & FRAME_LAST) conn->messageChars = 0;
+	if (conn->frame.flags & FRAME_PAD) ConnSetState(conn, CONN_OFFSET);
+	else ConnSetState(conn, conn->length > 0 ? CONN_TEXT : CONN_CIPHER);
+}
+
+// Acts on an admission result: starts the request, leaves it waiting, or
+// turns it away. Framed clients are told why; the original protocol has no
+// way to say, so those clients are hung up on.
+static void ConnAdmit(struct Conn *conn, int status) {
+	if (status == STATUS_OK) ConnStartRequest(conn);
+	else if (status == ADMIT_WAIT) ConnSetState(conn, CONN_ADMIT);
+	else if (conn->framed) ConnRejectFrame(conn, status);
+	else {
+		MetricError(ERROR_STATUS + status);
+		ConnSetState(conn, CONN_DONE);
+	}
+}
+
+// Tries again to admit a waiting request, for engines that keep waiting
+// connections to one side. Returns 1 if the connection has stopped
+// waiting, either admitted or turned away.
+int ConnRetryAdmit(struct ServerConfig *config, struct Conn *conn) {
+	int status;
+
+	if (conn->state != CONN_ADMIT) return 1;
+	status = AdmitRetry(config, conn);
+	if (status == ADMIT_WAIT) return 0;
+	ConnAdmit(conn, status);
+	return 1;
+}
+
+// Records that n bytes of the current field were transferred and moves the
+// connection on to the next state once the field is complete
+void ConnAdvance(struct ServerConfig *config, struct Conn *conn, size_t n) {
+	char *base;
+	size_t size;
+	int dir, status;
+
+	dir = ConnField(conn, &base, &size);
+	if (dir == IO_NONE) return;
+	MetricCount(dir == IO_READ ? METRIC_BYTES_IN : METRIC_BYTES_OUT, n);
+
+	// The first byte of a frame ends the idle wait between messages
+	if (conn->deadlineKind == DEADLINE_IDLE && n > 0) ConnStartWait(conn, DEADLINE_RECEIVE);
+	conn->waitBytes += n;
+	conn->done += n;
+	if (conn->done < size) return;
+
+	switch (conn->state) {
+		case CONN_HANDSHAKE:
+			// Work out the operation and protocol the client asks for, and
+			// verify that this daemon serves it
+			conn->idBuffer[3] = '\0';
+			if (strcmp(conn->idBuffer, ID_ENCODE) == 0 || strcmp(conn->idBuffer, ID_ENCODE_STREAM) == 0 ||
+					strcmp(conn->idBuffer, ID_ENCODE_PACKED) == 0) conn->op = OP_ENCODE;
+			else if (strcmp(conn->idBuffer, ID_DECODE) == 0 || strcmp(conn->idBuffer, ID_DECODE_STREAM) == 0 ||
+					strcmp(conn->idBuffer, ID_DECODE_PACKED) == 0) conn->op = OP_DECODE;
+			conn->packed = (strcmp(conn->idBuffer, ID_ENCODE_PACKED) == 0 || strcmp(conn->idBuffer, ID_DECODE_PACKED) == 0);
+			conn->framed = conn->packed || strcmp(conn->idBuffer, ID_ENCODE_STREAM) == 0 ||
+				strcmp(conn->idBuffer, ID_DECODE_STREAM) == 0;
+			conn->accepted = Serves(config, conn->op);
+			strcpy(conn->idBuffer, conn->accepted ? "OK" : "NO");
+			if (!conn->accepted) MetricError(ERROR_REFUSED);
+			else if (!conn->framed && AdmitHandshake(config)) {
+				MetricError(ERROR_STATUS + STATUS_BUSY);
+				strcpy(conn->idBuffer, ID_BUSY);
+				conn->accepted = 0;
+			}
+			ConnSetState(conn, CONN_VERIFY);
+			break;
+		case CONN_VERIFY:
+			// A rejected client gets its NO (or BZ) and is then hung up on. Framed
+			// clients get fixed-size chunk buffers for the whole connection.
+			MetricPhase(conn, PHASE_HANDSHAKE);
+			if (!conn->accepted) ConnSetState(conn, CONN_DONE);
+			else if (!conn->framed) ConnSetState(conn, CONN_LENGTH);
+			else if (ConnAllocBuffers(conn, STREAM_CHUNK_SIZE) < 0) ConnSetState(conn, CONN_FAILED);
+			else ConnSetState(conn, CONN_FRAME);
+			break;
+		case CONN_LENGTH:
+			// Admit the request before creating buffers for its text and key
+			if (conn->fileSize < 1) {
+				ConnSetState(conn, CONN_FAILED);
+				break;
+			}
+			conn->length = conn->fileSize - 1;
+			ConnAdmit(conn, AdmitRequest(config, conn, conn->length));
+			break;
+		case CONN_FRAME:
+			// Check the frame before reading its chunk. Each frame names its
+			// own operation, so one connection may mix encoding and decoding.
+			UnpackFrameHeader(conn->header, &conn->frame);
+			conn->op = conn->frame.op;
+			if (!Serves(config, conn->op)) ConnRejectFrame(conn, STATUS_WRONG_OP);
+			else if (conn->frame.length > STREAM_CHUNK_SIZE) ConnRejectFrame(conn, STATUS_TOO_LARGE);
+			else if ((conn->frame.flags & FRAME_PAD) && config->pad == NULL) ConnRejectFrame(conn, STATUS_NO_PAD);
+			else {
+				conn->length = conn->frame.length;
+				ConnAdmit(conn, AdmitRequest(config, conn, conn->messageChars + conn->length));
+			}
+			break;
+		case CONN_OFFSET:
+			// Pad frames take their key from the key store, not the client
+			status = ConnPadFrame(config, conn);
+			if (status != STATUS_OK) ConnRejectFrame(conn, status);
+			else ConnSetState(conn, conn->length > 0 ? CONN_TEXT : CONN_CIPHER);
+			break;
+		case CONN_TEXT:
+			if (conn->packed && !UnpackText(conn->text, (unsigned char *)base, conn->length)) ConnRejectFrame(conn, STATUS_BAD_TEXT);
+			else ConnSetState(conn, (conn->frame.flags & FRAME_PAD) && conn->framed ? CONN_CIPHER : CONN_KEY);
+			break;
+		case CONN_KEY:
+			if (conn->packed && !UnpackText(conn->key + REPLY_ROOM, (unsigned char *)base, conn->length)) ConnRejectFrame(conn, STATUS_BAD_TEXT);
+			else ConnSetState(conn, CONN_CIPHER);
+			break;
+		case CONN_REPLY:
+			// The request is answered, so its room goes to the next one.
+			// Framed connections go back for the next frame.
+			if (!conn->closing) MetricPhase(conn, PHASE_REPLY);
+			AdmitRelease(conn);
+			if (conn->framed && !conn->closing) ConnSetState(conn, CONN_FRAME);
+			else ConnSetState(conn, CONN_DONE);
+			break;
+	}
+}
+
+// Handles the client closing its side of the connection. Between frames
+// that is how a framed client says it is finished; anywhere else the
+// request was cut short.
+void ConnEOF(struct Conn *conn) {
+	if (conn->state == CONN_FRAME && conn->done == 0) ConnSetState(conn, CONN_DONE);
+	else ConnSetState(conn, CONN_FAILED);
+}
+
+// Copies received bytes into the fields the state machine is reading.
+// Returns how many were used; it stops early once the connection wants to
+// do something other than read.
+size_t ConnFeed(struct ServerConfig *config, struct Conn *conn, const char *data, size_t n) {
+	char *buf;
+	size_t len, used = 0;
+
+	while (used < n && ConnWant(conn, &buf, &len) == IO_READ) {
+		if (len > n - used) len = n - used;
+		memcpy(buf, data + used, len);
+		used += len;
+		ConnAdvance(config, conn, len);
+	}
+	return used;
+}
+
+// Feeds the connection from its read buffer. Returns 1 if any buffered
+// bytes were used.
+int ConnBuffered(struct ServerConfig *config, struct Conn *conn) {
+	size_t used;
+
+	if (conn->inEnd == conn->inStart) return 0;
+	used = ConnFeed(config, conn, conn->in + conn->inStart, conn->inEnd - conn->inStart);
+	conn->inStart += used;
+	if (conn->inStart == conn->inEnd) conn->inStart = conn->inEnd = 0;
+	return used > 0;
+}
+
+// Appends bytes to the read buffer for later, growing it if needed.
+// Returns -1 if out of memory.
+int ConnSaveInput(struct Conn *conn, const char *data, size_t n) {
+	char *grown;
+	size_t needed;
+
+	if (n == 0) return 0;
+
+	// Drop what has been consumed, then grow if still short of room
+	if (conn->inStart > 0) {
+		memmove(conn->in, conn->in + conn->inStart, conn->inEnd - conn->inStart);
+		conn->inEnd -= conn->inStart;
+		conn->inStart = 0;
+	}
+	needed = conn->inEnd + n;
+	if (needed > conn->inSize) {
+		if (needed < CONN_READ_BUFFER) needed = CONN_READ_BUFFER;
+		grown = realloc(conn->in, needed);
+		if (grown == NULL) return -1;
+		conn->in = grown;
+		conn->inSize = needed;
+	}
+	memcpy(conn->in + conn->inEnd, data, n);
+	conn->inEnd += n;
+	return 0;
+}
+
+// Reads for a connection that wants to read. Bytes already buffered are
+// used first. Otherwise a field of at least CONN_READ_BUFFER chars is read
+// in place, and anything smaller through the read buffer with one large
+// recv that may also take in the fields after it. Returns a positive count
+// on progress, 0 when the client has closed its side, or -1 like recv.
+ssize_t ConnRecv(struct ServerConfig *config, struct Conn *conn) {
+	char *buf;
+	size_t len;
+	ssize_t tempChars;
+
+	if (ConnBuffered(config, conn)) return 1;
+
+	ConnWant(conn, &buf, &len);
+	if (len >= CONN_READ_BUFFER) {
+		tempChars = recv(conn->fd, buf, len, 0);
+		if (tempChars > 0) ConnAdvance(config, conn, tempChars);
+		return tempChars;
+	}
+
+	if (conn->in == NULL) {
+		conn->in = malloc(CONN_READ_BUFFER);
+		if (conn->in == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		conn->inSize = CONN_READ_BUFFER;
+	}
+	tempChars = recv(conn->fd, conn->in, conn->inSize, 0);
+	if (tempChars > 0) {
+		conn->inEnd = tempChars;
+		ConnBuffered(config, conn);
+	}
+	return tempChars;
+}
+
+// Runs the encode or decode step over a fully received message and
+// readies the result to be written back to the client
+void CipherConn(struct ServerConfig *config, struct Conn *conn) {
+	struct FrameHeader reply;
+	char *keyText = conn->key + REPLY_ROOM, *replyStart = keyText - FRAME_HEADER_SIZE;
+	const char *key = keyText;
+	int pad = conn->framed && (conn->frame.flags & FRAME_PAD);
+
+	// Pad frames are ciphered straight from the key store, and their reply
+	// says which pad chars were used
+	if (pad) {
+		key = PadChars(config->pad, conn->padOffset);
+		PackPadOffset((unsigned char *)keyText - PAD_OFFSET_SIZE, conn->padOffset);
+		replyStart = conn->key;
+	}
+
+	if (conn->op == OP_ENCODE) EncodeText(keyText, conn->text, key, conn->length);
+	else DecodeText(keyText, conn->text, key, conn->length);
+	if (conn->packed) PackText((unsigned char *)keyText, keyText, conn->length);
+	MetricPhase(conn, PHASE_CIPHER);
+	MetricCount(conn->op == OP_ENCODE ? METRIC_ENCODES : METRIC_DECODES, 1);
+	MetricCount(METRIC_CHARS, conn->length);
+	if (config->stats != NULL) {
+		__atomic_fetch_add(&config->stats->requests, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&config->stats->chars, conn->length, __ATOMIC_RELAXED);
+	}
+
+	// Every frame is answered, even an empty one
+	if (conn->framed) {
+		reply = conn->frame;
+		reply.status = STATUS_OK;
+		PackFrameHeader((unsigned char *)replyStart, &reply);
+		ConnSetState(conn, CONN_REPLY);
+	}
+	else ConnSetState(conn, conn->length > 0 ? CONN_REPLY : CONN_DONE);
+}
+
+// Reaps finished children so they do not pile up as zombies
+static void CatchSIGCHLD(int signo) {
+	int savedErrno = errno;
+	while (waitpid(-1, NULL, WNOHANG) > 0);
+	errno = savedErrno;
+}
+
+// Waits for a connection's socket to be ready in the given direction, for
+// no longer than its deadline allows. Returns 1 when ready, 0 if the
+// deadline passed first, or -1 like poll.
+static int WaitConn(struct ServerConfig *config, struct Conn *conn, int dir) {
+	struct pollfd pfd;
+	long long now = NowMs(), deadline = ConnDeadline(config, conn, now), timeout = -1;
+	int ready;
+
+	if (deadline >= 0) {
+		timeout = deadline - now;
+		if (timeout < 0) timeout = 0;
+	}
+	pfd.fd = conn->fd;
+	pfd.events = dir == IO_READ ? POLLIN : POLLOUT;
+	ready = poll(&pfd, 1, (int)timeout);
+	if (ready == 0 && deadline >= 0 && NowMs() < deadline) return 1; // Woke a little early; check again
+	return ready;
+}
+
+// Serves one connection to completion, waiting on its socket in poll
+// between transfers so that the client is held to its deadlines. Used by
+// the child processes of the fork engine and the prefork workers, whose
+// connections are accepted non-blocking. Returns NULL, or what went wrong
+// if the connection was cut short.
+const char *ServeBlocking(struct ServerConfig *config, struct Conn *conn) {
+	const char *failure = NULL;
+	char *buf;
+	size_t len;
+	ssize_t tempChars;
+	int dir, ready;
+
+	while (conn->state != CONN_DONE && conn->state != CONN_FAILED) {
+		if (conn->state == CONN_CIPHER) {
+			CipherConn(config, conn);
+			continue;
+		}
+		if (conn->state == CONN_ADMIT) {
+			ConnCork(config, conn, 0);
+			ConnAdmit(conn, AdmitWait(config, conn));
+			continue;
+		}
+		dir = ConnWant(conn, &buf, &len);
+		if (dir == IO_READ) tempChars = ConnRecv(config, conn);
+		else {
+			ConnCork(config, conn, 1);
+			tempChars = send(conn->fd, buf, len, 0);
+		}
+
+		if (tempChars < 0 && errno == EINTR) continue;
+		if (tempChars < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// Nothing to move yet, so wait for the client until its deadline
+			if (dir == IO_READ) ConnCork(config, conn, 0);
+			ready = WaitConn(config, conn, dir);
+			if (ready < 0 && errno != EINTR) {
+				failure = "had issue waiting on socket";
+				break;
+			}
+			if (ready == 0) {
+				ConnTimeout(conn);
+				failure = "timed out waiting on client";
+				break;
+			}
+			continue;
+		}
+		if (tempChars < 0) {
+			failure = dir == IO_READ ? "had issue reading from socket" : "had issue writing to socket";
+			break;
+		}
+		if (dir == IO_READ && tempChars == 0) ConnEOF(conn);
+		else if (dir == IO_WRITE) ConnAdvance(config, conn, tempChars);
+	}
+	if (failure == NULL && conn->state == CONN_FAILED) failure = "received a bad or incomplete message";
+	return failure;
+}
+
+// Accepts the next connection on any of the daemon's listeners, blocking
+// until one arrives. The connection is non-blocking, for ServeBlocking to
+// wait on. Returns the connection, or -1 on error.
+int AcceptNext(struct ServerConfig *config) {
+	struct pollfd pfds[MAX_LISTENERS];
+	socklen_t sizeOfClientInfo;
+	struct sockaddr_storage clientAddress;
+	int i;
+
+	// With one listener, block in accept directly
+	sizeOfClientInfo = sizeof(clientAddress); // Get the size of the address for the client that will connect
+	if (config->numListeners == 1)
+		return accept4(config->listenFDs[0], (struct sockaddr *)&clientAddress, &sizeOfClientInfo, SOCK_NONBLOCK);
+
+	// Otherwise wait for any listener to have a connection waiting
+	for (i = 0; i < config->numListeners; i++) {
+		pfds[i].fd = config->listenFDs[i];
+		pfds[i].events = POLLIN;
+	}
+	if (poll(pfds, config->numListeners, -1) < 0) return -1;
+	for (i = 0; i < config->numListeners; i++) {
+		if (pfds[i].revents & POLLIN)
+			return accept4(config->listenFDs[i], (struct sockaddr *)&clientAddress, &sizeOfClientInfo, SOCK_NONBLOCK);
+	}
+	errno = EINTR;
+	return -1;
+}
+
+// The original engine: accept a connection and fork a child to serve it
+int RunForkEngine(struct ServerConfig *config) {
+	int i, establishedConnectionFD;
+	struct sigaction SIGCHLD_action = {0};
+	struct Conn *conn;
+	const char *failure;
+	pid_t spawnpid = -5;
+
+	// Reap children as they finish
+	SIGCHLD_action.sa_handler = CatchSIGCHLD;
+	SIGCHLD_action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigfillset(&SIGCHLD_action.sa_mask);
+	sigaction(SIGCHLD, &SIGCHLD_action, NULL);
+
+	// Keep the daemon running
+	while (1) {
+		// Accept a connection, blocking if one is not available until one connects
+		establishedConnectionFD = AcceptNext(config);
+		if (establishedConnectionFD < 0) {
+			CheckReport(config);
+			if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) continue;
+			ServerError(config, "could not accept connection");
+		}
+		CountAccept(config);
+
+		// Spawn child process to perform the cipher
+		spawnpid = fork();
+		switch (spawnpid) {
+			case -1:
+				// Error with fork
+				ServerError(config, "had issue forking");
+				break;
+			case 0:
+				// In child process: serve the connection, then exit
+				for (i = 0; i < config->numListeners; i++) close(config->listenFDs[i]);
+				if (config->metricsFD >= 0) close(config->metricsFD);
+				if (config->ringFD >= 0) close(config->ringFD);
+				MetricsForked();
+				conn = NewConn(establishedConnectionFD);
+				if (conn == NULL) ServerError(config, "could not allocate connection");
+				failure = ServeBlocking(config, conn);
+				FreeConn(conn); // Close the existing socket which is connected to the client
+
+				// The child exits with an error once its room is given back
+				// (and the error counted)
+				if (failure != NULL) ServerError(config, failure);
+				exit(0);
+			default:
+				// In parent: the child owns the connection now
+				close(establishedConnectionFD);
+				break;
+		}
+	}
+	return 0;
+}
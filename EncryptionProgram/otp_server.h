@@ -0,0 +1,328 @@
+/*
+File: otp_server.h
+Author: Adeline Harcourt
+Description: Declarations for the server core shared by otp_enc_d,
+		otp_dec_d and the combined otp_d. The core owns the listening
+		sockets, the per-connection protocol state machine (handshake,
+		length or frame header, text, key, reply) and the engines that
+		drive it: the original fork-per-connection loop, a pool of
+		pre-forked worker processes, a non-blocking epoll reactor backed
+		by a worker thread pool and an io_uring ring.
+		Any engine can also run sharded, one process per core, and any
+		can serve pad frames from a key store (otp_pad.c). All of them
+		admit requests through the limits in otp_admit.c, count into
+		the metrics in otp_metrics.c and hold clients to the deadlines
+		below, the event driven ones through the timer wheel in
+		otp_timer.c. Its TCP ports are bound on every IPv4 address or
+		on one chosen address (-a), with the socket options from
+		otp_net.c (-o). Besides them a daemon can listen on a Unix
+		socket, and serve local clients through shared memory rings
+		(otp_ring.c).
+*/
+#ifndef OTP_SERVER_H
+#define OTP_SERVER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "otp_proto.h"
+#include "otp_net.h"
+
+// Server engines, selected with -e on the daemon command line
+#define ENGINE_FORK  0		// One child process per accepted connection
+#define ENGINE_EPOLL 1		// epoll reactor with a pool of cipher worker threads
+#define ENGINE_URING 2		// io_uring ring with multishot accept and receive
+#define ENGINE_PREFORK 3	// Pool of long-lived processes that each accept and serve
+
+// Direction of the next transfer a connection is waiting on
+#define IO_NONE  0
+#define IO_READ  1
+#define IO_WRITE 2
+
+// Connection states, in the order a request moves through them
+#define CONN_HANDSHAKE 0	// Reading the 3 char client identifier
+#define CONN_VERIFY    1	// Writing OK or NO back to the client
+#define CONN_LENGTH    2	// Reading the message size (original protocol)
+#define CONN_FRAME     3	// Reading a frame header (framed protocol)
+#define CONN_TEXT      4	// Reading plain text (or cipher text)
+#define CONN_KEY       5	// Reading key text
+#define CONN_CIPHER    6	// Waiting on the encode/decode step
+#define CONN_REPLY     7	// Writing the result back to the client
+#define CONN_DONE      8	// Request finished, connection can be closed
+#define CONN_FAILED    9	// Protocol or socket error, connection is dropped
+#define CONN_OFFSET   10	// Reading the pad offset of a pad frame
+#define CONN_ADMIT    11	// Waiting for the admission limits to allow the request
+
+// AdmitRequest and AdmitRetry result when the request should keep waiting
+#define ADMIT_WAIT -1
+
+// How often engines with waiting requests check them (for room freed by
+// other processes, and for waits that have run out)
+#define ADMIT_TICK_MS 10
+
+// Phases of a request, each with a latency histogram in otp_metrics.c
+#define PHASE_HANDSHAKE 0	// Accept to handshake answered
+#define PHASE_RECEIVE   1	// Handshake (or last reply) to message received, including admission
+#define PHASE_CIPHER    2	// Message received to cipher done, including any worker queue
+#define PHASE_REPLY     3	// Cipher done to reply flushed
+#define PHASE_COUNT     4
+
+// Counters kept in otp_metrics.c
+#define METRIC_ACCEPTS   0	// Connections accepted
+#define METRIC_CLOSES    1	// Connections closed
+#define METRIC_ENCODES   2	// Messages (or frames) encoded
+#define METRIC_DECODES   3	// Messages (or frames) decoded
+#define METRIC_CHARS     4	// Chars ciphered
+#define METRIC_BYTES_IN  5	// Bytes read from clients
+#define METRIC_BYTES_OUT 6	// Bytes written to clients
+#define METRIC_COUNT     7
+
+// Error kinds counted in otp_metrics.c. A request turned away with a
+// STATUS_ code counts as ERROR_STATUS + status.
+#define ERROR_REFUSED     0	// Handshake answered NO
+#define ERROR_BAD_MESSAGE 1	// Bad or cut short message
+#define ERROR_SOCKET      2	// Dropped on a socket error
+#define ERROR_TIMEOUT     3	// Dropped for missing a deadline
+#define ERROR_STATUS      4
+#define ERROR_COUNT       (ERROR_STATUS + STATUS_BAD_TEXT + 1)
+
+// Deadlines a connection is held to, one per kind of wait on the client.
+// Each allows its base time (-t) from when the wait began; past that the
+// client must have kept up an average of the minimum rate (-r) over the
+// wait, and no wait may go its base time without a byte moving, so a
+// client trickling bytes (slowloris) or stalling part way is dropped.
+#define DEADLINE_NONE      -1	// Waiting on the daemon (cipher, admission)
+#define DEADLINE_HANDSHAKE  0	// Accept to handshake answered
+#define DEADLINE_RECEIVE    1	// First byte of a message (or frame) to all of it
+#define DEADLINE_REPLY      2	// Reply written back
+#define DEADLINE_IDLE       3	// Framed connection between messages
+#define DEADLINE_COUNT      4
+
+// Base times for each deadline (milliseconds) and the minimum rate
+// (bytes per second) unless -t and -r say otherwise
+#define DEFAULT_HANDSHAKE_MS 5000
+#define DEFAULT_RECEIVE_MS   30000
+#define DEFAULT_REPLY_MS     30000
+#define DEFAULT_IDLE_MS      120000
+#define DEFAULT_MIN_RATE     16384
+
+// Timer wheel: deadlines are kept to the nearest tick, and one turn of the
+// wheel covers TIMER_SLOTS ticks (later deadlines go round again)
+#define TIMER_TICK_MS 100
+#define TIMER_SLOTS   1024
+
+// Operations a daemon can be configured to serve
+#define SERVE_ENCODE 1
+#define SERVE_DECODE 2
+
+#define MAX_PORTS 16
+
+// Listening sockets: the TCP ports and the Unix socket
+#define MAX_LISTENERS (MAX_PORTS + 1)
+
+// Listen backlog unless -b says otherwise (the kernel caps it at somaxconn)
+#define DEFAULT_BACKLOG 1024
+
+// Messages at or below this many chars are ciphered on the reactor thread,
+// since handing them to a worker costs more than the cipher itself
+#define INLINE_CIPHER_LIMIT 16384
+
+// Size of each connection's read buffer. Small fields (the identifier,
+// lengths, frame headers, short messages) are read through it so that one
+// recv can fill several; fields at least this long are read in place.
+#define CONN_READ_BUFFER 65536
+
+// Room kept in front of the key text for a reply's frame header and pad
+// offset, so the reply goes out in one piece
+#define REPLY_ROOM (FRAME_HEADER_SIZE + PAD_OFFSET_SIZE)
+
+// Prefork engine defaults: worker processes, and connections each one
+// serves before it is replaced
+#define PREFORK_DEFAULT_POOL    16
+#define PREFORK_DEFAULT_RECYCLE 10000
+
+// Most pad chars reserved (and saved to the cursor file) at a time
+#define PAD_RESERVE_AHEAD (64 << 20)
+
+// Counters for one shard, kept in memory shared with the supervising
+// process and updated with atomic adds
+struct ShardStats {
+	pid_t pid;					// Shard process
+	int cpu;					// CPU the shard is pinned to
+	unsigned long accepts;		// Connections accepted
+	unsigned long requests;		// Messages ciphered (each frame counts)
+	unsigned long chars;		// Chars ciphered
+};
+
+// Admission state and counters, kept in memory shared by every process of
+// the daemon and updated with atomic adds
+struct Admission {
+	int active;					// Requests admitted and not yet answered
+	int queued;					// Requests waiting for room
+	unsigned long bytes;		// Text and key bytes held by admitted requests
+	uint32_t wakeups;			// Futex word, bumped when room is freed
+	int sleepers;				// Forked children waiting on the futex
+	unsigned long admitted;		// Requests admitted
+	unsigned long waited;		// Requests that had to wait
+	unsigned long timedOut;		// Waiting requests turned away when time ran out
+	unsigned long rejectedBusy;	// Requests turned away at once (no queue)
+	unsigned long rejectedSize;	// Messages over the size limit
+};
+
+// Settings for one daemon, filled in by InitServerConfig and ParseServerArgs
+struct ServerConfig {
+	const char *name;	// Program name used in error messages
+	int serves;			// SERVE_ENCODE and/or SERVE_DECODE
+	int ports[MAX_PORTS];		// Ports to listen on
+	const char *bindHost;		// Address (or host name) the ports are bound on (-a), or NULL for any
+	struct NetTuning tuning;	// TCP options for the ports and their connections (-o)
+	int listenFDs[MAX_LISTENERS];	// Listening socket for each port, then the Unix socket
+	int numPorts;
+	int numListeners;			// Ports plus the Unix socket if there is one
+	const char *unixPath;		// Unix socket served like the ports (-U), or NULL
+	int unixFD;					// Its listening socket, or -1
+	const char *ringPath;		// Unix socket for shared memory ring sessions (-R), or NULL
+	int ringFD;					// Its listening socket, or -1
+	int engine;			// One of the ENGINE_ values
+	int workers;		// Cipher worker threads for the epoll engine
+	int poolSize;		// Worker processes for the prefork engine (-p)
+	int recycleAfter;	// Connections a prefork worker serves before it is replaced (-n, 0 = never)
+	int shards;			// Processes with their own SO_REUSEPORT listeners (1 = no sharding)
+	int backlog;		// Listen backlog for each listener
+	struct ShardStats *stats;	// This shard's counters, or NULL if not sharded
+	const char *padPath;		// Key store pad file (-k), or NULL
+	struct Pad *pad;			// The opened key store
+	int maxRequests;			// Concurrent requests allowed (-c, 0 = no limit)
+	unsigned long maxBytes;		// Text and key bytes held at once (-i, 0 = no limit)
+	unsigned long maxSize;		// Chars in one message (-m, 0 = no limit)
+	unsigned long legacyMax;	// Chars in one original protocol message (-m, else LEGACY_MAX_CHARS)
+	int queueTimeout;			// Milliseconds a request may wait for room (-q)
+	struct Admission *admission;	// Shared admission counters
+	const char *metricsPath;	// Unix socket serving metrics (-M), or NULL
+	int metricsFD;				// Its listening socket, or -1
+	int deadlines[DEADLINE_COUNT];	// Base time for each deadline in ms (-t, 0 = none)
+	unsigned long minRate;		// Slowest average transfer allowed past a base time (-r, 0 = any)
+};
+
+// Connections with deadlines, hashed by the tick their deadline falls in.
+// Owned by one engine thread.
+struct TimerWheel {
+	struct Conn *slots[TIMER_SLOTS];	// Lists linked through timerNext/timerPrev
+	long long tick;				// Next tick to expire
+	int count;					// Connections on the wheel
+};
+
+// Protocol state for one client connection
+struct Conn {
+	int fd;				// Established connection socket
+	int state;			// One of the CONN_ states above
+	int accepted;		// 1 if the client identifier matched
+	char op;			// OP_ENCODE or OP_DECODE for the current request
+	int framed;			// 1 if the client speaks the framed protocol
+	int packed;			// 1 if its chunks are packed 5 bits per char
+	int closing;		// 1 if the connection ends after the current reply
+	int corked;			// 1 while replies are held back with TCP_CORK
+	int events;			// epoll events currently registered (epoll engine)
+	int ringFlags;		// Requests outstanding on the ring (io_uring engine)
+	char *in;			// Bytes received ahead of the state machine, which
+	size_t inStart, inEnd, inSize;	// fields are filled from before the socket
+	int fileSize;		// Message size from the client (text length + newline)
+	size_t length;		// Chars of text in the current message or frame
+	char idBuffer[4];	// Client identifier, then the OK/NO verification
+	unsigned char header[FRAME_HEADER_SIZE];	// Frame header being read
+	struct FrameHeader frame;	// Decoded header of the current frame
+	unsigned char padField[PAD_OFFSET_SIZE];	// Pad offset field being read
+	uint64_t padOffset;	// Pad chars the current pad frame is ciphered with
+	uint64_t padNext;	// Next pad char reserved for the message being encoded
+	uint64_t padLeft;	// Reserved pad chars the message has not used yet
+	int padOpen;		// 1 while a pad message is being encoded
+	unsigned long messageChars;	// Chars admitted so far for the current framed message
+	struct Admission *holding;	// Admission the current request holds room in, or NULL
+	unsigned long admitBytes;	// Bytes the current request holds
+	long long admitDeadline;	// When a waiting request gives up (monotonic ms)
+	long long phaseMark;	// When the current phase began (monotonic ns)
+	int deadlineKind;	// DEADLINE_ kind the connection is held to now
+	long long waitStart;	// When that wait was first checked (monotonic ms, 0 if not yet)
+	long long lastMoved;	// When bytes were last seen to have moved during it
+	unsigned long waitBytes;	// Bytes moved during it
+	unsigned long seenBytes;	// Of those, how many had moved at the last check
+	int timedOut;		// 1 if the connection missed its deadline
+	struct TimerWheel *wheel;	// Wheel the connection is on, or NULL
+	struct Conn *timerNext, *timerPrev;	// Links in its wheel slot
+	long long timerTick;	// Tick of the slot it is in
+	char *text;			// Plain text (or cipher text) from the client
+	char *key;			// REPLY_ROOM bytes followed by the key text, which
+						// the cipher overwrites with the result
+	size_t bufferSize;	// Chars the text and key buffers have room for
+	size_t done;		// Bytes transferred so far in the current state
+	struct Conn *next;	// Link used by the worker queues
+};
+
+void error(const char *msg, int exitVal);
+
+void InitServerConfig(struct ServerConfig *config, const char *name, int serves);
+void ParseServerArgs(struct ServerConfig *config, int argc, char *argv[]);
+int OpenListener(struct ServerConfig *config, int port);
+int OpenUnixListener(struct ServerConfig *config, const char *path, int backlog);
+int RunServer(struct ServerConfig *config);
+void CountAccept(struct ServerConfig *config);
+
+struct Conn *NewConn(int fd);
+void FreeConn(struct Conn *conn);
+void CloseConn(struct Conn *conn);
+void ReuseConn(struct Conn *conn, int fd);
+int ConnWant(struct Conn *conn, char **buf, size_t *len);
+void ConnAdvance(struct ServerConfig *config, struct Conn *conn, size_t n);
+void ConnEOF(struct Conn *conn);
+size_t ConnFeed(struct ServerConfig *config, struct Conn *conn, const char *data, size_t n);
+int ConnBuffered(struct ServerConfig *config, struct Conn *conn);
+int ConnSaveInput(struct Conn *conn, const char *data, size_t n);
+ssize_t ConnRecv(struct ServerConfig *config, struct Conn *conn);
+void CipherConn(struct ServerConfig *config, struct Conn *conn);
+int ConnRetryAdmit(struct ServerConfig *config, struct Conn *conn);
+long long ConnDeadline(struct ServerConfig *config, struct Conn *conn, long long now);
+void ConnTimeout(struct Conn *conn);
+void ConnCork(struct ServerConfig *config, struct Conn *conn, int on);
+void CheckReport(struct ServerConfig *config);
+int AcceptNext(struct ServerConfig *config);
+const char *ServeBlocking(struct ServerConfig *config, struct Conn *conn);
+
+int RunForkEngine(struct ServerConfig *config);
+int RunPreforkEngine(struct ServerConfig *config);
+int RunEpollEngine(struct ServerConfig *config);
+int RunUringEngine(struct ServerConfig *config);
+int RunShards(struct ServerConfig *config);
+
+void OpenPad(struct ServerConfig *config);
+int PadReserve(struct Pad *pad, uint64_t n, uint64_t *offset);
+int PadCheckIssued(struct Pad *pad, uint64_t offset, uint64_t n);
+uint64_t PadSize(struct Pad *pad);
+const char *PadChars(struct Pad *pad, uint64_t offset);
+
+void TimerInit(struct TimerWheel *wheel);
+void TimerWatch(struct ServerConfig *config, struct TimerWheel *wheel, struct Conn *conn);
+void TimerRemove(struct Conn *conn);
+struct Conn *TimerExpire(struct ServerConfig *config, struct TimerWheel *wheel, long long now);
+int TimerWait(struct TimerWheel *wheel);
+
+void OpenAdmission(struct ServerConfig *config);
+long long NowMs(void);
+int AdmitRequest(struct ServerConfig *config, struct Conn *conn, unsigned long messageChars);
+int AdmitRetry(struct ServerConfig *config, struct Conn *conn);
+int AdmitWait(struct ServerConfig *config, struct Conn *conn);
+void AdmitRelease(struct Conn *conn);
+int AdmitHandshake(struct ServerConfig *config);
+void PrintAdmission(struct ServerConfig *config, FILE *out);
+
+void OpenMetrics(struct ServerConfig *config);
+void StartMetricsServer(struct ServerConfig *config);
+void StartRingServer(struct ServerConfig *config);
+void MetricsForked(void);
+long long MetricsNow(void);
+void MetricCount(int counter, unsigned long n);
+void MetricError(int kind);
+void MetricPhase(struct Conn *conn, int phase);
+void WriteMetrics(struct ServerConfig *config, FILE *out);
+
+#endif
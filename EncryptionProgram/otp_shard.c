@@ -0,0 +1,168 @@
+/*
+File: otp_shard.c
+Author: Adeline Harcourt
+Description: The shard supervisor for the otp daemons (-s). It forks one
+		process per shard. Each shard pins itself to a CPU, opens its own
+		SO_REUSEPORT listener on every port and runs the chosen engine, so
+		the kernel spreads new connections across the shards with no
+		shared accept queue or lock. Shards count their accepts and
+		ciphered requests in memory shared with the supervisor (as are
+		the admission counters), which
+		prints the counters on SIGUSR1 (with the metrics) and when stopped
+		with SIGTERM or SIGINT, and restarts any shard that is killed. The
+		metrics socket is served by the supervisor.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include "otp_server.h"
+
+// Set by the supervisor's signal handlers
+static volatile sig_atomic_t reportRequested = 0, stopRequested = 0;
+
+static void CatchReport(int signo) {
+	reportRequested = 1;
+}
+
+static void CatchStop(int signo) {
+	stopRequested = 1;
+}
+
+// Returns the current time in seconds from a monotonic clock
+static double Now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Forks shard i, which pins itself to its CPU and runs the engine on its
+// own listeners
+static void StartShard(struct ServerConfig *config, struct ShardStats *stats, int i) {
+	cpu_set_t cpuSet;
+	char message[256];
+	pid_t spawnpid = fork();
+
+	switch (spawnpid) {
+		case -1:
+			snprintf(message, sizeof(message), "%s could not start shard %d", config->name, i);
+			error(message, 1);
+			break;
+		case 0:
+			// In the shard: go down with the supervisor, and leave the
+			// supervisor's signals to their defaults
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			signal(SIGUSR1, SIG_IGN);
+			signal(SIGTERM, SIG_DFL);
+			signal(SIGINT, SIG_DFL);
+
+			CPU_ZERO(&cpuSet);
+			CPU_SET(stats[i].cpu, &cpuSet);
+			if (sched_setaffinity(0, sizeof(cpuSet), &cpuSet) < 0) perror("sched_setaffinity");
+
+			if (config->metricsFD >= 0) close(config->metricsFD);
+			if (config->ringFD >= 0) close(config->ringFD);
+			config->stats = &stats[i];
+			exit(RunServer(config));
+		default:
+			stats[i].pid = spawnpid;
+			break;
+	}
+}
+
+// Prints every shard's counters, with request rates since startup
+static void PrintShardStats(struct ServerConfig *config, struct ShardStats *stats, double elapsed) {
+	unsigned long accepts, requests, chars, totalAccepts = 0, totalRequests = 0, totalChars = 0;
+	int i;
+
+	fprintf(stderr, "%s: %d shards, up %.1f s\n", config->name, config->shards, elapsed);
+	for (i = 0; i < config->shards; i++) {
+		accepts = __atomic_load_n(&stats[i].accepts, __ATOMIC_RELAXED);
+		requests = __atomic_load_n(&stats[i].requests, __ATOMIC_RELAXED);
+		chars = __atomic_load_n(&stats[i].chars, __ATOMIC_RELAXED);
+		fprintf(stderr, "  shard %d (pid %d, cpu %d): %lu accepts, %lu requests, %lu chars, %.1f requests/s\n",
+			i, (int)stats[i].pid, stats[i].cpu, accepts, requests, chars, requests / elapsed);
+		totalAccepts += accepts;
+		totalRequests += requests;
+		totalChars += chars;
+	}
+	fprintf(stderr, "  total: %lu accepts, %lu requests, %lu chars, %.1f requests/s\n",
+		totalAccepts, totalRequests, totalChars, totalRequests / elapsed);
+	PrintAdmission(config, stderr);
+}
+
+// Runs the daemon as config->shards processes and supervises them until
+// told to stop
+int RunShards(struct ServerConfig *config) {
+	struct ShardStats *stats;
+	struct sigaction action = {0};
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double start = Now();
+	int i, status, exitVal = 0;
+	pid_t pid;
+
+	// Counters live in shared memory so the supervisor can read them
+	stats = mmap(NULL, config->shards * sizeof(struct ShardStats), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) error("could not allocate shard counters", 1);
+
+	// Report and stop on signals. Without SA_RESTART they interrupt waitpid.
+	sigfillset(&action.sa_mask);
+	action.sa_handler = CatchReport;
+	sigaction(SIGUSR1, &action, NULL);
+	action.sa_handler = CatchStop;
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+
+	for (i = 0; i < config->shards; i++) {
+		stats[i].cpu = cpus > 0 ? i % cpus : 0;
+		StartShard(config, stats, i);
+	}
+
+	// Keep the daemon running
+	while (!stopRequested) {
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno != EINTR) break;
+			if (reportRequested) {
+				reportRequested = 0;
+				PrintShardStats(config, stats, Now() - start);
+				WriteMetrics(config, stderr);
+			}
+			continue;
+		}
+
+		for (i = 0; i < config->shards; i++) {
+			if (stats[i].pid != pid) continue;
+
+			// A shard that exits on its own hit an error (such as a port it
+			// could not bind) that a restart would only repeat
+			if (WIFEXITED(status)) {
+				fprintf(stderr, "%s shard %d exited with status %d, stopping\n", config->name, i, WEXITSTATUS(status));
+				exitVal = 1;
+				stopRequested = 1;
+			}
+			// A killed shard is restarted so its share of connections is served
+			else if (!stopRequested) {
+				fprintf(stderr, "%s shard %d was killed by signal %d, restarting\n", config->name, i, WTERMSIG(status));
+				StartShard(config, stats, i);
+			}
+		}
+	}
+
+	// Stop the shards, then give the final counts
+	for (i = 0; i < config->shards; i++) kill(stats[i].pid, SIGTERM);
+	while (waitpid(-1, NULL, 0) > 0 || errno == EINTR);
+	PrintShardStats(config, stats, Now() - start);
+	munmap(stats, config->shards * sizeof(struct ShardStats));
+	return exitVal;
+}
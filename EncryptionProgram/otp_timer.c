@@ -0,0 +1,123 @@
+/*
+File: otp_timer.c
+Author: Adeline Harcourt
+Description: The timer wheel the epoll and io_uring engines keep their
+		connection deadlines on. Time is cut into ticks of TIMER_TICK_MS,
+		and a connection sits in the slot for the tick its deadline falls
+		in, so watching, moving and removing one are each a few pointer
+		swaps however many connections there are. A deadline further out
+		than one turn of the wheel goes in the last slot of the turn and
+		is placed again when that slot comes round. Deadlines only move
+		later as bytes move, so the wheel is lazy: a connection is
+		moved when its engine next watches it, and one found in a slot
+		whose deadline has since moved on is placed again rather than
+		expired.
+*/
+#include <string.h>
+#include "otp_server.h"
+
+// Returns the tick a deadline (monotonic ms) falls due in
+static long long DeadlineTick(long long deadline) {
+	return (deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+// Starts an empty wheel at the current tick
+void TimerInit(struct TimerWheel *wheel) {
+	memset(wheel, '\0', sizeof(*wheel));
+	wheel->tick = NowMs() / TIMER_TICK_MS;
+}
+
+// Takes a connection off the wheel it is on, if any
+void TimerRemove(struct Conn *conn) {
+	struct TimerWheel *wheel = conn->wheel;
+
+	if (wheel == NULL) return;
+	if (conn->timerPrev != NULL) conn->timerPrev->timerNext = conn->timerNext;
+	else wheel->slots[conn->timerTick % TIMER_SLOTS] = conn->timerNext;
+	if (conn->timerNext != NULL) conn->timerNext->timerPrev = conn->timerPrev;
+	conn->timerNext = conn->timerPrev = NULL;
+	conn->wheel = NULL;
+	wheel->count--;
+}
+
+// Puts a connection in the slot for a deadline, moving it if it is already
+// on the wheel. A deadline of -1 takes it off.
+static void Place(struct TimerWheel *wheel, struct Conn *conn, long long deadline, long long now) {
+	long long tick;
+	struct Conn **slot;
+
+	if (deadline < 0) {
+		TimerRemove(conn);
+		return;
+	}
+
+	// An empty wheel may not have been moved for a while, so bring it up to
+	// date, then keep to the ticks of the current turn
+	if (wheel->count == 0) wheel->tick = now / TIMER_TICK_MS;
+	tick = DeadlineTick(deadline);
+	if (tick < wheel->tick) tick = wheel->tick;
+	if (tick >= wheel->tick + TIMER_SLOTS) tick = wheel->tick + TIMER_SLOTS - 1;
+	if (conn->wheel == wheel && conn->timerTick == tick) return;
+
+	TimerRemove(conn);
+	slot = &wheel->slots[tick % TIMER_SLOTS];
+	conn->timerPrev = NULL;
+	conn->timerNext = *slot;
+	if (*slot != NULL) (*slot)->timerPrev = conn;
+	*slot = conn;
+	conn->timerTick = tick;
+	conn->wheel = wheel;
+	wheel->count++;
+}
+
+// Puts a connection on the wheel by its current deadline, moving it if it
+// is already there. One without a deadline is taken off.
+void TimerWatch(struct ServerConfig *config, struct TimerWheel *wheel, struct Conn *conn) {
+	long long now = NowMs();
+
+	Place(wheel, conn, ConnDeadline(config, conn, now), now);
+}
+
+// Moves the wheel up to now and returns the connections whose deadlines
+// have passed, taken off the wheel and linked through timerNext. The rest
+// of those in the passed slots are placed again.
+struct Conn *TimerExpire(struct ServerConfig *config, struct TimerWheel *wheel, long long now) {
+	struct Conn *expired = NULL, *list, *conn;
+	long long last = now / TIMER_TICK_MS;
+	long long deadline;
+
+	// After a long gap each slot need only be visited once
+	if (last - wheel->tick >= TIMER_SLOTS) wheel->tick = last - TIMER_SLOTS + 1;
+
+	while (wheel->tick <= last) {
+		list = wheel->slots[wheel->tick % TIMER_SLOTS];
+		wheel->slots[wheel->tick % TIMER_SLOTS] = NULL;
+		wheel->tick++;
+
+		while (list != NULL) {
+			conn = list;
+			list = conn->timerNext;
+			conn->timerNext = conn->timerPrev = NULL;
+			conn->wheel = NULL;
+			wheel->count--;
+
+			deadline = ConnDeadline(config, conn, now);
+			if (deadline >= 0 && deadline <= now) {
+				conn->timerNext = expired;
+				expired = conn;
+			}
+			else Place(wheel, conn, deadline, now);
+		}
+	}
+	return expired;
+}
+
+// Returns how many milliseconds an engine may wait before the wheel next
+// needs moving, or -1 if nothing is on it
+int TimerWait(struct TimerWheel *wheel) {
+	long long wait;
+
+	if (wheel->count == 0) return -1;
+	wait = wheel->tick * TIMER_TICK_MS - NowMs();
+	return wait > 0 ? (int)wait : 0;
+}
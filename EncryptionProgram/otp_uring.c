@@ -0,0 +1,534 @@
+/*
+File: otp_uring.c
+Author: Adeline Harcourt
+Description: The io_uring engine for the otp daemons. A single thread owns a
+		submission/completion ring, set up with the raw io_uring syscalls.
+		Every listener has a multishot accept armed on the ring and every
+		connection a multishot receive that fills buffers from a provided
+		buffer ring, so new connections and incoming bytes show up as
+		completions without a syscall of their own. Received bytes are fed
+		through the protocol state machine in otp_server.c, and replies go
+		out as send requests; the last send on a connection is linked to
+		its shutdown and close. One pass of the event loop is a single
+		io_uring_enter that submits everything queued and waits for the
+		next completion. The cipher runs on the ring thread. Requests
+		waiting for admission have their receive cancelled and are
+		retried after every batch of completions, with a timeout request
+		keeping the ring ticking while any wait. Connections waiting on a
+		receive or send sit on a timer wheel, and the same timeout ticks
+		the ring while any do; one past its deadline is shut down, which
+		also ends any send it has in flight. Needs Linux 6.0 or later.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "otp_server.h"
+
+#define URING_ENTRIES     256		// Submission queue slots
+#define URING_CQ_ENTRIES  4096		// Completion queue slots
+#define URING_BUFFERS     64		// Provided receive buffers (a power of 2)
+#define URING_BUFFER_SIZE 32768		// Size of each provided buffer
+#define URING_GROUP       0			// Buffer group id of the receive buffers
+
+// Request kinds, kept in the low bits of each request's user_data next to
+// the connection (or listener) pointer. A user_data of 0 is ignored.
+#define TAG_ACCEPT 0
+#define TAG_RECV   1
+#define TAG_SEND   2
+#define TAG_CLOSE  3
+#define TAG_MASK   3
+
+// Bits of conn->ringFlags
+#define RING_RECV   0x01	// Multishot receive armed
+#define RING_SEND   0x02	// Send in flight
+#define RING_CLOSE  0x04	// Shutdown and close queued
+#define RING_EOF    0x08	// Client closed its side
+#define RING_CLOSED 0x10	// Socket closed; free once nothing is in flight
+#define RING_PARKED 0x20	// Waiting for admission on the parked list
+
+// The ring and its mappings, owned by the engine thread
+struct Ring {
+	struct ServerConfig *config;
+	int fd;
+	unsigned *sqHead, *sqTailShared, *sqArray;
+	unsigned sqTail, sqMask, sqEntries, toSubmit;
+	struct io_uring_sqe *sqes;
+	unsigned *cqHead, *cqTail, cqMask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *bufRing;	// Provided buffer ring shared with the kernel
+	unsigned bufTail;
+	char *buffers;						// Memory behind the provided buffers
+	struct Conn *waitHead, *waitTail;	// Requests waiting for admission
+	struct __kernel_timespec tick;		// Timeout that wakes the ring while any wait;
+	int ticking;						// its address is the timeout's user_data
+	struct TimerWheel wheel;			// Deadlines of connections waiting on clients
+};
+
+static void DriveConn(struct Ring *ring, struct Conn *conn);
+
+// Set by SIGTERM or SIGINT
+static volatile sig_atomic_t stopRequested = 0;
+
+static void CatchStop(int signo) {
+	stopRequested = 1;
+}
+
+// Packs a pointer and request kind into a user_data value
+static uint64_t Tag(void *ptr, int kind) {
+	return (uint64_t)(uintptr_t)ptr | kind;
+}
+
+// Submits every queued request, optionally waiting for a completion
+static void RingEnter(struct Ring *ring, int wait) {
+	int ret;
+
+	__atomic_store_n(ring->sqTailShared, ring->sqTail, __ATOMIC_RELEASE);
+	ret = syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, wait ? 1 : 0,
+		wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (ret < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY) return;
+		error("io_uring_enter failed", 1);
+	}
+	ring->toSubmit -= ret;
+}
+
+// Makes sure count submission slots are free, so linked requests are
+// never split across two submissions
+static void RingReserve(struct Ring *ring, unsigned count) {
+	while (ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) + count > ring->sqEntries)
+		RingEnter(ring, 0);
+}
+
+// Returns a cleared submission queue entry, queued for the next submit
+static struct io_uring_sqe *RingSqe(struct Ring *ring) {
+	unsigned index = ring->sqTail & ring->sqMask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, '\0', sizeof(*sqe));
+	ring->sqArray[index] = index;
+	ring->sqTail++;
+	ring->toSubmit++;
+	return sqe;
+}
+
+// Hands a receive buffer back to the kernel
+static void RecycleBuffer(struct Ring *ring, int bid) {
+	struct io_uring_buf *buf = &ring->bufRing->bufs[ring->bufTail & (URING_BUFFERS - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+	ring->bufTail++;
+	__atomic_store_n(&ring->bufRing->tail, (uint16_t)ring->bufTail, __ATOMIC_RELEASE);
+}
+
+// Creates the ring, maps its queues and registers the receive buffers
+static void RingSetup(struct Ring *ring) {
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	size_t sqSize, cqSize;
+	char *sq, *cq;
+	int i;
+
+	memset(&params, '\0', sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_CQ_ENTRIES;
+	ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring->fd < 0) error("could not set up io_uring", 1);
+
+	// Map the submission and completion rings (one mapping on newer kernels)
+	sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) && cqSize > sqSize) sqSize = cqSize;
+	sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) error("could not map io_uring submission queue", 1);
+	cq = sq;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) error("could not map io_uring completion queue", 1);
+	}
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) error("could not map io_uring entries", 1);
+
+	ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+	ring->sqTailShared = (unsigned *)(sq + params.sq_off.tail);
+	ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+	ring->sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sqEntries = params.sq_entries;
+	ring->sqTail = *ring->sqTailShared;
+	ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+	ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	// Register a ring of provided buffers for the multishot receives
+	ring->bufRing = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+	if (ring->bufRing == MAP_FAILED || ring->buffers == NULL) error("could not allocate receive buffers", 1);
+	memset(&reg, '\0', sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->bufRing;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_GROUP;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		error("could not register io_uring buffers (the io_uring engine needs Linux 6.0 or later)", 1);
+	for (i = 0; i < URING_BUFFERS; i++) RecycleBuffer(ring, i);
+}
+
+// Arms a multishot accept on a listener. Its user_data points at the
+// listener's slot in config->listenFDs.
+static void ArmAccept(struct Ring *ring, int *listenFD) {
+	struct io_uring_sqe *sqe;
+
+	RingReserve(ring, 1);
+	sqe = RingSqe(ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = *listenFD;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = Tag(listenFD, TAG_ACCEPT);
+}
+
+// Arms a multishot receive that picks its buffers from the provided ring
+static void ArmRecv(struct Ring *ring, struct Conn *conn) {
+	struct io_uring_sqe *sqe;
+
+	RingReserve(ring, 1);
+	sqe = RingSqe(ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_GROUP;
+	sqe->user_data = Tag(conn, TAG_RECV);
+	conn->ringFlags |= RING_RECV;
+}
+
+// Queues a shutdown (which also ends the multishot receive) followed by a
+// close. The close is hard linked so it runs even if the shutdown fails.
+static void QueueClose(struct Ring *ring, struct Conn *conn) {
+	struct io_uring_sqe *sqe;
+
+	sqe = RingSqe(ring);
+	sqe->opcode = IORING_OP_SHUTDOWN;
+	sqe->fd = conn->fd;
+	sqe->len = SHUT_RDWR;
+	sqe->flags = IOSQE_IO_HARDLINK;
+	sqe->user_data = 0;
+
+	sqe = RingSqe(ring);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = conn->fd;
+	sqe->user_data = Tag(conn, TAG_CLOSE);
+	conn->ringFlags |= RING_CLOSE;
+}
+
+// Returns 1 if finishing the current write ends the connection
+static int LastWrite(struct Conn *conn) {
+	if (conn->state == CONN_VERIFY) return !conn->accepted;
+	return conn->state == CONN_REPLY && (!conn->framed || conn->closing);
+}
+
+// Queues a send of the unfinished part of the current field. The last send
+// on a connection carries the shutdown and close linked behind it.
+static void QueueSend(struct Ring *ring, struct Conn *conn, char *buf, size_t len) {
+	struct io_uring_sqe *sqe;
+	int last = LastWrite(conn);
+
+	RingReserve(ring, 3);
+	sqe = RingSqe(ring);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = conn->fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL; // A short send breaks the link
+	sqe->user_data = Tag(conn, TAG_SEND);
+	conn->ringFlags |= RING_SEND;
+	if (last) {
+		sqe->flags = IOSQE_IO_LINK;
+		QueueClose(ring, conn);
+	}
+}
+
+// Stops the multishot receive of a connection that is about to wait, so its
+// unread bytes stay in the socket
+static void CancelRecv(struct Ring *ring, struct Conn *conn) {
+	struct io_uring_sqe *sqe;
+
+	RingReserve(ring, 1);
+	sqe = RingSqe(ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = Tag(conn, TAG_RECV);
+	sqe->user_data = 0;
+}
+
+// Queues a timeout that completes after ms milliseconds, so the loop comes
+// round to retry waiting requests and expire deadlines even when nothing
+// else happens
+static void ArmTick(struct Ring *ring, int ms) {
+	struct io_uring_sqe *sqe;
+
+	ring->tick.tv_sec = ms / 1000;
+	ring->tick.tv_nsec = (ms % 1000) * 1000000L;
+	RingReserve(ring, 1);
+	sqe = RingSqe(ring);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uint64_t)(uintptr_t)&ring->tick;
+	sqe->len = 1;
+	sqe->user_data = (uint64_t)(uintptr_t)&ring->tick;
+	ring->ticking = 1;
+}
+
+// Appends a connection to the parked list
+static void ParkConn(struct Ring *ring, struct Conn *conn) {
+	conn->next = NULL;
+	if (ring->waitTail != NULL) ring->waitTail->next = conn;
+	else ring->waitHead = conn;
+	ring->waitTail = conn;
+	conn->ringFlags |= RING_PARKED;
+}
+
+// Frees a closed connection once the kernel holds no more requests for it
+static void ReleaseConn(struct Conn *conn) {
+	if ((conn->ringFlags & RING_CLOSED) && !(conn->ringFlags & (RING_RECV | RING_SEND))) FreeConn(conn);
+}
+
+// Runs a connection's state machine until it has to wait on the ring:
+// for a send, for more bytes, or for its close
+static void DriveConn(struct Ring *ring, struct Conn *conn) {
+	struct ServerConfig *config = ring->config;
+	char *buf;
+	size_t len;
+
+	while (1) {
+		if (conn->ringFlags & (RING_SEND | RING_CLOSE | RING_CLOSED | RING_PARKED)) return;
+
+		if (conn->state == CONN_DONE || conn->state == CONN_FAILED) {
+			TimerRemove(conn);
+			RingReserve(ring, 2);
+			QueueClose(ring, conn);
+			return;
+		}
+		if (conn->state == CONN_CIPHER) {
+			CipherConn(config, conn);
+			continue;
+		}
+		if (conn->state == CONN_ADMIT) {
+			if (conn->ringFlags & RING_RECV) CancelRecv(ring, conn);
+			TimerRemove(conn);
+			ConnCork(config, conn, 0);
+			ParkConn(ring, conn);
+			return;
+		}
+
+		// Anything else waits on the client, until its deadline
+		if (ConnWant(conn, &buf, &len) == IO_WRITE) {
+			ConnCork(config, conn, 1);
+			QueueSend(ring, conn, buf, len);
+			TimerWatch(config, &ring->wheel, conn);
+			return;
+		}
+
+		// Reading: use buffered bytes first, then wait for the receive
+		if (ConnBuffered(config, conn)) continue;
+		if (conn->ringFlags & RING_EOF) {
+			ConnEOF(conn);
+			continue;
+		}
+		ConnCork(config, conn, 0);
+		if (!(conn->ringFlags & RING_RECV)) ArmRecv(ring, conn);
+		TimerWatch(config, &ring->wheel, conn);
+		return;
+	}
+}
+
+// A listener accepted a connection (or the multishot accept ended)
+static void AcceptDone(struct Ring *ring, int *listenFD, struct io_uring_cqe *cqe) {
+	struct Conn *conn;
+
+	if (cqe->res >= 0) {
+		CountAccept(ring->config);
+		conn = NewConn(cqe->res);
+		if (conn == NULL) close(cqe->res);
+		else DriveConn(ring, conn);
+	}
+	else if (cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+		fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+	}
+
+	// Re-arm the accept if the kernel stopped it
+	if (!(cqe->flags & IORING_CQE_F_MORE)) ArmAccept(ring, listenFD);
+}
+
+// Bytes arrived in a provided buffer (or the multishot receive ended).
+// A parked connection only saves what arrives, so it stays waiting; an
+// error will show up again once its receive is rearmed.
+static void RecvDone(struct Ring *ring, struct Conn *conn, struct io_uring_cqe *cqe) {
+	char *data;
+	size_t used = 0;
+	int bid, parked = (conn->ringFlags & RING_PARKED) != 0;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) conn->ringFlags &= ~RING_RECV;
+
+	if (cqe->res > 0) {
+		// Feed the bytes straight in, keeping any the state machine is not
+		// ready for, and give the buffer straight back
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		data = ring->buffers + (size_t)bid * URING_BUFFER_SIZE;
+		if (!(conn->ringFlags & (RING_CLOSE | RING_CLOSED))) {
+			if (conn->inEnd == conn->inStart) used = ConnFeed(ring->config, conn, data, cqe->res);
+			if (ConnSaveInput(conn, data + used, cqe->res - used) < 0 && !parked) conn->state = CONN_FAILED;
+		}
+		RecycleBuffer(ring, bid);
+	}
+	else if (cqe->res == 0) conn->ringFlags |= RING_EOF;
+	else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED && !parked) conn->state = CONN_FAILED;
+
+	if (conn->ringFlags & RING_CLOSED) ReleaseConn(conn);
+	else DriveConn(ring, conn);
+}
+
+// A send finished, fully or (if the link broke) partly
+static void SendDone(struct Ring *ring, struct Conn *conn, struct io_uring_cqe *cqe) {
+	conn->ringFlags &= ~RING_SEND;
+	if (cqe->res < 0) conn->state = CONN_FAILED;
+	else ConnAdvance(ring->config, conn, cqe->res);
+
+	if (conn->ringFlags & RING_CLOSED) ReleaseConn(conn);
+	else DriveConn(ring, conn);
+}
+
+// The close finished, or was cancelled because the send linked ahead of it
+// fell short, in which case the connection carries on
+static void CloseDone(struct Ring *ring, struct Conn *conn, struct io_uring_cqe *cqe) {
+	conn->ringFlags &= ~RING_CLOSE;
+	if (cqe->res == -ECANCELED) {
+		DriveConn(ring, conn);
+		return;
+	}
+	conn->ringFlags |= RING_CLOSED;
+	conn->fd = -1;
+	ReleaseConn(conn);
+}
+
+// Retries every parked request, oldest first. Admitted and timed out
+// requests carry on; the rest are parked again.
+static void RetryWaiting(struct Ring *ring) {
+	struct Conn *waiting = ring->waitHead, *conn;
+
+	ring->waitHead = ring->waitTail = NULL;
+	while (waiting != NULL) {
+		conn = waiting;
+		waiting = conn->next;
+		conn->next = NULL;
+		conn->ringFlags &= ~RING_PARKED;
+		if (ConnRetryAdmit(ring->config, conn)) DriveConn(ring, conn);
+		else ParkConn(ring, conn);
+	}
+}
+
+// Shuts down every connection whose deadline has passed. A connection with
+// its close already linked behind a stalled send gets a shutdown of its
+// own, which fails the send and so cancels the linked close; it is then
+// closed as failed.
+static void ExpireConns(struct Ring *ring) {
+	struct Conn *expired = TimerExpire(ring->config, &ring->wheel, NowMs()), *conn;
+	struct io_uring_sqe *sqe;
+
+	while (expired != NULL) {
+		conn = expired;
+		expired = conn->timerNext;
+		conn->timerNext = NULL;
+		if (conn->ringFlags & RING_CLOSED) continue;
+		ConnTimeout(conn);
+		RingReserve(ring, 2);
+		if (!(conn->ringFlags & RING_CLOSE)) QueueClose(ring, conn);
+		else {
+			sqe = RingSqe(ring);
+			sqe->opcode = IORING_OP_SHUTDOWN;
+			sqe->fd = conn->fd;
+			sqe->len = SHUT_RDWR;
+			sqe->user_data = 0;
+		}
+	}
+}
+
+// Returns how long the ring may wait before it next needs to come round
+// (-1 for as long as it likes): a timer tick while connections have
+// deadlines, and no longer than ADMIT_TICK_MS while requests are parked
+static int TickLength(struct Ring *ring) {
+	int ms = TimerWait(&ring->wheel);
+
+	if (ring->waitHead != NULL && (ms < 0 || ms > ADMIT_TICK_MS)) ms = ADMIT_TICK_MS;
+	return ms;
+}
+
+// The io_uring engine: one thread, one ring, no per-event syscalls beyond
+// the io_uring_enter that submits and waits
+int RunUringEngine(struct ServerConfig *config) {
+	struct Ring ring;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	void *ptr;
+	int i, tickMs;
+	struct sigaction stopAction = {0};
+
+	// The kernel tears a ring down after the process exits, and until then
+	// its armed accepts keep the listeners open. Catch the usual stop
+	// signals so the listeners can be shut down first and the ports are
+	// free for a restart straight away.
+	stopAction.sa_handler = CatchStop;
+	sigfillset(&stopAction.sa_mask);
+	sigaction(SIGTERM, &stopAction, NULL);
+	sigaction(SIGINT, &stopAction, NULL);
+
+	memset(&ring, '\0', sizeof(ring));
+	ring.config = config;
+	TimerInit(&ring.wheel);
+	RingSetup(&ring);
+	for (i = 0; i < config->numListeners; i++) ArmAccept(&ring, &config->listenFDs[i]);
+
+	// Keep the daemon running
+	while (!stopRequested) {
+		RingEnter(&ring, 1);
+		CheckReport(config);
+
+		head = *ring.cqHead;
+		tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &ring.cqes[head & ring.cqMask];
+			if (cqe->user_data == 0) continue;
+			if (cqe->user_data == (uint64_t)(uintptr_t)&ring.tick) {
+				ring.ticking = 0;
+				continue;
+			}
+			ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)TAG_MASK);
+			switch (cqe->user_data & TAG_MASK) {
+				case TAG_ACCEPT: AcceptDone(&ring, ptr, cqe); break;
+				case TAG_RECV:   RecvDone(&ring, ptr, cqe); break;
+				case TAG_SEND:   SendDone(&ring, ptr, cqe); break;
+				case TAG_CLOSE:  CloseDone(&ring, ptr, cqe); break;
+			}
+		}
+		__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+
+		if (ring.waitHead != NULL) RetryWaiting(&ring);
+		if (ring.wheel.count > 0) ExpireConns(&ring);
+		tickMs = ring.ticking ? -1 : TickLength(&ring);
+		if (tickMs >= 0) ArmTick(&ring, tickMs > 0 ? tickMs : 1);
+	}
+
+	for (i = 0; i < config->numListeners; i++) shutdown(config->listenFDs[i], SHUT_RDWR);
+	return 0;
+}
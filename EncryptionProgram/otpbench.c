@@ -0,0 +1,436 @@
+/*
+File: otpbench.c
+Author: Adeline Harcourt
+Description: A regression benchmark for the otp daemons. For each server
+		engine (fork, epoll and uring), each protocol (the original one
+		with a connection per request, and single messages on one framed
+		connection) and each message size taken from plaintext1 to
+		plaintext5, it starts otp_d and reports:
+		  p50 / p99 - request latency in microseconds, from connecting
+		              (or sending the first frame) to the last byte of
+		              the reply
+		  sys/req   - syscalls otp_d makes per request. The daemon is run
+		              under ptrace, following every thread and forked
+		              child, with N and then 2N requests, and the
+		              difference is divided by N so startup and shutdown
+		              drop out.
+		Results are compared with a baseline file and the benchmark exits
+		with status 1 if any figure regressed. If the baseline file does
+		not exist (or -u is given) the results are saved as the new
+		baseline. Run it from the directory holding otp_d and the
+		plaintext files.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "otp_proto.h"
+
+#define DAEMON "./otp_d"
+#define NUM_SIZES 5
+#define MAX_RESULTS 64
+
+// Allowed slack before a figure counts as a regression: a ratio of the
+// baseline plus an absolute amount, so tiny baselines do not trip on noise.
+// Latency is noisy on a shared machine, so the latency limits are loose;
+// they are there to catch step changes such as a delayed-ACK stall.
+#define P50_RATIO 2.0
+#define P50_SLACK 50.0		// microseconds
+#define P99_RATIO 3.0
+#define P99_SLACK 5000.0	// microseconds
+#define SYS_RATIO 1.1
+#define SYS_SLACK 0.5		// syscalls per request
+
+static const char *engines[] = { "fork", "epoll", "uring" };
+static const char *protocols[] = { "legacy", "framed" };
+
+// Figures for one engine, protocol and message size
+struct Result {
+	char engine[16];
+	char protocol[16];
+	long chars;
+	double p50, p99, syscalls;
+};
+
+// Error function used for reporting issues with custom exit value
+static void error(const char *msg, int exitVal) {
+	fprintf(stderr, "ERROR: %s\n", msg);
+	exit(exitVal);
+}
+
+// Returns the current time in microseconds from a monotonic clock
+static double NowMicros(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Sends all n bytes, exiting on failure
+static void SendAll(int fd, const void *buf, size_t n) {
+	ssize_t sent;
+	size_t done = 0;
+
+	while (done < n) {
+		sent = send(fd, (const char *)buf + done, n - done, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0) error("could not send to daemon", 1);
+		done += sent;
+	}
+}
+
+// Receives exactly n bytes, exiting on failure
+static void RecvAll(int fd, void *buf, size_t n) {
+	ssize_t got;
+	size_t done = 0;
+
+	while (done < n) {
+		got = recv(fd, (char *)buf + done, n - done, 0);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) error("could not receive from daemon", 1);
+		done += got;
+	}
+}
+
+// Connects to the daemon on localhost and completes the handshake,
+// retrying while the daemon starts up
+static int Connect(int port, const char *id) {
+	struct sockaddr_in serverAddress;
+	char reply[2];
+	int fd, tries, yes = 1;
+
+	memset(&serverAddress, '\0', sizeof(serverAddress));
+	serverAddress.sin_family = AF_INET;
+	serverAddress.sin_port = htons(port);
+	serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (tries = 0; tries < 500; tries++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) error("could not open socket", 1);
+		// Same socket options as otp_enc and otp_dec
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		if (connect(fd, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) == 0) {
+			SendAll(fd, id, 3);
+			RecvAll(fd, reply, 2);
+			if (memcmp(reply, "OK", 2) != 0) error("daemon refused the handshake", 1);
+			return fd;
+		}
+		close(fd);
+		usleep(10000);
+	}
+	error("could not connect to " DAEMON, 1);
+	return -1;
+}
+
+// Sends requests one at a time in the original protocol, one connection
+// each. Records each request's latency if latencies is not NULL.
+static void RunLegacy(int port, int requests, const char *text, const char *key, char *out, size_t n,
+		double *latencies) {
+	int i, fd, bufferSize = (int)n + 1;
+	double start;
+
+	for (i = 0; i < requests; i++) {
+		start = NowMicros();
+		fd = Connect(port, ID_ENCODE);
+		SendAll(fd, &bufferSize, sizeof(bufferSize));
+		SendAll(fd, text, n);
+		SendAll(fd, key, n);
+		RecvAll(fd, out, n);
+		if (latencies != NULL) latencies[i] = NowMicros() - start;
+		close(fd);
+	}
+}
+
+// Sends requests as messages on one framed connection, each split into
+// frames and waiting on every reply before sending more. Records each
+// message's latency if latencies is not NULL.
+static void RunFramed(int port, int requests, const char *text, const char *key, char *out, size_t n,
+		double *latencies) {
+	struct FrameHeader header;
+	unsigned char packed[FRAME_HEADER_SIZE];
+	size_t offset, chunk;
+	int i, fd = Connect(port, ID_ENCODE_STREAM);
+	double start;
+
+	for (i = 0; i < requests; i++) {
+		start = NowMicros();
+		for (offset = 0; offset < n; offset += chunk) {
+			chunk = n - offset < STREAM_CHUNK_SIZE ? n - offset : STREAM_CHUNK_SIZE;
+			header.op = OP_ENCODE;
+			header.flags = (offset + chunk == n) ? FRAME_LAST : 0;
+			header.status = STATUS_OK;
+			header.length = chunk;
+			PackFrameHeader(packed, &header);
+			SendAll(fd, packed, sizeof(packed));
+			SendAll(fd, text + offset, chunk);
+			SendAll(fd, key + offset, chunk);
+
+			RecvAll(fd, packed, sizeof(packed));
+			UnpackFrameHeader(packed, &header);
+			if (header.status != STATUS_OK || header.length != chunk) error("daemon rejected a frame", 1);
+			RecvAll(fd, out + offset, chunk);
+		}
+		if (latencies != NULL) latencies[i] = NowMicros() - start;
+	}
+
+	// Say goodbye and wait for the daemon to hang up
+	shutdown(fd, SHUT_WR);
+	while (recv(fd, out, n, 0) > 0);
+	close(fd);
+}
+
+// Starts otp_d with an engine, stopped at exec under ptrace if traced
+static pid_t StartDaemon(const char *engine, int port, int traced) {
+	char portString[16];
+	int status;
+	pid_t daemonPid;
+
+	snprintf(portString, sizeof(portString), "%d", port);
+	daemonPid = fork();
+	if (daemonPid < 0) error("could not fork", 1);
+	if (daemonPid == 0) {
+		if (traced && ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) _exit(2);
+		execl(DAEMON, DAEMON, "-e", engine, portString, (char *)NULL);
+		_exit(3);
+	}
+	if (traced) {
+		if (waitpid(daemonPid, &status, 0) < 0 || !WIFSTOPPED(status))
+			error("could not start " DAEMON " under ptrace", 1);
+		ptrace(PTRACE_SETOPTIONS, daemonPid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+			PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_EXITKILL);
+		ptrace(PTRACE_SYSCALL, daemonPid, NULL, 0);
+	}
+	return daemonPid;
+}
+
+// Runs a load against the daemon on the port
+static void RunLoad(int port, int framed, int requests, const char *text, const char *key, char *out,
+		size_t n, double *latencies) {
+	if (framed) RunFramed(port, requests, text, key, out, n, latencies);
+	else RunLegacy(port, requests, text, key, out, n, latencies);
+}
+
+// Starts otp_d under ptrace, runs the load against it from a child
+// process, then stops the daemon. Returns the number of syscalls the
+// daemon and all of its threads and children made.
+static long CountSyscalls(const char *engine, int port, int framed, int requests,
+		const char *text, const char *key, char *out, size_t n) {
+	struct __ptrace_syscall_info info;
+	pid_t daemonPid = StartDaemon(engine, port, 1), loadPid, pid;
+	int status, sig;
+	long count = 0;
+
+	// Run the load untraced
+	loadPid = fork();
+	if (loadPid < 0) error("could not fork", 1);
+	if (loadPid == 0) {
+		RunLoad(port, framed, requests, text, key, out, n, NULL);
+		_exit(0);
+	}
+
+	// Count syscall entries until the load is done and every traced task has exited
+	while ((pid = waitpid(-1, &status, __WALL)) > 0) {
+		if (pid == loadPid) {
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) error("load failed", 1);
+			kill(daemonPid, SIGTERM);
+			continue;
+		}
+		if (!WIFSTOPPED(status)) continue; // A traced task exited
+
+		sig = WSTOPSIG(status);
+		if (sig == (SIGTRAP | 0x80)) {
+			if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY)
+				count++;
+			sig = 0;
+		}
+		// Fork and clone events, and the stop new tasks start in, are not
+		// signals for the daemon
+		else if ((status >> 16) != 0 || sig == SIGSTOP || sig == SIGTRAP) sig = 0;
+		ptrace(PTRACE_SYSCALL, pid, NULL, sig);
+	}
+	return count;
+}
+
+// Orders latencies for the percentiles
+static int CompareDoubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// Measures one engine, protocol and size: latency untraced, then syscalls
+// per request from traced runs of N and 2N requests
+static void Measure(struct Result *result, int port, int framed, int requests,
+		const char *text, const char *key, char *out, double *latencies) {
+	size_t n = result->chars;
+	long once, twice;
+	pid_t daemonPid;
+
+	// Time the requests after a short warm up
+	daemonPid = StartDaemon(result->engine, port, 0);
+	RunLoad(port, framed, requests / 10 + 1, text, key, out, n, NULL);
+	RunLoad(port, framed, requests, text, key, out, n, latencies);
+	kill(daemonPid, SIGTERM);
+	waitpid(daemonPid, NULL, 0);
+	qsort(latencies, requests, sizeof(double), CompareDoubles);
+	result->p50 = latencies[requests / 2];
+	result->p99 = latencies[requests * 99 / 100];
+
+	once = CountSyscalls(result->engine, port, framed, requests, text, key, out, n);
+	twice = CountSyscalls(result->engine, port, framed, 2 * requests, text, key, out, n);
+	result->syscalls = (double)(twice - once) / requests;
+}
+
+// Reads a baseline file into results. Returns the number read, or -1 if
+// the file does not exist.
+static int ReadBaseline(const char *path, struct Result *results) {
+	FILE *file = fopen(path, "r");
+	char line[256];
+	int count = 0;
+
+	if (file == NULL) return -1;
+	while (count < MAX_RESULTS && fgets(line, sizeof(line), file) != NULL) {
+		if (line[0] == '#') continue;
+		if (sscanf(line, "%15s %15s %ld %lf %lf %lf", results[count].engine, results[count].protocol,
+				&results[count].chars, &results[count].p50, &results[count].p99, &results[count].syscalls) == 6)
+			count++;
+	}
+	fclose(file);
+	return count;
+}
+
+// Writes results as the new baseline file
+static void WriteBaseline(const char *path, const struct Result *results, int count) {
+	FILE *file = fopen(path, "w");
+	int i;
+
+	if (file == NULL) error("could not write baseline file", 1);
+	fprintf(file, "# engine protocol chars p50_us p99_us syscalls_per_request\n");
+	for (i = 0; i < count; i++) {
+		fprintf(file, "%s %s %ld %.1f %.1f %.2f\n", results[i].engine, results[i].protocol,
+			results[i].chars, results[i].p50, results[i].p99, results[i].syscalls);
+	}
+	fclose(file);
+}
+
+// Finds the baseline entry matching a result, or NULL
+static const struct Result *FindBaseline(const struct Result *baseline, int count, const struct Result *result) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (strcmp(baseline[i].engine, result->engine) == 0 && strcmp(baseline[i].protocol, result->protocol) == 0
+				&& baseline[i].chars == result->chars)
+			return &baseline[i];
+	}
+	return NULL;
+}
+
+// Prints a result next to its baseline and returns 1 if any figure regressed
+static int Report(const struct Result *result, const struct Result *base) {
+	int slowP50, slowP99, moreSyscalls;
+
+	printf("%-6s %-7s %6ld %10.1f %10.1f %9.1f", result->engine, result->protocol, result->chars,
+		result->p50, result->p99, result->syscalls);
+	if (base == NULL) {
+		printf("\n");
+		return 0;
+	}
+
+	slowP50 = result->p50 > base->p50 * P50_RATIO + P50_SLACK;
+	slowP99 = result->p99 > base->p99 * P99_RATIO + P99_SLACK;
+	moreSyscalls = result->syscalls > base->syscalls * SYS_RATIO + SYS_SLACK;
+	printf("   (%.1f %.1f %.1f)%s%s%s\n", base->p50, base->p99, base->syscalls,
+		slowP50 ? " REGRESSED:p50" : "", slowP99 ? " REGRESSED:p99" : "", moreSyscalls ? " REGRESSED:syscalls" : "");
+	return slowP50 || slowP99 || moreSyscalls;
+}
+
+// Prints the benchmark usage message and exits
+static void Usage(const char *prog) {
+	fprintf(stderr, "USAGE: %s [-n requests] [-b baselinefile] [-u] [-p port]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	struct Result results[MAX_RESULTS], baseline[MAX_RESULTS];
+	const char *baselinePath = "otpbench.baseline";
+	int requests = 500, port = 52600, update = 0, numBaseline, numResults = 0, regressed = 0;
+	int opt, e, p, s;
+	long sizes[NUM_SIZES], maxChars = 0;
+	char fileName[32], *text, *key, *out;
+	double *latencies;
+	struct stat fileInfo;
+
+	// Check user input format
+	while ((opt = getopt(argc, argv, "n:b:up:")) != -1) {
+		switch (opt) {
+			case 'n': requests = atoi(optarg); break;
+			case 'b': baselinePath = optarg; break;
+			case 'u': update = 1; break;
+			case 'p': port = atoi(optarg); break;
+			default: Usage(argv[0]);
+		}
+	}
+	if (optind != argc || requests < 1) Usage(argv[0]);
+	if (access(DAEMON, X_OK) != 0) error("run from the directory holding otp_d", 1);
+
+	// Message sizes are those of the plaintext files, less the newline
+	for (s = 0; s < NUM_SIZES; s++) {
+		snprintf(fileName, sizeof(fileName), "plaintext%d", s + 1);
+		if (stat(fileName, &fileInfo) < 0 || fileInfo.st_size < 2) error("could not find the plaintext files", 1);
+		sizes[s] = (long)fileInfo.st_size - 1;
+		if (sizes[s] > maxChars) maxChars = sizes[s];
+	}
+
+	// Any valid text and key will do
+	text = malloc(maxChars);
+	key = malloc(maxChars);
+	out = malloc(maxChars);
+	latencies = malloc(requests * sizeof(double));
+	if (!text || !key || !out || !latencies) error("could not allocate buffers", 1);
+	memset(text, 'A', maxChars);
+	memset(key, 'B', maxChars);
+
+	numBaseline = update ? -1 : ReadBaseline(baselinePath, baseline);
+
+	printf("%-6s %-7s %6s %10s %10s %9s   %s  (%d requests each)\n", "engine", "proto", "chars",
+		"p50 us", "p99 us", "sys/req", numBaseline >= 0 ? "(baseline)" : "", requests);
+	for (e = 0; e < (int)(sizeof(engines) / sizeof(engines[0])); e++) {
+		for (p = 0; p < 2; p++) {
+			for (s = 0; s < NUM_SIZES; s++) {
+				struct Result *result = &results[numResults++];
+
+				memset(result, '\0', sizeof(*result));
+				snprintf(result->engine, sizeof(result->engine), "%s", engines[e]);
+				snprintf(result->protocol, sizeof(result->protocol), "%s", protocols[p]);
+				result->chars = sizes[s];
+				Measure(result, port, p, requests, text, key, out, latencies);
+				regressed |= Report(result, numBaseline > 0 ? FindBaseline(baseline, numBaseline, result) : NULL);
+				fflush(stdout);
+			}
+		}
+	}
+
+	// Save a new baseline, or judge against the old one
+	if (numBaseline < 0) {
+		WriteBaseline(baselinePath, results, numResults);
+		printf("saved baseline to %s\n", baselinePath);
+	}
+	else if (regressed) printf("FAIL: regressed against %s\n", baselinePath);
+	else printf("OK: no regressions against %s\n", baselinePath);
+
+	free(text);
+	free(key);
+	free(out);
+	free(latencies);
+	return regressed;
+}
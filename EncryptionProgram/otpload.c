@@ -0,0 +1,908 @@
+/*
+File: otpload.c
+Author: Adeline Harcourt
+Description: A load generator for the otp daemons. One thread drives many
+		non-blocking connections with epoll, speaking either the original
+		protocol (a connection per message) or the framed one (messages
+		on long-lived connections, with -P packed sending its chunks 5
+		bits per char), over TCP (to a port on localhost or host:port,
+		with the TCP options given to -T) or a daemon's Unix socket, or
+		(-P ring) passing messages through shared memory ring sessions
+		on the daemon's ring socket. In closed loop (the default) each
+		connection sends its next message as soon as the last reply is
+		in. In open loop (-r) messages arrive at random (Poisson) times at
+		the given rate whether or not the daemon keeps up, and latency
+		counts from when a message was due, so a stalled daemon shows up
+		in the tail instead of quietly slowing the load down. Message
+		sizes are fixed, uniform over a range or exponential. Latencies go
+		into an HDR-style histogram (log-linear buckets under 1% apart),
+		which is summarised on stdout and can be written out in the
+		HdrHistogram percentile format (-H). otpsuite.bash runs it against
+		a set of daemon configurations.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "otp_proto.h"
+#include "otp_cipher.h"
+#include "otp_net.h"
+
+#define MAX_CONNECTIONS 4096
+#define MAX_MESSAGE (16 << 20)		// Longest message the size options may ask for
+#define MAX_EVENTS 256
+#define PENDING_SLOTS (1 << 20)		// Open loop messages waiting for a free connection
+#define SCRATCH_SIZE (1 << 20)		// Replies are read here and dropped
+
+// Histogram layout: values (in nanoseconds) below 2 * HIST_SUB are kept
+// exactly, and above that each power of two is split into HIST_SUB linear
+// buckets, so no bucket is more than 1% wide
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+// Message size distributions (-s)
+#define SIZES_FIXED   0		// N
+#define SIZES_UNIFORM 1		// MIN-MAX
+#define SIZES_EXP     2		// exp:MEAN
+
+// Connection phases
+#define CLIENT_IDLE      0	// Free: not connected, or framed and connected with no message
+#define CLIENT_CONNECT   1	// Waiting for the connect to finish
+#define CLIENT_HANDSHAKE 2	// Sending the identifier and waiting for the answer
+#define CLIENT_REQUEST   3	// Sending a message and reading its reply
+#define CLIENT_CLOSING   4	// Reply in, waiting for the daemon to hang up (original protocol)
+
+// Kinds of failed messages
+#define ERR_CONNECT  0	// Could not connect
+#define ERR_REFUSED  1	// Handshake answered NO
+#define ERR_BUSY     2	// Handshake answered BZ, or a frame came back STATUS_BUSY
+#define ERR_STATUS   3	// A frame came back with any other status
+#define ERR_DROPPED  4	// Connection closed or reset before the reply was in
+#define ERR_BACKLOG  5	// Open loop message with no room to wait for a connection
+#define ERR_KINDS    6
+
+static const char *errorNames[ERR_KINDS] = {"connect", "refused", "busy", "status", "dropped", "backlog"};
+
+struct Histogram {
+	unsigned long counts[HIST_BUCKETS];
+	unsigned long total;
+	long long max;
+	double sum, sumSquares;
+};
+
+// One connection slot
+struct Client {
+	int fd;
+	int phase;				// One of the CLIENT_ phases above
+	int connected;			// Framed: handshake done, so the connection can be reused
+	int busy;				// 1 while a message is assigned
+	int events;				// epoll events registered
+	struct iovec *iov;		// What is left to send
+	int iovCount, iovIndex;
+	unsigned char *headers;	// Frame headers for the message being sent
+	int lengthField;		// Message size field (original protocol)
+	char answer[2];			// Handshake answer
+	size_t answerDone;
+	size_t replyLeft;		// Reply chars still to come (original protocol)
+	unsigned char header[FRAME_HEADER_SIZE];	// Reply frame header being read
+	size_t headerDone, chunkLeft;
+	long long start;		// When the message was due (ns)
+	size_t chars;			// Message size
+	int ringSocket;			// Ring session socket; fd is then the completion eventfd
+	int submitFD;			// Ring submit eventfd
+	struct RingHeader *ring;	// Mapped ring, or NULL
+	size_t ringSize;
+	uint32_t ringHead;		// Slots posted
+};
+
+// Settings and state for a run
+struct Load {
+	int framed, packed, ring, connections;
+	struct sockaddr_storage address;	// Daemon address, resolved once
+	socklen_t addressLen;
+	struct NetTuning tuning;	// TCP options for each connection (-T)
+	const char *unixPath;	// Daemon socket path instead of a port, or NULL
+	char op;
+	double rate;			// Messages per second in open loop, 0 for closed loop
+	long long duration, warmup;	// ns
+	int sizes;				// One of the SIZES_ kinds
+	size_t minSize, maxSize;
+	double meanSize;
+	uint64_t rng;
+
+	int epollFD;
+	struct Client *clients;
+	int *idle, idleCount;	// Free connection slots
+	char *text, *key, *scratch;
+	unsigned char *packedText, *packedKey;	// The text and key packed (-P packed)
+	long long measureFrom, end, nextArrival;
+	long long *pending;		// Due times of open loop messages waiting for a slot
+	unsigned long pendingHead, pendingTail, pendingPeak;
+
+	unsigned long messages, chars, errors[ERR_KINDS];
+	struct Histogram hist;
+};
+
+// Error function used for reporting issues with custom exit value
+static void error(const char *msg, int exitVal) {
+	fprintf(stderr, "ERROR: %s\n", msg);
+	exit(exitVal);
+}
+
+// Returns the current time in nanoseconds from a monotonic clock
+static long long NowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// xorshift64*: fast, and repeatable for a given seed
+static uint64_t Random(struct Load *load) {
+	load->rng ^= load->rng >> 12;
+	load->rng ^= load->rng << 25;
+	load->rng ^= load->rng >> 27;
+	return load->rng * 0x2545F4914F6CDD1DULL;
+}
+
+// Returns a random number in [0, 1)
+static double RandomUnit(struct Load *load) {
+	return (Random(load) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Draws the size of the next message
+static size_t NextSize(struct Load *load) {
+	size_t size;
+
+	switch (load->sizes) {
+		case SIZES_UNIFORM:
+			return load->minSize + Random(load) % (load->maxSize - load->minSize + 1);
+		case SIZES_EXP:
+			size = (size_t)(-log(1.0 - RandomUnit(load)) * load->meanSize) + 1;
+			return size > load->maxSize ? load->maxSize : size;
+	}
+	return load->minSize;
+}
+
+// Reads a size distribution: N, MIN-MAX or exp:MEAN. Returns 0, or -1 if
+// it makes no sense.
+static int ParseSizes(struct Load *load, const char *spec) {
+	char *end;
+
+	if (strncmp(spec, "exp:", 4) == 0) {
+		load->sizes = SIZES_EXP;
+		load->meanSize = strtod(spec + 4, &end);
+		if (*end != '\0' || load->meanSize < 1) return -1;
+		load->minSize = 1;
+		load->maxSize = load->meanSize * 20 < MAX_MESSAGE ? (size_t)(load->meanSize * 20) : MAX_MESSAGE;
+		return 0;
+	}
+
+	load->minSize = load->maxSize = strtoul(spec, &end, 10);
+	load->sizes = SIZES_FIXED;
+	if (*end == '-') {
+		load->sizes = SIZES_UNIFORM;
+		load->maxSize = strtoul(end + 1, &end, 10);
+	}
+	if (*end != '\0' || load->minSize < 1 || load->maxSize < load->minSize || load->maxSize > MAX_MESSAGE) return -1;
+	load->meanSize = (load->minSize + load->maxSize) / 2.0;
+	return 0;
+}
+
+// Returns the histogram bucket a value falls in
+static int BucketIndex(long long value) {
+	int magnitude;
+
+	if (value < 2 * HIST_SUB) return value < 0 ? 0 : (int)value;
+	magnitude = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return magnitude * HIST_SUB + (int)(value >> magnitude);
+}
+
+// Returns the highest value that falls in a histogram bucket
+static long long BucketValue(int index) {
+	int magnitude;
+
+	if (index < 2 * HIST_SUB) return index;
+	magnitude = index / HIST_SUB - 1;
+	return ((long long)(index - magnitude * HIST_SUB + 1) << magnitude) - 1;
+}
+
+static void HistRecord(struct Histogram *hist, long long value) {
+	hist->counts[BucketIndex(value)]++;
+	hist->total++;
+	hist->sum += value;
+	hist->sumSquares += (double)value * value;
+	if (value > hist->max) hist->max = value;
+}
+
+// Returns the value at a percentile (0 to 100)
+static long long HistPercentile(const struct Histogram *hist, double percentile) {
+	unsigned long target = (unsigned long)ceil(percentile / 100.0 * hist->total), cumulative = 0;
+	long long value;
+	int i;
+
+	if (hist->total == 0) return 0;
+	if (target < 1) target = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		cumulative += hist->counts[i];
+		if (cumulative >= target) break;
+	}
+	value = BucketValue(i < HIST_BUCKETS ? i : HIST_BUCKETS - 1);
+	return value < hist->max ? value : hist->max;
+}
+
+// Writes the histogram in the HdrHistogram percentile distribution format
+// (values in milliseconds), which the HdrHistogram plotter reads
+static void WriteHistogram(const struct Histogram *hist, const char *path) {
+	FILE *file = fopen(path, "w");
+	unsigned long cumulative = 0;
+	double level = 0, mean, deviation, halfDistance;
+	int i;
+
+	if (file == NULL) error("could not write histogram file", 1);
+	mean = hist->total ? hist->sum / hist->total : 0;
+	deviation = hist->total ? sqrt(hist->sumSquares / hist->total - mean * mean) : 0;
+
+	fprintf(file, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+	for (i = 0; i < HIST_BUCKETS && cumulative < hist->total; i++) {
+		if (hist->counts[i] == 0) continue;
+		cumulative += hist->counts[i];
+
+		// Report levels get closer together towards the tail, 5 ticks for
+		// every halving of the distance to 100%
+		while (level < 100 && cumulative * 100.0 >= level * hist->total) {
+			fprintf(file, "%12.3f %2.12f %10lu %14.2f\n", BucketValue(i) / 1e6, level / 100, cumulative,
+				1 / (1 - level / 100));
+			if (cumulative == hist->total) break;
+			halfDistance = pow(2, floor(log2(100 / (100 - level))) + 1);
+			level += 100 / (5 * halfDistance);
+		}
+	}
+	fprintf(file, "%12.3f %2.12f %10lu\n", hist->max / 1e6, 1.0, hist->total);
+	fprintf(file, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1e6, deviation / 1e6);
+	fprintf(file, "#[Max     = %12.3f, Total count    = %12lu]\n", hist->max / 1e6, hist->total);
+	fprintf(file, "#[Buckets = %12d, SubBuckets     = %12d]\n", HIST_BUCKETS / HIST_SUB, HIST_SUB);
+	fclose(file);
+}
+
+// Changes the epoll events a client is registered for
+static void Watch(struct Load *load, struct Client *client, int events) {
+	struct epoll_event event;
+
+	if (events == client->events) return;
+	memset(&event, '\0', sizeof(event));
+	event.events = events;
+	event.data.ptr = client;
+	if (epoll_ctl(load->epollFD, client->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, client->fd, &event) < 0)
+		error("could not register with epoll", 1);
+	client->events = events;
+}
+
+// Closes a client's connection and frees its slot
+static void Release(struct Load *load, struct Client *client) {
+	if (client->fd >= 0) close(client->fd); // Closing also removes it from epoll
+	client->fd = -1;
+	if (client->ring != NULL) {
+		close(client->ringSocket);
+		close(client->submitFD);
+		munmap(client->ring, client->ringSize);
+		client->ring = NULL;
+	}
+	client->events = 0;
+	client->connected = 0;
+	client->busy = 0;
+	client->phase = CLIENT_IDLE;
+	load->idle[load->idleCount++] = client - load->clients;
+}
+
+// Gives up on a client's message, counting why unless still warming up
+static void Fail(struct Load *load, struct Client *client, int kind) {
+	if (NowNs() >= load->measureFrom) load->errors[kind]++;
+	Release(load, client);
+}
+
+// Adds a block to send, skipping empty ones
+static void AddIov(struct Client *client, const void *base, size_t len) {
+	if (len == 0) return;
+	client->iov[client->iovCount].iov_base = (void *)base;
+	client->iov[client->iovCount].iov_len = len;
+	client->iovCount++;
+}
+
+// Lays out the client's message to send, without copying the text or key
+static void BuildRequest(struct Load *load, struct Client *client) {
+	struct FrameHeader header;
+	size_t n = client->chars, offset, chunk;
+	unsigned char *packed;
+
+	client->iovCount = client->iovIndex = 0;
+	client->phase = CLIENT_REQUEST;
+	if (!load->framed) {
+		client->lengthField = (int)n + 1; // The size counts the newline
+		AddIov(client, &client->lengthField, sizeof(client->lengthField));
+		AddIov(client, load->text, n);
+		AddIov(client, load->key, n);
+		client->replyLeft = n;
+		return;
+	}
+
+	for (offset = 0, packed = client->headers; offset < n; offset += chunk, packed += FRAME_HEADER_SIZE) {
+		chunk = n - offset < STREAM_CHUNK_SIZE ? n - offset : STREAM_CHUNK_SIZE;
+		header.op = load->op;
+		header.flags = (offset + chunk == n) ? FRAME_LAST : 0;
+		header.status = STATUS_OK;
+		header.length = chunk;
+		PackFrameHeader(packed, &header);
+		AddIov(client, packed, FRAME_HEADER_SIZE);
+
+		// Chunks start a multiple of 8 chars in, so each one's packed
+		// bytes start on a byte in the text and key packed as a whole
+		if (load->packed) {
+			AddIov(client, load->packedText + PACKED_SIZE(offset), PACKED_SIZE(chunk));
+			AddIov(client, load->packedKey + PACKED_SIZE(offset), PACKED_SIZE(chunk));
+		}
+		else {
+			AddIov(client, load->text + offset, chunk);
+			AddIov(client, load->key + offset, chunk);
+		}
+	}
+	client->headerDone = client->chunkLeft = 0;
+}
+
+// Starts the handshake on a freshly connected client
+static void StartHandshake(struct Load *load, struct Client *client) {
+	const char *id;
+
+	if (load->packed) id = load->op == OP_ENCODE ? ID_ENCODE_PACKED : ID_DECODE_PACKED;
+	else if (load->framed) id = load->op == OP_ENCODE ? ID_ENCODE_STREAM : ID_DECODE_STREAM;
+	else id = load->op == OP_ENCODE ? ID_ENCODE : ID_DECODE;
+	client->iovCount = client->iovIndex = 0;
+	AddIov(client, id, 3);
+	client->answerDone = 0;
+	client->phase = CLIENT_HANDSHAKE;
+}
+
+// Works out the daemon's address from the target: a Unix socket path, or
+// a port on localhost or host:port, resolved once for every connection
+static void SetTarget(struct Load *load, const char *target) {
+	struct sockaddr_un *unixAddress = (struct sockaddr_un *)&load->address;
+	struct addrinfo *addresses;
+	char host[NET_HOST_SIZE], message[NET_HOST_SIZE + 64];
+	const char *port, *failure;
+
+	// A target with a slash in it is a Unix socket, which ring sessions need
+	if (strchr(target, '/') != NULL) {
+		load->unixPath = target;
+		if (strlen(target) >= sizeof(unixAddress->sun_path)) error("Unix socket path is too long", 1);
+		unixAddress->sun_family = AF_UNIX;
+		strcpy(unixAddress->sun_path, target);
+		load->addressLen = sizeof(*unixAddress);
+		return;
+	}
+
+	if (SplitEndpoint(target, host, sizeof(host), &port) < 0) error("bad port", 1);
+	addresses = ResolveEndpoint(host[0] != '\0' ? host : NET_DEFAULT_HOST, port, 0, &failure);
+	if (addresses == NULL) {
+		snprintf(message, sizeof(message), "could not resolve %s: %s", target, failure);
+		error(message, 1);
+	}
+	memcpy(&load->address, addresses->ai_addr, addresses->ai_addrlen);
+	load->addressLen = addresses->ai_addrlen;
+	freeaddrinfo(addresses);
+}
+
+// Opens a non-blocking connection to the daemon
+static void OpenConn(struct Load *load, struct Client *client) {
+	client->fd = socket(load->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (client->fd < 0) error("could not open socket", 1);
+	if (load->unixPath == NULL) TuneSocket(client->fd, &load->tuning); // As otp_enc and otp_dec do
+	client->events = 0;
+	if (connect(client->fd, (struct sockaddr *)&load->address, load->addressLen) == 0) StartHandshake(load, client);
+	else if (errno == EINPROGRESS) client->phase = CLIENT_CONNECT;
+	else {
+		Fail(load, client, ERR_CONNECT);
+		return;
+	}
+}
+
+// Records a finished message and frees or keeps the connection
+static void Complete(struct Load *load, struct Client *client) {
+	long long now = NowNs();
+
+	if (now >= load->measureFrom) {
+		HistRecord(&load->hist, now - client->start);
+		load->messages++;
+		load->chars += client->chars;
+	}
+	client->busy = 0;
+
+	// Framed connections and ring sessions are kept for the next message. With the original
+	// protocol the daemon hangs up first, which leaves TIME_WAIT on its side
+	// rather than using up local ports.
+	if (load->framed || load->ring) {
+		client->phase = CLIENT_IDLE;
+		load->idle[load->idleCount++] = client - load->clients;
+	}
+	else client->phase = CLIENT_CLOSING;
+}
+
+// Takes in reply bytes. Returns 0 to keep driving the client, or -1 once it
+// has stopped (failed, or done with its message).
+static int Received(struct Load *load, struct Client *client, const char *data, size_t n) {
+	struct FrameHeader reply;
+	size_t pos = 0, take;
+
+	if (!load->framed) {
+		if (n > client->replyLeft) {
+			Fail(load, client, ERR_DROPPED);
+			return -1;
+		}
+		client->replyLeft -= n;
+		if (client->replyLeft == 0) Complete(load, client);
+		return 0;
+	}
+
+	while (pos < n) {
+		// Frame header, checked as soon as it is whole
+		if (client->headerDone < FRAME_HEADER_SIZE) {
+			take = FRAME_HEADER_SIZE - client->headerDone;
+			if (take > n - pos) take = n - pos;
+			memcpy(client->header + client->headerDone, data + pos, take);
+			client->headerDone += take;
+			pos += take;
+			if (client->headerDone < FRAME_HEADER_SIZE) break;
+			UnpackFrameHeader(client->header, &reply);
+			if (reply.status != STATUS_OK) {
+				Fail(load, client, reply.status == STATUS_BUSY ? ERR_BUSY : ERR_STATUS);
+				return -1;
+			}
+			client->chunkLeft = load->packed ? PACKED_SIZE(reply.length) : reply.length;
+		}
+
+		// Its chunk, dropped
+		take = client->chunkLeft < n - pos ? client->chunkLeft : n - pos;
+		client->chunkLeft -= take;
+		pos += take;
+		if (client->chunkLeft == 0) {
+			client->headerDone = 0;
+			UnpackFrameHeader(client->header, &reply);
+			if (reply.flags & FRAME_LAST) {
+				Complete(load, client);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+// Moves a client along for as long as its socket allows, then waits for
+// the socket to be ready in whichever direction is still needed
+static void Drive(struct Load *load, struct Client *client) {
+	struct msghdr msg;
+	char *buf;
+	size_t len;
+	ssize_t tempChars;
+	int progress, err;
+	socklen_t errLen = sizeof(err);
+
+	if (client->phase == CLIENT_CONNECT) {
+		if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0 || err == EINPROGRESS) err = EINPROGRESS;
+		if (err == EINPROGRESS) {
+			Watch(load, client, EPOLLOUT);
+			return;
+		}
+		if (err != 0) {
+			Fail(load, client, ERR_CONNECT);
+			return;
+		}
+		StartHandshake(load, client);
+	}
+
+	do {
+		progress = 0;
+
+		// Send what is left, IOV_MAX blocks at a time
+		if (client->iovIndex < client->iovCount) {
+			memset(&msg, '\0', sizeof(msg));
+			msg.msg_iov = client->iov + client->iovIndex;
+			msg.msg_iovlen = client->iovCount - client->iovIndex;
+			if (msg.msg_iovlen > IOV_MAX) msg.msg_iovlen = IOV_MAX;
+			tempChars = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+			if (tempChars < 0 && errno != EAGAIN && errno != EINTR) {
+				Fail(load, client, ERR_DROPPED);
+				return;
+			}
+			while (tempChars > 0) {
+				progress = 1;
+				len = client->iov[client->iovIndex].iov_len;
+				if ((size_t)tempChars >= len) {
+					client->iovIndex++;
+					tempChars -= len;
+				}
+				else {
+					client->iov[client->iovIndex].iov_base = (char *)client->iov[client->iovIndex].iov_base + tempChars;
+					client->iov[client->iovIndex].iov_len -= tempChars;
+					tempChars = 0;
+				}
+			}
+		}
+
+		// Read what has come: the handshake answer, or reply bytes
+		if (client->phase == CLIENT_HANDSHAKE) {
+			buf = client->answer + client->answerDone;
+			len = sizeof(client->answer) - client->answerDone;
+		}
+		else {
+			buf = load->scratch;
+			len = SCRATCH_SIZE;
+		}
+		tempChars = recv(client->fd, buf, len, 0);
+		if (tempChars == 0 || (tempChars < 0 && errno != EAGAIN && errno != EINTR)) {
+			// The daemon hanging up after a whole reply is how the original
+			// protocol ends
+			if (client->phase == CLIENT_CLOSING) Release(load, client);
+			else Fail(load, client, ERR_DROPPED);
+			return;
+		}
+		if (tempChars < 0) continue;
+		progress = 1;
+
+		if (client->phase == CLIENT_HANDSHAKE) {
+			client->answerDone += tempChars;
+			if (client->answerDone < sizeof(client->answer)) continue;
+			if (memcmp(client->answer, "OK", 2) != 0) {
+				Fail(load, client, memcmp(client->answer, ID_BUSY, 2) == 0 ? ERR_BUSY : ERR_REFUSED);
+				return;
+			}
+			client->connected = 1;
+			BuildRequest(load, client);
+		}
+		else if (client->phase == CLIENT_REQUEST) {
+			if (Received(load, client, buf, tempChars) < 0) return;
+		}
+	} while (progress);
+
+	Watch(load, client, EPOLLIN | (client->iovIndex < client->iovCount ? EPOLLOUT : 0));
+}
+
+// Sets up a ring session big enough for the largest message, the way
+// otp_enc --ring does: a sealed memfd and two eventfds passed with the
+// handshake. This blocks, but only happens on a client's first message.
+// Returns 0, or the ERR_ kind it failed with.
+static int OpenRing(struct Load *load, struct Client *client) {
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct sockaddr_un address;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char answer[2];
+	int fds[3], ok;
+
+	client->ringSize = RING_HEADER_SIZE + 2 * load->maxSize;
+	fds[0] = memfd_create("otpload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fds[0] < 0 || ftruncate(fds[0], client->ringSize) < 0 || fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+		error("could not create ring", 1);
+	client->ring = mmap(NULL, client->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if (client->ring == MAP_FAILED) error("could not map ring", 1);
+	client->ring->magic = RING_MAGIC;
+	client->ring->dataSize = 2 * load->maxSize;
+	client->ringHead = 0;
+	fds[1] = client->submitFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	fds[2] = client->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	client->ringSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fds[1] < 0 || fds[2] < 0 || client->ringSocket < 0) error("could not create ring", 1);
+	client->events = 0;
+
+	memset(&address, '\0', sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, load->unixPath);
+	memset(&msg, '\0', sizeof(msg));
+	iov.iov_base = (void *)ID_RING;
+	iov.iov_len = 3;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	ok = connect(client->ringSocket, (struct sockaddr *)&address, sizeof(address)) == 0 &&
+		sendmsg(client->ringSocket, &msg, MSG_NOSIGNAL) == 3;
+	close(fds[0]); // The daemon has its own reference now
+	if (!ok) return ERR_CONNECT;
+	if (recv(client->ringSocket, answer, 2, MSG_WAITALL) != 2) return ERR_DROPPED;
+	if (memcmp(answer, "OK", 2) != 0) return ERR_REFUSED;
+	client->connected = 1;
+	return 0;
+}
+
+// Copies the client's message into its ring and rings the daemon
+static void PostRing(struct Load *load, struct Client *client) {
+	struct RingSlot *slot = &client->ring->slots[client->ringHead % RING_SLOTS];
+	char *data = (char *)client->ring + RING_HEADER_SIZE;
+	uint64_t count = 1;
+
+	memcpy(data, load->text, client->chars);
+	memcpy(data + client->chars, load->key, client->chars);
+	slot->offset = 0;
+	slot->length = client->chars;
+	slot->op = load->op;
+	slot->status = STATUS_OK;
+	client->phase = CLIENT_REQUEST;
+	__atomic_store_n(&client->ring->head, ++client->ringHead, __ATOMIC_RELEASE);
+	if (write(client->submitFD, &count, sizeof(count)) != sizeof(count)) {
+		Fail(load, client, ERR_DROPPED);
+		return;
+	}
+	Watch(load, client, EPOLLIN);
+}
+
+// Finishes a ring client's message once the daemon has caught up with it
+static void DriveRing(struct Load *load, struct Client *client) {
+	struct RingSlot *slot;
+	uint64_t count;
+
+	if (read(client->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		Fail(load, client, ERR_DROPPED);
+		return;
+	}
+	if (client->phase != CLIENT_REQUEST || __atomic_load_n(&client->ring->tail, __ATOMIC_ACQUIRE) != client->ringHead) return;
+	slot = &client->ring->slots[(client->ringHead - 1) % RING_SLOTS];
+	if (slot->status != STATUS_OK) Fail(load, client, slot->status == STATUS_BUSY ? ERR_BUSY : ERR_STATUS);
+	else Complete(load, client);
+}
+
+// Hands a message due at the given time to a free client
+static void StartMessage(struct Load *load, struct Client *client, long long due) {
+	int kind;
+
+	client->busy = 1;
+	client->start = due;
+	client->chars = NextSize(load);
+	if (load->ring) {
+		if (!client->connected && (kind = OpenRing(load, client)) != 0) Fail(load, client, kind);
+		else PostRing(load, client);
+		return;
+	}
+	if (!client->connected) {
+		OpenConn(load, client);
+		if (client->fd < 0) return;
+	}
+	else BuildRequest(load, client);
+	Drive(load, client);
+}
+
+// Gives free clients their next messages: straight away in closed loop,
+// or the oldest waiting ones in open loop. A client that fails at once is
+// left for the next pass.
+static void Dispatch(struct Load *load, long long now) {
+	int count = load->idleCount;
+	long long due;
+
+	while (count-- > 0 && load->idleCount > 0) {
+		if (load->rate > 0) {
+			if (load->pendingHead == load->pendingTail) return;
+			due = load->pending[load->pendingHead++ % PENDING_SLOTS];
+		}
+		else due = now;
+		StartMessage(load, &load->clients[load->idle[--load->idleCount]], due);
+	}
+}
+
+// Queues the open loop messages that have come due by now
+static void Arrivals(struct Load *load, long long now) {
+	while (load->nextArrival <= now && load->nextArrival < load->end) {
+		if (load->pendingTail - load->pendingHead >= PENDING_SLOTS) {
+			if (load->nextArrival >= load->measureFrom) load->errors[ERR_BACKLOG]++;
+		}
+		else load->pending[load->pendingTail++ % PENDING_SLOTS] = load->nextArrival;
+		if (load->pendingTail - load->pendingHead > load->pendingPeak) load->pendingPeak = load->pendingTail - load->pendingHead;
+		load->nextArrival += (long long)(-log(1.0 - RandomUnit(load)) / load->rate * 1e9);
+	}
+}
+
+// Runs the load until the duration is up
+static void Run(struct Load *load) {
+	struct epoll_event events[MAX_EVENTS];
+	struct timespec timeout;
+	long long now, wake;
+	int i, numEvents;
+	size_t frames = load->maxSize / STREAM_CHUNK_SIZE + 1;
+
+	// Buffers: any valid text and key will do
+	load->text = malloc(load->maxSize);
+	load->key = malloc(load->maxSize);
+	load->scratch = malloc(SCRATCH_SIZE);
+	load->clients = calloc(load->connections, sizeof(struct Client));
+	load->idle = malloc(load->connections * sizeof(int));
+	load->pending = load->rate > 0 ? malloc(PENDING_SLOTS * sizeof(long long)) : NULL;
+	if (!load->text || !load->key || !load->scratch || !load->clients || !load->idle || (load->rate > 0 && !load->pending))
+		error("could not allocate buffers", 1);
+	for (i = 0; i < (int)load->maxSize; i++) {
+		load->text[i] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ "[Random(load) % 27];
+		load->key[i] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ "[Random(load) % 27];
+	}
+	if (load->packed) {
+		load->packedText = malloc(PACKED_SIZE(load->maxSize));
+		load->packedKey = malloc(PACKED_SIZE(load->maxSize));
+		if (!load->packedText || !load->packedKey) error("could not allocate buffers", 1);
+		PackText(load->packedText, load->text, load->maxSize);
+		PackText(load->packedKey, load->key, load->maxSize);
+	}
+	for (i = 0; i < load->connections; i++) {
+		load->clients[i].fd = -1;
+		load->clients[i].iov = malloc(3 * frames * sizeof(struct iovec));
+		load->clients[i].headers = malloc(frames * FRAME_HEADER_SIZE);
+		if (!load->clients[i].iov || !load->clients[i].headers) error("could not allocate buffers", 1);
+		load->idle[load->idleCount++] = load->connections - 1 - i;
+	}
+
+	load->epollFD = epoll_create1(EPOLL_CLOEXEC);
+	if (load->epollFD < 0) error("could not create epoll instance", 1);
+
+	now = NowNs();
+	load->measureFrom = now + load->warmup;
+	load->end = load->measureFrom + load->duration;
+	load->nextArrival = now;
+
+	while ((now = NowNs()) < load->end) {
+		if (load->rate > 0) Arrivals(load, now);
+		Dispatch(load, now);
+
+		// Sleep until the next message is due, or the run is over. Messages
+		// that finished inside Dispatch may have left clients to start
+		// straight away, and open loop arrivals need better than
+		// millisecond timing, hence epoll_pwait2.
+		wake = load->end;
+		if (load->rate > 0 && load->nextArrival < wake) wake = load->nextArrival;
+		if (load->idleCount > 0 && (load->rate == 0 || load->pendingHead != load->pendingTail)) wake = now;
+		timeout.tv_sec = wake > now ? (wake - now) / 1000000000LL : 0;
+		timeout.tv_nsec = wake > now ? (wake - now) % 1000000000LL : 0;
+
+		numEvents = epoll_pwait2(load->epollFD, events, MAX_EVENTS, &timeout, NULL);
+		if (numEvents < 0) {
+			if (errno == EINTR) continue;
+			error("epoll_pwait2 failed", 1);
+		}
+		for (i = 0; i < numEvents; i++) {
+			if (load->ring) DriveRing(load, events[i].data.ptr);
+			else Drive(load, events[i].data.ptr);
+		}
+	}
+}
+
+// Prints the results, either readably or as one line of key=value pairs
+static void Report(struct Load *load, int terse) {
+	struct Histogram *hist = &load->hist;
+	double seconds = load->duration / 1e9, mean = hist->total ? hist->sum / hist->total / 1e3 : 0;
+	unsigned long errors = 0;
+	int i;
+
+	for (i = 0; i < ERR_KINDS; i++) errors += load->errors[i];
+	if (terse) {
+		printf("messages=%lu errors=%lu rps=%.1f mbps=%.2f mean_us=%.1f p50_us=%.1f p90_us=%.1f p99_us=%.1f "
+			"p999_us=%.1f max_us=%.1f\n", load->messages, errors, load->messages / seconds,
+			load->chars / seconds / 1e6, mean, HistPercentile(hist, 50) / 1e3, HistPercentile(hist, 90) / 1e3,
+			HistPercentile(hist, 99) / 1e3, HistPercentile(hist, 99.9) / 1e3, hist->max / 1e3);
+		return;
+	}
+
+	printf("%lu messages, %lu chars in %.1f s: %.1f messages/s, %.2f MB/s\n", load->messages, load->chars,
+		seconds, load->messages / seconds, load->chars / seconds / 1e6);
+	printf("latency (us): mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  p99.99 %.1f  max %.1f\n",
+		mean, HistPercentile(hist, 50) / 1e3, HistPercentile(hist, 90) / 1e3, HistPercentile(hist, 99) / 1e3,
+		HistPercentile(hist, 99.9) / 1e3, HistPercentile(hist, 99.99) / 1e3, hist->max / 1e3);
+	if (load->rate > 0) printf("open loop: %.1f messages/s offered, at most %lu waiting for a connection\n",
+		load->rate, load->pendingPeak);
+	printf("errors: %lu", errors);
+	for (i = 0; i < ERR_KINDS; i++) {
+		if (load->errors[i] > 0) printf("  %s %lu", errorNames[i], load->errors[i]);
+	}
+	printf("\n");
+}
+
+// Prints the load generator usage message and exits
+static void Usage(const char *prog) {
+	fprintf(stderr, "USAGE: %s [-P legacy|framed|packed|ring] [-o encode|decode] [-c connections] [-r rate]\n"
+		"\t[-d seconds] [-w warmupseconds] [-s N|MIN-MAX|exp:MEAN] [-S seed] [-H histfile]\n"
+		"\t[-T nodelay=0|1,sndbuf=N,rcvbuf=N] [-t] [host:]port|socket\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	struct Load *load = calloc(1, sizeof(struct Load));
+	const char *histPath = NULL;
+	int opt, terse = 0;
+
+	if (load == NULL) error("could not allocate load", 1);
+	load->framed = 1;
+	load->op = OP_ENCODE;
+	load->connections = 16;
+	load->duration = 10 * 1000000000LL;
+	load->warmup = 1000000000LL;
+	load->rng = 1;
+	load->tuning.noDelay = 1;
+	ParseSizes(load, "1000");
+
+	// Check user input format
+	while ((opt = getopt(argc, argv, "P:o:c:r:d:w:s:S:H:T:t")) != -1) {
+		switch (opt) {
+			case 'P':
+				load->ring = load->packed = 0;
+				if (strcmp(optarg, "legacy") == 0) load->framed = 0;
+				else if (strcmp(optarg, "framed") == 0) load->framed = 1;
+				else if (strcmp(optarg, "packed") == 0) load->framed = load->packed = 1;
+				else if (strcmp(optarg, "ring") == 0) {
+					load->framed = 0;
+					load->ring = 1;
+				}
+				else Usage(argv[0]);
+				break;
+			case 'o':
+				if (strcmp(optarg, "encode") == 0) load->op = OP_ENCODE;
+				else if (strcmp(optarg, "decode") == 0) load->op = OP_DECODE;
+				else Usage(argv[0]);
+				break;
+			case 'c':
+				load->connections = atoi(optarg);
+				if (load->connections < 1 || load->connections > MAX_CONNECTIONS) Usage(argv[0]);
+				break;
+			case 'r':
+				// Open loop rate in messages per second (0 for closed loop)
+				load->rate = atof(optarg);
+				if (load->rate < 0) Usage(argv[0]);
+				break;
+			case 'd':
+				load->duration = (long long)(atof(optarg) * 1e9);
+				if (load->duration <= 0) Usage(argv[0]);
+				break;
+			case 'w':
+				load->warmup = (long long)(atof(optarg) * 1e9);
+				if (load->warmup < 0) Usage(argv[0]);
+				break;
+			case 's':
+				if (ParseSizes(load, optarg) < 0) Usage(argv[0]);
+				break;
+			case 'S':
+				load->rng = strtoull(optarg, NULL, 10) | 1; // xorshift needs a non-zero state
+				break;
+			case 'H': histPath = optarg; break;
+			case 'T':
+				if (ParseTuning(&load->tuning, optarg) < 0) Usage(argv[0]);
+				break;
+			case 't': terse = 1; break;
+			default: Usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) Usage(argv[0]);
+
+	SetTarget(load, argv[optind]);
+	if (load->ring && load->unixPath == NULL) Usage(argv[0]);
+
+	Run(load);
+	Report(load, terse);
+	if (histPath != NULL) WriteHistogram(&load->hist, histPath);
+	return 0;
+}
@@ -0,0 +1,171 @@
+#!/bin/bash
+# File: otpsuite.bash
+# Author: Adeline Harcourt
+# Description: Runs otpload against otp_d in a set of configurations on
+#	localhost and compares the results with a baseline file, so a change
+#	that costs throughput or latency shows up before it is deployed. Each
+#	configuration (engine, workers, shards) meets each workload (closed
+#	loop on both protocols, packed frames and a mix of sizes, plus an
+#	open loop at a fixed rate to watch the tail). Large messages are also run over the
+#	daemon's Unix socket and through shared memory rings, to show what
+#	the TCP stack costs local clients. Exits with status 1 if any figure
+#	regressed or any request failed. If the baseline file does not exist
+#	(or -u is given) the results are saved as the new baseline, unless
+#	some requests failed. Run it from the directory holding otp_d and
+#	otpload after compileall.
+
+usage="usage: $0 [-d seconds] [-b baselinefile] [-u] [-p port]"
+
+# Allowed slack before a figure counts as a regression, as in otpbench:
+# throughput may drop by RPS_DROP of the baseline, and latency may grow by
+# a ratio plus an absolute amount so small baselines do not trip on noise
+RPS_DROP=0.25
+P50_RATIO=2.0
+P50_SLACK=100		# microseconds
+P99_RATIO=3.0
+P99_SLACK=5000		# microseconds
+
+# Daemon configurations: name and otp_d options
+configs=(
+	"fork|-e fork"
+	"prefork|-e prefork"
+	"epoll|-e epoll"
+	"epoll-1w|-e epoll -w 1"
+	"uring|-e uring"
+	"shards|-e epoll -s 2"
+)
+
+# Workloads: name, otpload options and what to connect to (the TCP port
+# unless it says unix or ring)
+workloads=(
+	"legacy-1k|-P legacy -c 16 -s 1000"
+	"framed-1k|-P framed -c 16 -s 1000"
+	"framed-mix|-P framed -c 16 -s exp:8000"
+	"framed-64k|-P framed -c 8 -s 65536"
+	"packed-64k|-P packed -c 8 -s 65536"
+	"tcp-70k|-P framed -c 8 -s 70000"
+	"unix-70k|-P framed -c 8 -s 70000|unix"
+	"ring-70k|-P ring -c 8 -s 70000|ring"
+	"open-2k/s|-P framed -c 64 -r 2000 -s 1000-20000"
+)
+
+duration=3
+baseline=otpsuite.baseline
+port=52700
+update=0
+
+while getopts "d:b:up:" opt
+do
+	case $opt in
+		d) duration=$OPTARG ;;
+		b) baseline=$OPTARG ;;
+		u) update=1 ;;
+		p) port=$OPTARG ;;
+		*) echo "$usage" 1>&2; exit 1 ;;
+	esac
+done
+
+if [ ! -x ./otp_d -o ! -x ./otpload ]
+then
+	echo "run compileall first" 1>&2
+	exit 1
+fi
+if [ ! -f "$baseline" ]
+then
+	update=1
+fi
+
+# Reads one key=value figure out of an otpload -t line
+figure() {
+	echo "$1" | tr ' ' '\n' | sed -n "s/^$2=//p"
+}
+
+# Prints 1 if the figures regressed against the baseline ones, else 0
+regressed() {
+	awk -v rps="$1" -v p50="$2" -v p99="$3" -v brps="$4" -v bp50="$5" -v bp99="$6" \
+		-v drop=$RPS_DROP -v r50=$P50_RATIO -v s50=$P50_SLACK -v r99=$P99_RATIO -v s99=$P99_SLACK \
+		'BEGIN { print (rps < brps * (1 - drop) || p50 > bp50 * r50 + s50 || p99 > bp99 * r99 + s99) ? 1 : 0 }'
+}
+
+results=$(mktemp)
+unixSocket=/tmp/otpsuite.$$.sock
+ringSocket=/tmp/otpsuite.$$.ring
+trap 'rm -f "$results" $unixSocket $ringSocket; kill $daemon 2>/dev/null' EXIT
+failed=0
+errored=0
+
+printf "%-9s %-11s %10s %9s %9s %9s %7s\n" config workload "msgs/s" "MB/s" "p50 us" "p99 us" errors
+for config in "${configs[@]}"
+do
+	name=${config%%|*}
+	./otp_d ${config#*|} -U $unixSocket -R $ringSocket $port 2>/dev/null &
+	daemon=$!
+	sleep 0.5
+
+	for workload in "${workloads[@]}"
+	do
+		IFS='|' read load options target <<< "$workload"
+		case $target in
+			unix) target=$unixSocket ;;
+			ring) target=$ringSocket ;;
+			*) target=$port ;;
+		esac
+		line=$(./otpload $options -d $duration -w 0.5 -t $target)
+		rps=$(figure "$line" rps)
+		p50=$(figure "$line" p50_us)
+		p99=$(figure "$line" p99_us)
+		errors=$(figure "$line" errors)
+		echo "$name $load $rps $p50 $p99" >> "$results"
+
+		printf "%-9s %-11s %10s %9s %9s %9s %7s" $name $load $rps $(figure "$line" mbps) $p50 $p99 $errors
+		base=$(grep "^$name $load " "$baseline" 2>/dev/null)
+		if [ $update -eq 0 -a -n "$base" ]
+		then
+			set -- $base
+			printf "   (%s %s %s)" $3 $4 $5
+			if [ "$(regressed $rps $p50 $p99 $3 $4 $5)" = 1 ]
+			then
+				printf " REGRESSED"
+				failed=1
+			fi
+		fi
+
+		# Failed or dropped requests (or no figures at all) are a failure
+		# on every run, baseline or not
+		if [ "$errors" != 0 ]
+		then
+			printf " ERRORS"
+			errored=1
+		fi
+		printf "\n"
+	done
+
+	kill $daemon
+	wait $daemon 2>/dev/null
+done
+
+# Save a new baseline, or judge against the old one. Results with errors
+# are never saved, so a broken configuration cannot become the baseline.
+if [ $errored -eq 1 ]
+then
+	if [ $update -eq 1 ]
+	then
+		echo "FAIL: requests failed or were dropped; baseline not saved to $baseline"
+	elif [ $failed -eq 1 ]
+	then
+		echo "FAIL: requests failed or were dropped, and regressed against $baseline"
+	else
+		echo "FAIL: requests failed or were dropped"
+	fi
+	exit 1
+elif [ $update -eq 1 ]
+then
+	{ echo "# config workload msgs_per_s p50_us p99_us"; cat "$results"; } > "$baseline"
+	echo "saved baseline to $baseline"
+elif [ $failed -eq 1 ]
+then
+	echo "FAIL: regressed against $baseline"
+	exit 1
+else
+	echo "OK: no regressions against $baseline"
+fi
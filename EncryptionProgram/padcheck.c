@@ -0,0 +1,119 @@
+/*
+File: padcheck.c
+Author: Adeline Harcourt
+Description: A check of the key store cursor in otp_pad.c. It makes a
+		small pad in a scratch directory and opens it as a daemon would,
+		then makes sure that reservations a client could ask for which
+		do not fit (one so large the cursor would wrap, one past the end)
+		are turned away without using up any pad, that only chars handed
+		out can be decoded with, and that threads reserving all at once
+		are never handed the same char twice. Prints "padcheck: ok", or
+		what failed and exits with status 1.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "otp_server.h"
+
+#define PAD_CHARS 100000	// Pad size; large enough to save ahead more than once
+#define THREADS 8
+
+static struct ServerConfig config;
+static unsigned char *uses;	// Times each pad char was handed out
+static int failed;
+
+// The key store reports fatal errors through this, as the daemons do
+void error(const char *msg, int exitVal) {
+	fprintf(stderr, "ERROR: %s\n", msg);
+	exit(exitVal);
+}
+
+// Reports a failed check
+static void Check(int ok, const char *what) {
+	if (ok) return;
+	fprintf(stderr, "padcheck: %s\n", what);
+	failed = 1;
+}
+
+// Reserves pad in small pieces until it runs out, counting every char
+static void *Reserver(void *arg) {
+	uint64_t offset, n = 1 + (uintptr_t)arg % 7, i;
+
+	while (PadReserve(config.pad, n, &offset) == STATUS_OK) {
+		for (i = 0; i < n; i++) __atomic_fetch_add(&uses[offset + i], 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+int main(void) {
+	char dir[] = "/tmp/padcheckXXXXXX", path[64], cursorPath[80];
+	pthread_t threads[THREADS];
+	uint64_t offset, i, size;
+	FILE *padFile;
+	int status;
+
+	// A pad of capital letters, ending in a newline as keygen writes it
+	if (mkdtemp(dir) == NULL) error("could not make a scratch directory", 1);
+	snprintf(path, sizeof(path), "%s/pad", dir);
+	snprintf(cursorPath, sizeof(cursorPath), "%s.cursor", path);
+	padFile = fopen(path, "w");
+	if (padFile == NULL) error("could not write the pad", 1);
+	for (i = 0; i < PAD_CHARS; i++) fputc('A' + i % 26, padFile);
+	fputc('\n', padFile);
+	fclose(padFile);
+
+	memset(&config, '\0', sizeof(config));
+	config.name = "padcheck";
+	config.padPath = path;
+	OpenPad(&config);
+	size = PadSize(config.pad);
+	Check(size == PAD_CHARS, "pad size is wrong");
+
+	// A first message gets the start of the pad
+	status = PadReserve(config.pad, 10, &offset);
+	Check(status == STATUS_OK && offset == 0, "first reservation is not at 0");
+
+	// Reservations that would wrap the cursor or run past the end fail,
+	// and the next message still gets the chars right after the first
+	Check(PadReserve(config.pad, UINT64_MAX - 9, &offset) == STATUS_PAD_USED, "wrapping reservation accepted");
+	Check(PadReserve(config.pad, (uint64_t)1 << 40, &offset) == STATUS_PAD_USED, "reservation past the end accepted");
+	Check(PadReserve(config.pad, size, &offset) == STATUS_PAD_USED, "reservation of more than is left accepted");
+	status = PadReserve(config.pad, 10, &offset);
+	Check(status == STATUS_OK && offset == 10, "a failed reservation moved the cursor");
+
+	// Only chars handed out may be decoded with
+	Check(PadCheckIssued(config.pad, 0, 20) == STATUS_OK, "issued chars refused for decoding");
+	Check(PadCheckIssued(config.pad, 0, 21) == STATUS_BAD_PAD, "unissued chars allowed for decoding");
+	Check(PadCheckIssued(config.pad, UINT64_MAX, 2) == STATUS_BAD_PAD, "wrapping decode range allowed");
+
+	// Threads share out the rest, and no char goes to two of them
+	uses = calloc(size, 1);
+	if (uses == NULL) error("could not allocate", 1);
+	for (i = 0; i < THREADS; i++) pthread_create(&threads[i], NULL, Reserver, (void *)(uintptr_t)i);
+	for (i = 0; i < THREADS; i++) pthread_join(threads[i], NULL);
+	for (i = 20; i < size; i++) {
+		if (uses[i] > 1) {
+			Check(0, "a pad char was handed out twice");
+			break;
+		}
+	}
+
+	// With the pad used up (but for the odd chars no piece fitted) the
+	// cursor sits at or before the end, and a single char is still all
+	// that can be had
+	while (PadReserve(config.pad, 1, &offset) == STATUS_OK) uses[offset]++;
+	for (i = 20; i < size && uses[i] == 1; i++);
+	Check(i == size, "pad chars were skipped or handed out twice");
+	Check(PadReserve(config.pad, 1, &offset) == STATUS_PAD_USED, "reservation accepted from a used up pad");
+	Check(PadCheckIssued(config.pad, 0, size) == STATUS_OK, "used up pad refused for decoding");
+	Check(PadCheckIssued(config.pad, size, 1) == STATUS_BAD_PAD, "chars past the end allowed for decoding");
+
+	unlink(cursorPath);
+	unlink(path);
+	rmdir(dir);
+	if (failed) return 1;
+	printf("padcheck: ok\n");
+	return 0;
+}
@@ -0,0 +1,135 @@
+/*
+File: ringcheck.c
+Author: Adeline Harcourt
+Description: A check of the ring handshake in otp_ring.c, run against a
+		daemon started with a ring socket (-R). It offers the daemon a
+		plain file, a memfd that is not sealed and a memfd sealed against
+		shrinking, each laid out as a ring, and makes sure only the
+		sealed memfd is taken. A client could cut a plain file short
+		after the daemon mapped it, and the daemon would die of SIGBUS on
+		its next slot. Prints "ringcheck: ok", or what failed and exits
+		with status 1.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "otp_proto.h"
+
+#define RING_SIZE (RING_HEADER_SIZE + 4096)	// Header and a small data area
+
+static const char *ringPath;
+static int failed;
+
+// Reports a fatal error as the clients do
+static void error(const char *msg, int exitVal) {
+	fprintf(stderr, "ERROR: %s\n", msg);
+	exit(exitVal);
+}
+
+// Lays fd out as an empty ring
+static void MakeRing(int fd) {
+	struct RingHeader *header;
+
+	if (ftruncate(fd, RING_SIZE) < 0) error("could not size the ring", 1);
+	header = mmap(NULL, RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) error("could not map the ring", 1);
+	header->magic = RING_MAGIC;
+	header->dataSize = RING_SIZE - RING_HEADER_SIZE;
+	munmap(header, RING_SIZE);
+}
+
+// Sends the handshake with fd as the ring and checks the daemon's reply
+static void Offer(int fd, const char *expect, const char *what) {
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct sockaddr_un address;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char reply[3];
+	int socketFD, fds[3], charsRead = 0, tempChars;
+
+	socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&address, '\0', sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, ringPath, sizeof(address.sun_path) - 1);
+	if (socketFD < 0 || connect(socketFD, (struct sockaddr *)&address, sizeof(address)) < 0)
+		error("could not connect to the ring socket", 2);
+
+	fds[0] = fd;
+	fds[1] = eventfd(0, EFD_CLOEXEC);
+	fds[2] = eventfd(0, EFD_CLOEXEC);
+	memset(&msg, '\0', sizeof(msg));
+	iov.iov_base = (void *)ID_RING;
+	iov.iov_len = 3;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(socketFD, &msg, MSG_NOSIGNAL) != 3) error("could not send the handshake", 2);
+
+	memset(reply, '\0', sizeof(reply));
+	while (charsRead < 2) {
+		tempChars = recv(socketFD, &reply[charsRead], 2 - charsRead, 0);
+		if (tempChars <= 0) break;
+		charsRead += tempChars;
+	}
+	if (strcmp(reply, expect) != 0) {
+		fprintf(stderr, "ringcheck: %s got \"%s\", not %s\n", what, reply, expect);
+		failed = 1;
+	}
+
+	close(socketFD);
+	close(fds[1]);
+	close(fds[2]);
+	close(fd);
+}
+
+int main(int argc, char *argv[]) {
+	char path[] = "/tmp/ringcheckXXXXXX";
+	int fd;
+
+	if (argc != 2) {
+		fprintf(stderr, "USAGE: %s ringsocket\n", argv[0]);
+		exit(1);
+	}
+	ringPath = argv[1];
+
+	// A plain file has no seals at all
+	fd = mkstemp(path);
+	if (fd < 0) error("could not make a scratch file", 1);
+	unlink(path);
+	MakeRing(fd);
+	Offer(fd, "NO", "a plain file");
+
+	// Nor does a memfd that was never sealed
+	fd = memfd_create("ringcheck", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) error("could not create a memfd", 1);
+	MakeRing(fd);
+	Offer(fd, "NO", "an unsealed memfd");
+
+	// Sealed against shrinking, as otp_enc and otp_dec send it
+	fd = memfd_create("ringcheck", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) error("could not create a memfd", 1);
+	MakeRing(fd);
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) error("could not seal the memfd", 1);
+	Offer(fd, "OK", "a sealed memfd");
+
+	if (failed) return 1;
+	printf("ringcheck: ok\n");
+	return 0;
+}